@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <fmt/core.h>
+#include <string>
+
+#include "anomaly.h"
+
+namespace icmp_ns {
+
+std::string describe_anomaly(const anomaly_event & event)
+{
+    auto via = event.engine.empty() ? "" : " via " + event.engine;
+    auto direction = event.change.increase ? "up" : "down";
+    if (event.targets > 1)
+    {
+        return fmt::format("{}{}: {} targets {}, loss {:.1f}%", event.address, via, event.targets, event.change.increase ? "down" : "up", event.change.to * 100.0);
+    }
+    if (event.metric == anomaly_metric::loss)
+    {
+        return fmt::format("{}{}: loss {} from {:.1f}% to {:.1f}%", event.address, via, direction, event.change.from * 100.0, event.change.to * 100.0);
+    }
+    return fmt::format("{}{}: rtt {} from {:.3f} ms to {:.3f} ms", event.address, via, direction, event.change.from, event.change.to);
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+namespace icmp_ns {
+
+struct change_detector_options
+{
+    double alpha = 0.02;         // weight of a new sample in the baseline and in its mean deviation
+    double slack = 0.5;          // deviations below this many times the scale are not accumulated (the k of CUSUM)
+    double threshold = 8.0;      // the accumulated deviation, in units of the scale, that signals a change (the h of CUSUM)
+    double max_deviation = 2.5;  // one sample adds at most this many times the scale, so it takes several to signal a change
+    double min_scale = 0.0;      // the scale never drops below this, nor below relative_scale times the baseline,
+    double relative_scale = 0.0; // so a very steady series does not signal a change on a tiny step
+    uint32_t warmup = 16;        // samples that only train the baseline
+};
+
+// a shift of the level of a series, from the old baseline to the mean of the samples that signaled it
+struct level_change
+{
+    bool increase;
+    double from;
+    double to;
+};
+
+// detects a lasting step up or down in a series of samples with a two-sided CUSUM on top of an EWMA baseline.
+// every deviation from the baseline, in units of the baseline's mean deviation, is added to an upward and a downward sum
+// minus the slack; a sum that reaches the threshold signals a change and the new level becomes the baseline.
+// a deviation counts for at most max_deviation, so a short burst of outliers fades and a step of a few mean deviations
+// is signaled after a handful of samples (5 with the defaults). O(1) time and memory per sample.
+class change_detector
+{
+public:
+    [[nodiscard]] std::optional<level_change> add(double value, const change_detector_options & options)
+    {
+        if (m_samples < options.warmup)
+        {
+            // plain means until there is enough data for the ewma
+            m_baseline += static_cast<float>((value - m_baseline) / (m_samples + 1));
+            m_deviation += static_cast<float>((std::abs(value - m_baseline) - m_deviation) / (m_samples + 1));
+            ++m_samples;
+            return {};
+        }
+
+        auto scale = std::max({static_cast<double>(m_deviation), options.min_scale, options.relative_scale * std::abs(m_baseline)});
+        auto z = scale > 0.0 ? std::clamp((value - m_baseline) / scale, -options.max_deviation, options.max_deviation) : 0.0;
+        accumulate(m_up, z - options.slack, value, m_baseline);
+        accumulate(m_down, -z - options.slack, value, m_baseline);
+        m_deviation += static_cast<float>(options.alpha * (std::abs(value - m_baseline) - m_deviation));
+        m_baseline += static_cast<float>(options.alpha * (value - m_baseline));
+
+        if (m_up.sum <= options.threshold && m_down.sum <= options.threshold)
+        {
+            return {};
+        }
+        const auto & signaled = m_up.sum > options.threshold ? m_up : m_down;
+        level_change change{&signaled == &m_up, signaled.baseline, static_cast<double>(signaled.total) / signaled.count};
+        m_baseline = static_cast<float>(change.to);
+        m_up = {};
+        m_down = {};
+        return change;
+    }
+
+    [[nodiscard]] double baseline() const { return m_baseline; }
+
+private:
+    // a cusum with the mean of the samples since it last was zero, the estimate of the new level,
+    // and the baseline before that, which the samples of the run have moved since
+    struct run
+    {
+        float sum = 0.0f;
+        float total = 0.0f;
+        float baseline = 0.0f;
+        uint32_t count = 0;
+    };
+
+    static void accumulate(run & current, double step, double value, float baseline)
+    {
+        current.sum = static_cast<float>(std::max(0.0, current.sum + step));
+        if (current.sum == 0.0f)
+        {
+            current = {};
+            return;
+        }
+        if (current.count == 0)
+        {
+            current.baseline = baseline;
+        }
+        current.total += static_cast<float>(value);
+        ++current.count;
+    }
+
+    // float halves the size of the detectors, which every target has two of
+    float m_baseline = 0.0f;
+    float m_deviation = 0.0f;
+    run m_up;
+    run m_down;
+    uint32_t m_samples = 0;
+};
+
+enum class anomaly_metric : uint8_t
+{
+    rtt,
+    loss
+};
+
+// a change in the rtt or loss of a target, detected by the probe thread of an engine
+struct anomaly_event
+{
+    std::chrono::system_clock::time_point time;
+    std::string address;
+    std::string engine; // the name of the engine, see probe_engine::name()
+    anomaly_metric metric;
+    level_change change;
+    uint32_t targets; // 1, or the number of targets of a subnet that went down or came back together, the address is its prefix
+};
+
+// returns a readable description like "10.0.0.1 via eth0: rtt up from 0.210 ms to 5.310 ms",
+// or "10.3.17.0/26 via eth0: 40 targets down, loss 100.0%" for a subnet
+[[nodiscard]] std::string describe_anomaly(const anomaly_event & event);
+
+} // namespace icmp_ns
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "batch_ping.h"
+#include "icmp.h"
+#include "policies.h"
+#include "probe_loop.h"
+#include "tsc_clock.h"
+
+namespace icmp_ns {
+
+template <typename Backend, typename Clock, typename Stats>
+void run_probe_loop(const std::vector<std::string> & addresses, const std::vector<sockaddr_in> & targets, const batch_options & options)
+{
+    Backend backend;
+    probe_loop<Backend, Clock, Stats> loop(backend, targets);
+    auto start = std::chrono::steady_clock::now();
+    auto received = loop.run(options.rounds, options.interval, options.timeout);
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    fmt::print("{} backend, {} clock, {} stats: {} of {} replies in {:.3f}s\n", Backend::name, Clock::name, Stats::name, received,
+               targets.size() * options.rounds, elapsed);
+    for (size_t i = 0; i < targets.size(); ++i)
+    {
+        fmt::print("{}: {}\n", addresses[i], loop.stats()[i].describe());
+    }
+}
+
+template <typename Backend, typename Clock>
+void select_stats(const std::vector<std::string> & addresses, const std::vector<sockaddr_in> & targets, const batch_options & options)
+{
+    if (options.stats == summary_stats::name)
+    {
+        return run_probe_loop<Backend, Clock, summary_stats>(addresses, targets, options);
+    }
+    if (options.stats == histogram_stats::name)
+    {
+        return run_probe_loop<Backend, Clock, histogram_stats>(addresses, targets, options);
+    }
+    throw std::runtime_error(fmt::format("unknown statistics '{}', use summary or histogram", options.stats));
+}
+
+template <typename Backend>
+void select_clock(const std::vector<std::string> & addresses, const std::vector<sockaddr_in> & targets, const batch_options & options)
+{
+    if (options.clock == steady_clock_policy::name)
+    {
+        return select_stats<Backend, steady_clock_policy>(addresses, targets, options);
+    }
+    if (options.clock == kernel_clock_policy::name)
+    {
+        return select_stats<Backend, kernel_clock_policy>(addresses, targets, options);
+    }
+    if (options.clock == tsc_clock_policy::name)
+    {
+        if (!tsc_clock::initialize())
+        {
+            fmt::print("the time stamp counter is not invariant or not used by the kernel, using CLOCK_MONOTONIC instead.\n");
+        }
+        return select_stats<Backend, tsc_clock_policy>(addresses, targets, options);
+    }
+    throw std::runtime_error(fmt::format("unknown clock '{}', use steady, kernel or tsc", options.clock));
+}
+
+void run_batch_pings(const std::vector<std::string> & addresses, const batch_options & options)
+{
+    std::vector<sockaddr_in> targets;
+    targets.reserve(addresses.size());
+    for (const auto & address : addresses)
+    {
+        targets.push_back(resolve_address(address));
+    }
+
+    if (options.backend == raw_backend::name)
+    {
+        return select_clock<raw_backend>(addresses, targets, options);
+    }
+    if (options.backend == dgram_backend::name)
+    {
+        return select_clock<dgram_backend>(addresses, targets, options);
+    }
+    if (options.backend == simulated_backend::name)
+    {
+        return select_clock<simulated_backend>(addresses, targets, options);
+    }
+    throw std::runtime_error(fmt::format("unknown backend '{}', use raw, dgram or simulated", options.backend));
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace icmp_ns {
+
+struct batch_options
+{
+    std::string backend = "raw";   // raw, dgram or simulated, see policies.h
+    std::string clock = "steady";  // steady, kernel or tsc
+    std::string stats = "summary"; // summary or histogram
+    int rounds = 4;
+    std::chrono::milliseconds interval{1000};
+    std::chrono::milliseconds timeout{2500};
+};
+
+// pings every target once per round with a probe_loop built from the policies named in the options.
+// the combination is chosen here, once; the loop itself runs without any indirect calls.
+void run_batch_pings(const std::vector<std::string> & addresses, const batch_options & options);
+
+} // namespace icmp_ns
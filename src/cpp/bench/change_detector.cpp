@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+// the cost per sample of change_detector with the rtt options of the engine, and how well it finds steps: every
+// detector sees an rtt of 10 ms with lognormal jitter of 'sigma' (about 5% by default) that steps up by 2 ms and back
+// down every 'block' samples. the first change in the right direction within a block of a step finds it, with the samples since the step as its
+// delay, a change in the wrong direction or before the first step is a false alarm.
+//
+//   bench_change_detector [samples] [detectors] [block] [sigma]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <random>
+#include <vector>
+
+#include "anomaly.h"
+#include "engine.h"
+
+int main(int argc, char * argv[])
+{
+    using namespace icmp_ns;
+    size_t samples = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000000;
+    size_t detector_count = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 1000;
+    size_t block = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 500;
+    double sigma = argc > 4 ? std::atof(argv[4]) : 0.05;
+
+    const auto options = engine_options{}.rtt_changes;
+    std::mt19937 random(1);
+    std::lognormal_distribution<double> jitter(0.0, sigma);
+    std::vector<double> noise(1 << 20); // reused, the noise of a sample does not depend on its place
+    for (auto & value : noise)
+    {
+        value = jitter(random);
+    }
+
+    std::vector<change_detector> detectors(detector_count);
+    std::vector<uint32_t> found_in_block(detector_count, ~0u); // the block whose step the detector found
+    uint64_t steps = 0;
+    uint64_t found = 0;
+    uint64_t delay = 0;
+    uint64_t repeated = 0;
+    uint64_t false_alarms = 0;
+    size_t next_noise = 0;
+    auto rounds = samples / detector_count;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t sample = 0; sample < rounds; ++sample)
+    {
+        auto current_block = static_cast<uint32_t>(sample / block);
+        auto up = current_block % 2 == 1;
+        auto level = up ? 12.0 : 10.0;
+        steps += sample % block == 0 && sample > 0 ? detector_count : 0;
+        for (size_t detector = 0; detector < detector_count; ++detector)
+        {
+            auto rtt = level * noise[next_noise++ & (noise.size() - 1)];
+            if (auto change = detectors[detector].add(rtt, options))
+            {
+                if (current_block == 0 || change->increase != up)
+                {
+                    ++false_alarms;
+                }
+                else if (found_in_block[detector] == current_block)
+                {
+                    ++repeated;
+                }
+                else
+                {
+                    found_in_block[detector] = current_block;
+                    ++found;
+                    delay += sample % block;
+                }
+            }
+        }
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+    fmt::print("{} samples over {} detectors, sigma {}, a 2 ms step every {} samples of a detector:\n", samples, detector_count, sigma, block);
+    fmt::print("  {:.1f} ns per sample\n", elapsed / (rounds * detector_count));
+    fmt::print("  {} of {} steps found, {:.1f} samples after the step on average\n", found, steps, found > 0 ? static_cast<double>(delay) / found : 0.0);
+    fmt::print("  {} steps reported a second time, {} false alarms\n", repeated, false_alarms);
+    return 0;
+}
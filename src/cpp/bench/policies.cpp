@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+// compares probe_loop, built from template policies, with the same loop built from virtual interfaces and a
+// std::function callback. both use the simulated backend, the steady clock and the summary stats, so the difference
+// is the cost of the dispatch alone.
+//
+//   bench_policies [targets] [rounds] [repeats]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "policies.h"
+#include "probe_loop.h"
+
+namespace icmp_ns {
+
+struct backend_interface
+{
+    virtual ~backend_interface() = default;
+    virtual void send(const std::vector<outgoing_probe> & probes, int64_t now) = 0;
+    virtual void receive(int64_t timeout_ns, const std::function<void(uint16_t, in_addr, std::optional<int64_t>)> & on_reply) = 0;
+};
+
+struct clock_interface
+{
+    virtual ~clock_interface() = default;
+    virtual int64_t now() const = 0;
+    virtual int64_t receive_time(std::optional<int64_t> timestamp) const = 0;
+};
+
+struct stats_interface
+{
+    virtual ~stats_interface() = default;
+    virtual void add(int64_t rtt_ns) = 0;
+};
+
+template <typename Backend>
+struct backend_adapter : backend_interface
+{
+    void send(const std::vector<outgoing_probe> & probes, int64_t now) override { backend.send(probes, now); }
+    void receive(int64_t timeout_ns, const std::function<void(uint16_t, in_addr, std::optional<int64_t>)> & on_reply) override
+    {
+        backend.receive(timeout_ns, on_reply);
+    }
+    Backend backend;
+};
+
+template <typename Clock>
+struct clock_adapter : clock_interface
+{
+    int64_t now() const override { return Clock::now(); }
+    int64_t receive_time(std::optional<int64_t> timestamp) const override { return Clock::receive_time(timestamp); }
+};
+
+template <typename Stats>
+struct stats_adapter : stats_interface
+{
+    void add(int64_t rtt_ns) override { stats.add(rtt_ns); }
+    Stats stats;
+};
+
+// probe_loop::run() line by line, with every policy call going through an interface
+class virtual_probe_loop
+{
+public:
+    virtual_probe_loop(backend_interface & backend, const clock_interface & clock, const std::vector<sockaddr_in> & targets,
+                       std::function<std::unique_ptr<stats_interface>()> make_stats) :
+        m_backend(backend),
+        m_clock(clock),
+        m_targets(targets),
+        m_in_flight(65536)
+    {
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            m_stats.push_back(make_stats());
+        }
+        m_probes.reserve(targets.size());
+    }
+
+    uint64_t run(int rounds, std::chrono::nanoseconds timeout)
+    {
+        uint64_t received = 0;
+        for (int round = 0; round < rounds; ++round)
+        {
+            auto round_start = m_clock.now();
+            m_probes.clear();
+            for (uint32_t index = 0; index < m_targets.size(); ++index)
+            {
+                auto sequence = m_next_sequence++;
+                m_in_flight[sequence] = {round_start, index, true};
+                m_probes.push_back({&m_targets[index], sequence});
+            }
+            m_backend.send(m_probes, round_start);
+
+            size_t pending = m_probes.size();
+            auto deadline = round_start + timeout.count();
+            for (auto now = m_clock.now(); pending > 0 && now < deadline; now = m_clock.now())
+            {
+                m_backend.receive(deadline - now, [&](uint16_t sequence, in_addr source, std::optional<int64_t> timestamp) {
+                    auto & probe = m_in_flight[sequence];
+                    if (!probe.outstanding || m_targets[probe.target].sin_addr.s_addr != source.s_addr)
+                    {
+                        return;
+                    }
+                    probe.outstanding = false;
+                    m_stats[probe.target]->add(m_clock.receive_time(timestamp) - probe.sent);
+                    --pending;
+                    ++received;
+                });
+            }
+            for (const auto & probe : m_probes)
+            {
+                m_in_flight[probe.sequence].outstanding = false;
+            }
+        }
+        return received;
+    }
+
+private:
+    struct in_flight_probe
+    {
+        int64_t sent = 0;
+        uint32_t target = 0;
+        bool outstanding = false;
+    };
+
+    backend_interface & m_backend;
+    const clock_interface & m_clock;
+    const std::vector<sockaddr_in> & m_targets;
+    std::vector<std::unique_ptr<stats_interface>> m_stats;
+    std::vector<in_flight_probe> m_in_flight;
+    std::vector<outgoing_probe> m_probes;
+    uint16_t m_next_sequence = 0;
+};
+
+static double probes_per_second(uint64_t probes, std::chrono::steady_clock::time_point start)
+{
+    return static_cast<double>(probes) / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace icmp_ns
+
+int main(int argc, char * argv[])
+{
+    using namespace icmp_ns;
+    size_t target_count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 500;
+    int repeats = argc > 3 ? std::atoi(argv[3]) : 5;
+    const std::chrono::seconds timeout(10);
+
+    std::vector<sockaddr_in> targets(std::min<size_t>(target_count, 65536));
+    for (size_t i = 0; i < targets.size(); ++i)
+    {
+        targets[i].sin_family = AF_INET;
+        targets[i].sin_addr.s_addr = htonl(static_cast<uint32_t>(0x0a000000 + i));
+    }
+
+    // the best of every repeat, the two loops take turns so both see the same machine
+    double best_template = 0.0;
+    double best_virtual = 0.0;
+    for (int repeat = 0; repeat < repeats; ++repeat)
+    {
+        {
+            simulated_backend backend;
+            probe_loop<simulated_backend, steady_clock_policy, summary_stats> loop(backend, targets);
+            auto start = std::chrono::steady_clock::now();
+            auto received = loop.run(rounds, std::chrono::nanoseconds(0), timeout);
+            best_template = std::max(best_template, probes_per_second(received, start));
+        }
+        {
+            backend_adapter<simulated_backend> backend;
+            clock_adapter<steady_clock_policy> clock;
+            virtual_probe_loop loop(backend, clock, targets, [] { return std::make_unique<stats_adapter<summary_stats>>(); });
+            auto start = std::chrono::steady_clock::now();
+            auto received = loop.run(rounds, timeout);
+            best_virtual = std::max(best_virtual, probes_per_second(received, start));
+        }
+    }
+    fmt::print("{} targets x {} rounds, best of {}:\n", targets.size(), rounds, repeats);
+    fmt::print("  template policies:  {:.2f} M probes/s\n", best_template / 1e6);
+    fmt::print("  virtual interfaces: {:.2f} M probes/s\n", best_virtual / 1e6);
+    fmt::print("  the template loop is {:.0f}% faster\n", (best_template / best_virtual - 1.0) * 100.0);
+    return 0;
+}
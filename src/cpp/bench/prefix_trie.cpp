@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+// the memory, build time and update cost of prefix_trie for a large target set, once with the addresses packed into
+// 10.0.0.0/8 and once spread over the whole address space, and how close the summed srtt at the root stays to the
+// exact mean when small changes are not passed on.
+//
+//   bench_prefix_trie [targets] [samples]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "prefix_trie.h"
+
+namespace icmp_ns {
+
+static double milliseconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void run(const char * name, const std::vector<in_addr> & addresses, size_t samples)
+{
+    std::mt19937 random(1);
+    auto start = std::chrono::steady_clock::now();
+    prefix_trie trie(addresses);
+    auto build = milliseconds_since(start);
+
+    // every target answers with its own srtt of 1 to 50 ms, 1% of them lose half their probes
+    std::uniform_real_distribution<double> base_srtt(1.0, 50.0);
+    std::vector<double> base(addresses.size());
+    std::vector<double> srtt(addresses.size());
+    std::vector<bool> lossy(addresses.size());
+    for (size_t i = 0; i < addresses.size(); ++i)
+    {
+        base[i] = base_srtt(random);
+        srtt[i] = base[i];
+        lossy[i] = random() % 100 == 0;
+    }
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < addresses.size(); ++i)
+    {
+        if (trie.leaf(i) != prefix_trie::no_node) // a random address that came up twice
+        {
+            trie.set_leaf(trie.leaf(i), lossy[i] ? 0.5 : 0.0, srtt[i]);
+        }
+    }
+    trie.sum_up();
+    auto initialize = milliseconds_since(start);
+
+    // replies of random targets, with an rtt within 10% of the target's own, smoothed into the srtt like the engine does,
+    // and the loss of the lossy ones between 40 and 60%
+    std::vector<uint32_t> targets(samples);
+    std::vector<double> jitter(samples);
+    std::uniform_int_distribution<uint32_t> target(0, static_cast<uint32_t>(addresses.size() - 1));
+    std::uniform_real_distribution<double> step(0.9, 1.1);
+    for (size_t i = 0; i < samples; ++i)
+    {
+        targets[i] = target(random);
+        jitter[i] = step(random);
+    }
+    std::vector<uint32_t> recovered;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < samples; ++i)
+    {
+        auto index = targets[i];
+        if (trie.leaf(index) == prefix_trie::no_node)
+        {
+            continue;
+        }
+        auto & value = srtt[index];
+        value = 0.875 * value + 0.125 * base[index] * jitter[i];
+        trie.update(trie.leaf(index), lossy[index] ? 0.4 + 0.2 * (jitter[i] - 0.9) / 0.2 : 0.0, value, recovered);
+        recovered.clear();
+    }
+    auto update = milliseconds_since(start) * 1e6 / samples;
+
+    double exact = 0.0;
+    size_t leaves = 0;
+    for (size_t i = 0; i < srtt.size(); ++i)
+    {
+        if (trie.leaf(i) != prefix_trie::no_node)
+        {
+            exact += srtt[i];
+            ++leaves;
+        }
+    }
+    exact /= leaves;
+    auto root = trie.find(in_addr{0}, 0);
+
+    fmt::print("{}: {} targets\n", name, addresses.size());
+    fmt::print("  memory {:.1f} MB, {:.1f} bytes per target\n", trie.memory_usage() / 1e6, static_cast<double>(trie.memory_usage()) / addresses.size());
+    fmt::print("  build {:.0f} ms, set the leaves and sum up {:.0f} ms\n", build, initialize);
+    fmt::print("  update {:.0f} ns per sample\n", update);
+    fmt::print("  mean srtt at the root {:.4f} ms, exact {:.4f} ms\n", root ? root->srtt_ms : 0.0, exact);
+}
+
+} // namespace icmp_ns
+
+int main(int argc, char * argv[])
+{
+    using namespace icmp_ns;
+    size_t targets = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+    size_t samples = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10000000;
+
+    // distinct addresses: a random permutation of a part of 10.0.0.0/8, and random addresses anywhere
+    std::mt19937 random(2);
+    std::vector<in_addr> packed(targets);
+    std::vector<uint32_t> offsets(1u << 24);
+    for (uint32_t i = 0; i < offsets.size(); ++i)
+    {
+        offsets[i] = i;
+    }
+    std::shuffle(offsets.begin(), offsets.end(), random);
+    for (size_t i = 0; i < targets; ++i)
+    {
+        packed[i].s_addr = htonl(0x0a000000 + offsets[i % offsets.size()]);
+    }
+    std::vector<in_addr> spread(targets);
+    for (auto & address : spread)
+    {
+        address.s_addr = static_cast<uint32_t>(random());
+    }
+    run("10.0.0.0/8", packed, samples);
+    run("whole address space", spread, samples);
+    return 0;
+}
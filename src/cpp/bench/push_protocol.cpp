@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+// the size and the cost of the push datagrams for a push of every target, once with the addresses packed next to
+// each other and once spread over the whole address space. every target was probed 'probes' times in the interval,
+// answered all of them within one to three histogram buckets, except 1% that lost about half.
+//
+//   bench_push_protocol [targets] [probes] [repeats]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "push_protocol.h"
+
+namespace icmp_ns {
+
+static void run(const char * name, std::vector<uint32_t> addresses, uint64_t probes, int repeats)
+{
+    std::sort(addresses.begin(), addresses.end());
+    addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+
+    std::mt19937 random(1);
+    std::vector<push_record> records(addresses.size());
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        auto & record = records[i];
+        record.address = addresses[i];
+        record.sent = probes;
+        record.received = random() % 100 == 0 ? probes / 2 : probes;
+        record.lost = probes - record.received;
+        auto rtt_us = 1000 + random() % 49000;
+        record.rtt_total_us = rtt_us * record.received;
+        auto first = 8 + random() % 8;
+        auto width = 1 + random() % 3;
+        for (uint64_t reply = 0; reply < record.received; ++reply)
+        {
+            ++record.histogram[first + reply % width];
+        }
+    }
+
+    push_header header;
+    header.source = "probe-host:12345/eth0";
+    header.time_ms = 1700000000000;
+    header.interval_ms = 10000;
+
+    // the best of every repeat
+    std::vector<std::string> datagrams;
+    double encode_ns = 0.0;
+    double decode_ns = 0.0;
+    for (int repeat = 0; repeat < repeats; ++repeat)
+    {
+        datagrams.clear();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t next = 0; next < records.size();)
+        {
+            datagrams.emplace_back();
+            next = encode_push(header, records, next, max_push_datagram, datagrams.back());
+            ++header.sequence;
+        }
+        auto encode = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+        push_header decoded_header;
+        std::vector<push_record> decoded;
+        size_t decoded_records = 0;
+        start = std::chrono::steady_clock::now();
+        for (const auto & datagram : datagrams)
+        {
+            decode_push(datagram, decoded_header, decoded);
+            decoded_records += decoded.size();
+        }
+        auto decode = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (decoded_records != records.size())
+        {
+            fmt::print("decoded {} records of {}\n", decoded_records, records.size());
+            std::exit(1);
+        }
+        encode_ns = repeat == 0 ? encode : std::min(encode_ns, encode);
+        decode_ns = repeat == 0 ? decode : std::min(decode_ns, decode);
+    }
+
+    size_t bytes = 0;
+    for (const auto & datagram : datagrams)
+    {
+        bytes += datagram.size();
+    }
+    fmt::print("{}: {} targets, {} probes each\n", name, records.size(), probes);
+    fmt::print("  {} datagrams, {} bytes, {:.1f} bytes per target\n", datagrams.size(), bytes, static_cast<double>(bytes) / records.size());
+    fmt::print("  encode {:.0f} ns, decode {:.0f} ns per target\n", encode_ns / records.size(), decode_ns / records.size());
+}
+
+} // namespace icmp_ns
+
+int main(int argc, char * argv[])
+{
+    using namespace icmp_ns;
+    size_t targets = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 10000;
+    uint64_t probes = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 10;
+    int repeats = argc > 3 ? std::atoi(argv[3]) : 20;
+
+    std::vector<uint32_t> packed(targets);
+    for (size_t i = 0; i < targets; ++i)
+    {
+        packed[i] = static_cast<uint32_t>(0x0a000000 + i);
+    }
+    std::mt19937 random(2);
+    std::vector<uint32_t> spread(targets);
+    for (auto & address : spread)
+    {
+        address = static_cast<uint32_t>(random());
+    }
+    run("packed", packed, probes, repeats);
+    run("whole address space", spread, probes, repeats);
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+// the cost of a read of tsc_clock against std::chrono::steady_clock, and how far tsc_clock drifts from CLOCK_MONOTONIC
+// over a run that spans several recalibrations.
+//
+//   bench_tsc_clock [seconds]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <thread>
+#include <vector>
+
+#include "tsc_clock.h"
+
+namespace icmp_ns {
+
+// every reading is stored here, so the calls are not optimized away
+static volatile int64_t sink = 0;
+
+// the nanoseconds per call of 'now'
+template <typename F>
+static double cost_per_call(F && now)
+{
+    const int calls = 10000000;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < calls; ++i)
+    {
+        sink = now();
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+} // namespace icmp_ns
+
+int main(int argc, char * argv[])
+{
+    using namespace icmp_ns;
+    int seconds = argc > 1 ? std::atoi(argv[1]) : 5;
+    if (!tsc_clock::initialize())
+    {
+        fmt::print("the time stamp counter is not usable here, tsc_clock falls back to CLOCK_MONOTONIC.\n");
+    }
+
+    auto steady = cost_per_call([] { return std::chrono::steady_clock::now().time_since_epoch().count(); });
+    auto tsc = cost_per_call([] { return tsc_clock::now(); });
+    fmt::print("cost per read: steady_clock {:.1f} ns, tsc_clock {:.1f} ns\n", steady, tsc);
+
+    // the offset of a tsc_clock reading to the middle of the two CLOCK_MONOTONIC readings around it, about once per millisecond
+    std::vector<double> offsets;
+    auto end = monotonic_now() + seconds * 1000000000LL;
+    while (tsc_clock::enabled() && monotonic_now() < end)
+    {
+        auto before = monotonic_now();
+        auto reading = tsc_clock::now();
+        auto after = monotonic_now();
+        if (after - before > 1000)
+        {
+            continue; // interrupted between the readings, the offset would be noise
+        }
+        offsets.push_back(static_cast<double>(reading - (before + after) / 2));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (offsets.empty())
+    {
+        return 0;
+    }
+    std::vector<double> magnitudes;
+    for (auto offset : offsets)
+    {
+        magnitudes.push_back(std::abs(offset));
+    }
+    std::sort(magnitudes.begin(), magnitudes.end());
+    fmt::print("offset to CLOCK_MONOTONIC over {} s ({} readings): p50 {:.0f} ns, p99 {:.0f} ns, max {:.0f} ns{}\n", seconds, offsets.size(),
+               magnitudes[magnitudes.size() / 2], magnitudes[magnitudes.size() * 99 / 100], magnitudes.back(),
+               tsc_clock::enabled() ? "" : ", then the clock gave up on the counter");
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <netinet/ip_icmp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fmt/core.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "capacity.h"
+#include "icmp.h"
+#include "probe_table.h"
+
+namespace icmp_ns {
+
+static const int icmp_overhead = sizeof(ipv4_header) + sizeof(icmp_header);
+
+static std::string format_rate(double bits_per_second)
+{
+    if (bits_per_second >= 1e9)
+    {
+        return fmt::format("{:.2f} Gbit/s", bits_per_second / 1e9);
+    }
+    return fmt::format("{:.2f} Mbit/s", bits_per_second / 1e6);
+}
+
+// returns the value at quantile 'q' (0.0 - 1.0) of a sorted range
+static double quantile(const std::vector<double> & sorted, double q)
+{
+    auto index = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void estimate_capacity(const std::string & address, const capacity_options & options)
+{
+    // an echo request is at least the ip and icmp headers, and an ipv4 packet at most 65535 bytes
+    if (options.packet_size < icmp_overhead || options.packet_size > 65535)
+    {
+        throw std::runtime_error(fmt::format("packet size {} is not within {} to 65535 bytes", options.packet_size, icmp_overhead));
+    }
+    if (options.trains < 1)
+    {
+        throw std::runtime_error(fmt::format("invalid number of trains '{}'", options.trains));
+    }
+    if (options.train_length < 2)
+    {
+        throw std::runtime_error(fmt::format("invalid train length '{}', a train needs at least two packets", options.train_length));
+    }
+    icmp_socket socket(address);
+    socket.accept_replies_and_errors();
+    socket.set_mtu_discover(IP_PMTUDISC_DO);
+    socket.enable_receive_timestamps();
+    socket.set_receive_buffer_size(options.train_length * (options.packet_size + 1024));
+    const auto destination = socket.get_sockadd_in().sin_addr;
+    const double bits = options.packet_size * 8.0;
+
+    fmt::print("capacity to {}: {} trains of {} x {} bytes\n", address, options.trains, options.train_length, options.packet_size);
+    icmp_payload_template payload(options.packet_size - icmp_overhead);
+    probe_table probes;
+    std::vector<double> pair_estimates;
+    std::vector<double> train_estimates;
+    for (int train = 0; train < options.trains; ++train)
+    {
+        // the train is built up front and handed to the kernel in one sendmmsg() call,
+        // so the packets leave back-to-back at the rate of the local interface.
+        std::vector<icmp_header> headers;
+        std::vector<batch_packet> batch;
+        headers.reserve(options.train_length);
+        auto now = std::chrono::steady_clock::now();
+        for (int index = 0; index < options.train_length; ++index)
+        {
+            headers.push_back(payload.make_header(probes.add(index, destination, 0, now), payload.max_length()));
+            batch.push_back({&headers.back(), sizeof(icmp_header), 0, nullptr, payload.data(), payload.max_length()});
+        }
+        if (socket.send_batch(batch) < batch.size())
+        {
+            fmt::print("{} bytes is larger than the path mtu to {}, use a smaller --size.\n", options.packet_size, address);
+            return;
+        }
+
+        std::vector<std::optional<std::chrono::nanoseconds>> arrivals(options.train_length);
+        int pending = options.train_length;
+        auto deadline = now + options.timeout;
+        while (pending > 0)
+        {
+            auto reply = receive_probe_reply(socket, probes, deadline);
+            if (!reply)
+            {
+                break;
+            }
+            if (reply->message.type != ICMP_ECHOREPLY)
+            {
+                fmt::print("{} from {}.\n", describe_icmp_message(reply->message.type, reply->message.code), inet_ntoa(reply->message.source));
+                return;
+            }
+            arrivals[reply->sent_probe.target] = reply->received_timestamp;
+            --pending;
+        }
+
+        // only pairs that arrived in the order they were sent are used, a reordered or lost packet says nothing about the spacing
+        for (int index = 1; index < options.train_length; ++index)
+        {
+            if (arrivals[index] && arrivals[index - 1] && *arrivals[index] > *arrivals[index - 1])
+            {
+                std::chrono::duration<double> gap = *arrivals[index] - *arrivals[index - 1];
+                pair_estimates.push_back(bits / gap.count());
+            }
+        }
+        auto & first = arrivals.front();
+        auto & last = arrivals.back();
+        if (pending == 0 && first && last && *last > *first)
+        {
+            std::chrono::duration<double> spread = *last - *first;
+            train_estimates.push_back(bits * (options.train_length - 1) / spread.count());
+        }
+        std::this_thread::sleep_for(options.interval);
+    }
+
+    // cross traffic squeezes a pair together or pushes it apart, the median is robust against both
+    if (pair_estimates.empty())
+    {
+        fmt::print("  no usable packet pairs received.\n");
+        return;
+    }
+    std::sort(pair_estimates.begin(), pair_estimates.end());
+    fmt::print("  packet pairs: median {} (interquartile range {} - {}, {} pairs)\n", format_rate(quantile(pair_estimates, 0.5)),
+               format_rate(quantile(pair_estimates, 0.25)), format_rate(quantile(pair_estimates, 0.75)), pair_estimates.size());
+    if (!train_estimates.empty())
+    {
+        std::sort(train_estimates.begin(), train_estimates.end());
+        fmt::print("  packet trains: median {} ({} complete trains)\n", format_rate(quantile(train_estimates, 0.5)), train_estimates.size());
+    }
+}
+
+} // namespace icmp_ns
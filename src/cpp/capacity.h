@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+
+namespace icmp_ns {
+
+struct capacity_options
+{
+    int packet_size = 1500; // ip packet size of every echo request, the largest size that fits the path mtu gives the best estimate
+    int train_length = 8;
+    int trains = 20;
+    std::chrono::milliseconds interval{50}; // pause between trains, so the queues on the path drain
+    std::chrono::milliseconds timeout{2500};
+};
+
+// estimates the bottleneck capacity of the path to 'address'.
+// trains of large echo requests are sent back-to-back, the narrowest link on the path spreads them out and the replies
+// arrive with that spacing. the kernel receive timestamps of consecutive replies give one estimate per packet pair
+// (packet size / spacing) and one per train, the median of each is reported.
+void estimate_capacity(const std::string & address, const capacity_options & options);
+
+} // namespace icmp_ns
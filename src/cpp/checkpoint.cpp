@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fmt/core.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "checkpoint.h"
+#include "engine.h"
+
+namespace icmp_ns {
+
+static const char checkpoint_magic[8] = {'P', 'I', 'N', 'G', 'C', 'K', 'P', 'T'};
+const uint32_t checkpoint_version = 3;
+
+struct checkpoint_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // detects a file written by a build with a different record layout
+    uint64_t count;
+    uint32_t next_slot;
+    uint32_t reserved;
+};
+
+struct checkpoint_record
+{
+    char address[64]; // zero terminated
+    char group[64];   // zero terminated, empty for none
+    in_addr resolved;
+    uint32_t reserved;
+    int64_t interval_ms;
+    int64_t timeout_ms;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t lost;
+    uint64_t errors;
+    double last_ms;
+    double srtt_ms;
+    double rttvar_ms;
+    double rtt_total_ms;
+    uint64_t histogram[rtt_histogram_buckets];
+};
+
+static_assert(std::is_trivially_copyable_v<checkpoint_header> && std::is_trivially_copyable_v<checkpoint_record>,
+              "checkpoint records are copied to and from the mapped file as raw bytes");
+static_assert(sizeof(checkpoint_header) % alignof(checkpoint_record) == 0, "the records after the header must be aligned");
+
+// a file mapped into memory, unmapped and closed when it goes out of scope
+class mapped_file
+{
+public:
+    mapped_file(const std::string & path, int flags, size_t size) :
+        m_path(path)
+    {
+        m_fd = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+        {
+            throw std::runtime_error(fmt::format("could not open checkpoint '{}': {}", path, std::strerror(errno)));
+        }
+        bool writable = (flags & O_ACCMODE) != O_RDONLY;
+        if (writable && ::ftruncate(m_fd, size) != 0)
+        {
+            fail("could not resize");
+        }
+        if (!writable)
+        {
+            struct stat status{};
+            if (::fstat(m_fd, &status) != 0)
+            {
+                fail("could not read");
+            }
+            size = status.st_size;
+        }
+        m_size = size;
+        if (m_size == 0)
+        {
+            return;
+        }
+        m_data = ::mmap(nullptr, m_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, m_fd, 0);
+        if (m_data == MAP_FAILED)
+        {
+            m_data = nullptr;
+            fail("could not map");
+        }
+        // restoring reads every record once, front to back
+        ::madvise(m_data, m_size, MADV_SEQUENTIAL);
+    }
+
+    ~mapped_file()
+    {
+        if (m_data != nullptr)
+        {
+            ::munmap(m_data, m_size);
+        }
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+        }
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file & operator=(const mapped_file &) = delete;
+
+    void sync()
+    {
+        if ((m_data != nullptr && ::msync(m_data, m_size, MS_SYNC) != 0) || ::fsync(m_fd) != 0)
+        {
+            fail("could not write");
+        }
+    }
+
+    [[nodiscard]] char * data() const { return static_cast<char *>(m_data); }
+    [[nodiscard]] size_t size() const { return m_size; }
+
+private:
+    // a constructor that throws does not run the destructor, so the mapping and the descriptor are released here.
+    // both are reset, so a fail() from sync() does not release them again in the destructor.
+    [[noreturn]] void fail(const char * what)
+    {
+        auto error = errno;
+        if (m_data != nullptr)
+        {
+            ::munmap(m_data, m_size);
+            m_data = nullptr;
+        }
+        ::close(m_fd);
+        m_fd = -1;
+        throw std::runtime_error(fmt::format("{} checkpoint '{}': {}", what, m_path, std::strerror(error)));
+    }
+
+    std::string m_path;
+    int m_fd = -1;
+    void * m_data = nullptr;
+    size_t m_size = 0;
+};
+
+std::string checkpoint_path(const std::string & path, const probe_engine & engine)
+{
+    return engine.name().empty() ? path : path + "." + engine.name();
+}
+
+size_t write_checkpoint(const std::string & path, const probe_engine & engine)
+{
+    auto targets = engine.targets();
+    auto temporary = path + ".tmp";
+    size_t written = 0;
+    {
+        mapped_file file(temporary, O_RDWR | O_CREAT | O_TRUNC, sizeof(checkpoint_header) + targets->targets.size() * sizeof(checkpoint_record));
+        auto * records = reinterpret_cast<checkpoint_record *>(file.data() + sizeof(checkpoint_header));
+        for (const auto & target : targets->targets)
+        {
+            if (target->address.size() >= sizeof(checkpoint_record::address) || target->group.size() >= sizeof(checkpoint_record::group))
+            {
+                continue;
+            }
+            // the statistics are read like a snapshot, without the copy of the address
+            auto & record = records[written++];
+            std::memcpy(record.address, target->address.c_str(), target->address.size() + 1);
+            std::memcpy(record.group, target->group.c_str(), target->group.size() + 1);
+            record.resolved = target->sockaddr.sin_addr;
+            record.interval_ms = target->interval_ms.load(std::memory_order_relaxed);
+            record.timeout_ms = target->timeout_ms.load(std::memory_order_relaxed);
+            record.sent = target->sent.load(std::memory_order_relaxed);
+            record.received = target->received.load(std::memory_order_relaxed);
+            record.lost = target->lost.load(std::memory_order_relaxed);
+            record.errors = target->errors.load(std::memory_order_relaxed);
+            record.last_ms = target->last_ms.load(std::memory_order_relaxed);
+            record.srtt_ms = target->srtt_ms.load(std::memory_order_relaxed);
+            record.rttvar_ms = target->rttvar_ms.load(std::memory_order_relaxed);
+            record.rtt_total_ms = target->rtt_total_ms.load(std::memory_order_relaxed);
+            for (size_t bucket = 0; bucket < rtt_histogram_buckets; ++bucket)
+            {
+                record.histogram[bucket] = target->histogram[bucket].load(std::memory_order_relaxed);
+            }
+        }
+
+        checkpoint_header header{};
+        std::memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+        header.version = checkpoint_version;
+        header.record_size = sizeof(checkpoint_record);
+        header.count = written;
+        header.next_slot = engine.next_slot();
+        std::memcpy(file.data(), &header, sizeof(header));
+        file.sync();
+    }
+    // skipped targets leave unused records at the end, they are cut off here
+    if (::truncate(temporary.c_str(), sizeof(checkpoint_header) + written * sizeof(checkpoint_record)) != 0 ||
+        ::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        throw std::runtime_error(fmt::format("could not replace checkpoint '{}': {}", path, std::strerror(errno)));
+    }
+    return written;
+}
+
+size_t restore_checkpoint(const std::string & path, probe_engine & engine)
+{
+    if (::access(path.c_str(), F_OK) != 0)
+    {
+        return 0;
+    }
+    mapped_file file(path, O_RDONLY, 0);
+    checkpoint_header header{};
+    if (file.size() < sizeof(header))
+    {
+        throw std::runtime_error(fmt::format("checkpoint '{}' is truncated", path));
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 || header.version != checkpoint_version ||
+        header.record_size != sizeof(checkpoint_record))
+    {
+        throw std::runtime_error(fmt::format("'{}' is not a checkpoint of this version", path));
+    }
+    // a division, a count from a damaged file can overflow the size of its records
+    if ((file.size() - sizeof(header)) % sizeof(checkpoint_record) != 0 || header.count != (file.size() - sizeof(header)) / sizeof(checkpoint_record))
+    {
+        throw std::runtime_error(fmt::format("checkpoint '{}' is truncated", path));
+    }
+
+    std::vector<std::shared_ptr<engine_target>> targets;
+    targets.reserve(header.count);
+    const auto * records = reinterpret_cast<const checkpoint_record *>(file.data() + sizeof(header));
+    for (size_t i = 0; i < header.count; ++i)
+    {
+        const auto & record = records[i];
+        if (record.interval_ms < min_target_interval.count())
+        {
+            throw std::runtime_error(fmt::format("checkpoint '{}' has an invalid interval of {} ms for target {}", path, record.interval_ms, i));
+        }
+        sockaddr_in resolved{};
+        resolved.sin_family = AF_INET;
+        resolved.sin_addr = record.resolved;
+        auto target = std::make_shared<engine_target>(std::string(record.address, strnlen(record.address, sizeof(record.address))), resolved,
+                                                      std::chrono::milliseconds(record.interval_ms),
+                                                      std::string(record.group, strnlen(record.group, sizeof(record.group))));
+        target->timeout_ms = record.timeout_ms;
+        target->sent = record.sent;
+        target->received = record.received;
+        target->lost = record.lost;
+        target->errors = record.errors;
+        target->last_ms = record.last_ms;
+        target->srtt_ms = record.srtt_ms;
+        target->rttvar_ms = record.rttvar_ms;
+        target->rtt_total_ms = record.rtt_total_ms;
+        for (size_t bucket = 0; bucket < rtt_histogram_buckets; ++bucket)
+        {
+            target->histogram[bucket] = record.histogram[bucket];
+        }
+        targets.push_back(std::move(target));
+    }
+    engine.publish(make_target_set(std::move(targets)));
+    engine.set_next_slot(header.next_slot);
+    return header.count;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "engine.h"
+
+namespace icmp_ns {
+
+// a checkpoint is a header followed by one fixed-size record per target, so the file is mapped and read in place.
+// it keeps everything a warm engine has learned: counters, srtt, rttvar, the adaptive timeout, the rtt histogram,
+// the resolved address and the id and sequence counter.
+
+// the checkpoint file of an engine: 'path' itself, or 'path.<name>' for an engine bound to an interface or source address
+[[nodiscard]] std::string checkpoint_path(const std::string & path, const probe_engine & engine);
+
+// writes the state of every target to a temporary file next to 'path' and renames it over 'path',
+// so a crash during a checkpoint leaves the previous one intact. the probe thread keeps running.
+// returns the number of targets written, addresses and groups longer than a record can hold are skipped.
+size_t write_checkpoint(const std::string & path, const probe_engine & engine);
+
+// publishes the targets of a checkpoint with their state, before the engine is started.
+// returns the number of targets restored; a missing file restores nothing, a damaged file throws.
+size_t restore_checkpoint(const std::string & path, probe_engine & engine);
+
+} // namespace icmp_ns
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <docopt.h>
+#include <fmt/core.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "push_protocol.h"
+
+namespace icmp_ns {
+
+static volatile std::sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+// a target as measured by all the sources together
+struct merged_target
+{
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    uint64_t errors = 0;
+    uint64_t rtt_total_us = 0;
+    std::array<uint64_t, push_histogram_buckets> histogram{};
+
+    // the upper bound of the histogram bucket that holds the percentile, in ms
+    [[nodiscard]] double percentile(double fraction) const
+    {
+        uint64_t total = 0;
+        for (auto count : histogram)
+        {
+            total += count;
+        }
+        auto rank = static_cast<uint64_t>(std::ceil(fraction * total));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < push_histogram_buckets; ++bucket)
+        {
+            seen += histogram[bucket];
+            if (seen >= rank && histogram[bucket] > 0)
+            {
+                return static_cast<double>(1ull << bucket) / 1000.0;
+            }
+        }
+        return 0.0;
+    }
+};
+
+struct source_state
+{
+    uint64_t next_sequence = 0;
+    uint64_t datagrams = 0;
+    uint64_t lost_datagrams = 0; // gaps in the sequence
+};
+
+// the running totals of the collector, and of the current report interval
+struct collector_totals
+{
+    uint64_t datagrams = 0;
+    uint64_t lost_datagrams = 0;
+    uint64_t malformed = 0;
+    uint64_t bytes = 0;
+    uint64_t records = 0; // one per target per interval of a source
+};
+
+class collector
+{
+public:
+    explicit collector(const std::string & listen) :
+        m_listen(listen)
+    {
+        auto address = parse_push_address(listen);
+        m_fd = ::socket(address.address.ss_family, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (m_fd < 0)
+        {
+            throw std::runtime_error(fmt::format("could not create collector socket: {}", std::strerror(errno)));
+        }
+        if (address.address.ss_family == AF_UNIX)
+        {
+            ::unlink(listen.c_str()); // a socket file left behind by a collector that was killed
+        }
+        // hundreds of sources push at about the same moment, so the receive buffer takes a burst of them
+        int buffer_size = 8 << 20;
+        ::setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        if (::bind(m_fd, reinterpret_cast<const sockaddr *>(&address.address), address.length) != 0)
+        {
+            auto error = errno;
+            ::close(m_fd);
+            throw std::runtime_error(fmt::format("could not listen on '{}': {}", listen, std::strerror(error)));
+        }
+        m_unix = address.address.ss_family == AF_UNIX;
+    }
+
+    ~collector()
+    {
+        ::close(m_fd);
+        if (m_unix)
+        {
+            ::unlink(m_listen.c_str());
+        }
+    }
+
+    collector(const collector &) = delete;
+    collector & operator=(const collector &) = delete;
+
+    void run(std::chrono::seconds report_interval, size_t top)
+    {
+        struct sigaction action{};
+        action.sa_handler = request_stop;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+
+        fmt::print("collecting on {}.\n", m_listen);
+        auto next_report = std::chrono::steady_clock::now() + report_interval;
+        while (stop_requested == 0)
+        {
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next_report - std::chrono::steady_clock::now()).count();
+            pollfd fd{m_fd, POLLIN, 0};
+            if (::poll(&fd, 1, static_cast<int>(std::max<int64_t>(wait, 0))) > 0)
+            {
+                receive();
+            }
+            if (std::chrono::steady_clock::now() >= next_report)
+            {
+                report(top);
+                next_report += report_interval;
+            }
+        }
+        print_targets();
+    }
+
+private:
+    void receive()
+    {
+        // the datagrams that are queued, the poll() of run() is not woken up for every single one
+        std::vector<char> buffer(65536);
+        for (ssize_t size; (size = ::recv(m_fd, buffer.data(), buffer.size(), 0)) >= 0;)
+        {
+            ++m_interval.datagrams;
+            m_interval.bytes += size;
+            try
+            {
+                decode_push(std::string_view(buffer.data(), size), m_header, m_records);
+            }
+            catch (const std::exception &)
+            {
+                ++m_interval.malformed;
+                continue;
+            }
+            merge();
+        }
+    }
+
+    void merge()
+    {
+        auto & source = m_sources[m_header.source];
+        if (source.datagrams > 0 && m_header.sequence > source.next_sequence)
+        {
+            source.lost_datagrams += m_header.sequence - source.next_sequence;
+            m_interval.lost_datagrams += m_header.sequence - source.next_sequence;
+        }
+        // a source that restarted begins at 0 again
+        source.next_sequence = m_header.sequence + 1;
+        ++source.datagrams;
+        m_interval.records += m_records.size();
+
+        for (const auto & record : m_records)
+        {
+            auto & target = m_targets[record.address];
+            target.sent += record.sent;
+            target.received += record.received;
+            target.lost += record.lost;
+            target.errors += record.errors;
+            target.rtt_total_us += record.rtt_total_us;
+            for (size_t bucket = 0; bucket < push_histogram_buckets; ++bucket)
+            {
+                target.histogram[bucket] += record.histogram[bucket];
+            }
+        }
+    }
+
+    void report(size_t top)
+    {
+        auto & interval = m_interval;
+        fmt::print("{} sources, {} targets: {} datagrams, {} lost, {} malformed, {} bytes, {} target intervals, {:.1f} bytes per target interval.\n",
+                   m_sources.size(), m_targets.size(), interval.datagrams, interval.lost_datagrams, interval.malformed, interval.bytes, interval.records,
+                   interval.records > 0 ? static_cast<double>(interval.bytes) / interval.records : 0.0);
+        m_total.datagrams += interval.datagrams;
+        m_total.lost_datagrams += interval.lost_datagrams;
+        m_total.malformed += interval.malformed;
+        m_total.bytes += interval.bytes;
+        m_total.records += interval.records;
+        interval = {};
+
+        if (top == 0)
+        {
+            return;
+        }
+        std::vector<std::pair<double, uint32_t>> worst;
+        for (const auto & [address, target] : m_targets)
+        {
+            worst.emplace_back(target.sent > 0 ? 100.0 * (target.lost + target.errors) / target.sent : 0.0, address);
+        }
+        auto count = std::min(top, worst.size());
+        std::partial_sort(worst.begin(), worst.begin() + count, worst.end(), [](const auto & a, const auto & b) { return a.first > b.first; });
+        for (size_t i = 0; i < count; ++i)
+        {
+            fmt::print("  {}", format_target(worst[i].second, m_targets[worst[i].second]));
+        }
+    }
+
+    static std::string format_target(uint32_t address, const merged_target & target)
+    {
+        in_addr network{htonl(address)};
+        auto loss = target.sent > 0 ? 100.0 * (target.lost + target.errors) / target.sent : 0.0;
+        auto mean = target.received > 0 ? target.rtt_total_us / 1000.0 / target.received : 0.0;
+        return fmt::format("{} sent {} received {} lost {} errors {} loss {:.1f}% mean {:.3f} p50 {:.3f} p99 {:.3f} ms\n", inet_ntoa(network),
+                           target.sent, target.received, target.lost, target.errors, loss, mean, target.percentile(0.5), target.percentile(0.99));
+    }
+
+    void print_targets()
+    {
+        std::map<uint32_t, const merged_target *> sorted;
+        for (const auto & [address, target] : m_targets)
+        {
+            sorted.emplace(address, &target);
+        }
+        for (const auto & [address, target] : sorted)
+        {
+            fmt::print("{}", format_target(address, *target));
+        }
+        for (const auto & [name, source] : m_sources)
+        {
+            fmt::print("source {}: {} datagrams, {} lost.\n", name, source.datagrams, source.lost_datagrams);
+        }
+        fmt::print("{} datagrams, {} lost, {} malformed, {} bytes in total.\n", m_total.datagrams + m_interval.datagrams,
+                   m_total.lost_datagrams + m_interval.lost_datagrams, m_total.malformed + m_interval.malformed, m_total.bytes + m_interval.bytes);
+    }
+
+    std::string m_listen;
+    int m_fd = -1;
+    bool m_unix = false;
+    push_header m_header;
+    std::vector<push_record> m_records;
+    std::map<std::string, source_state> m_sources;
+    std::unordered_map<uint32_t, merged_target> m_targets;
+    collector_totals m_interval;
+    collector_totals m_total;
+};
+
+} // namespace icmp_ns
+
+static const char usage[] = R"(collector - merge the statistics that ping daemons push with --push.
+
+Usage:
+  collector [options]
+  collector -h | --help
+
+Options:
+  -h, --help           Show this screen.
+  --listen=<address>   Unix datagram socket path, or host:port for udp [default: /tmp/ping-collector.sock].
+  --report=<s>         Time between two summaries of what was received [default: 10].
+  --top=<n>            List the <n> targets with the highest loss with every summary [default: 0].
+)";
+
+int main(int argc, char * argv[])
+{
+    auto arguments = docopt::docopt(usage, {argv + 1, argv + argc}, true, "collector 1.2");
+    try
+    {
+        auto report_interval = std::chrono::seconds(arguments["--report"].asLong());
+        if (report_interval <= std::chrono::seconds(0))
+        {
+            throw std::runtime_error("the --report interval must be at least 1 s");
+        }
+        icmp_ns::collector collector(arguments["--listen"].asString());
+        collector.run(report_interval, arguments["--top"].asLong());
+    }
+    catch (const std::exception & e)
+    {
+        fmt::print("error: {}\n", e.what());
+        return -1;
+    }
+    return 0;
+}
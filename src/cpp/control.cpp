@@ -0,0 +1,800 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fmt/core.h>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "checkpoint.h"
+#include "control.h"
+#include "engine.h"
+#include "groups.h"
+#include "icmp_ids.h"
+#include "network.h"
+#include "target_list.h"
+#include "worst.h"
+
+namespace icmp_ns {
+
+static volatile std::sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+static sockaddr_un make_unix_address(const std::string & path)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error(fmt::format("control socket path '{}' is too long", path));
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return address;
+}
+
+static void write_all(int fd, const std::string & data)
+{
+    size_t written = 0;
+    while (written < data.size())
+    {
+        auto result = ::send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+        if (result <= 0)
+        {
+            return; // the client went away, its connection is closed when the next read fails
+        }
+        written += result;
+    }
+}
+
+static std::string format_interface(const network_interface & interface)
+{
+    std::string addresses;
+    for (const auto & address : interface.addresses)
+    {
+        addresses += fmt::format(" {}", inet_ntoa(address));
+    }
+    return fmt::format("{} {} {}{}{} mtu {}{}\n", interface.index, interface.name, (interface.flags & IFF_UP) != 0 ? "up" : "down",
+                       (interface.flags & IFF_RUNNING) != 0 ? " running" : "", interface.physical ? " physical" : "", interface.mtu, addresses);
+}
+
+static std::string format_snapshot(const target_snapshot & snapshot, const probe_engine & engine)
+{
+    auto loss = snapshot.sent > 0 ? 100.0 * (snapshot.lost + snapshot.errors) / snapshot.sent : 0.0;
+    return fmt::format("{}{}{} sent {} received {} lost {} errors {} loss {:.1f}% last {:.3f} srtt {:.3f} rttvar {:.3f} timeout {} ms\n",
+                       snapshot.address, snapshot.group.empty() ? "" : " group " + snapshot.group, engine.name().empty() ? "" : " via " + engine.name(), snapshot.sent, snapshot.received, snapshot.lost, snapshot.errors, loss, snapshot.last_ms, snapshot.srtt_ms,
+                       snapshot.rttvar_ms, snapshot.timeout.count());
+}
+
+static std::string format_group(const group_snapshot & group, const probe_engine & engine)
+{
+    auto samples = group.replies + group.losses;
+    auto loss = samples > 0 ? 100.0 * group.losses / samples : 0.0;
+    auto mean = group.replies > 0 ? group.rtt_total_ms / group.replies : 0.0;
+    return fmt::format("{}{} targets {} up {} down {} replies {} losses {} loss {:.1f}% mean {:.3f} p50 {:.3f} p99 {:.3f} ms\n", group.path,
+                       engine.name().empty() ? "" : " via " + engine.name(), group.targets, group.targets - group.down, group.down, group.replies,
+                       group.losses, loss, mean, group.percentile(0.5), group.percentile(0.99));
+}
+
+// the totals of the groups in the text format of prometheus, one series per group and engine
+static std::string format_metrics(const std::vector<std::pair<group_snapshot, const probe_engine *>> & groups)
+{
+    auto labels = [](const group_snapshot & group, const probe_engine & engine) {
+        return engine.name().empty() ? fmt::format("group=\"{}\"", group.path) : fmt::format("group=\"{}\",engine=\"{}\"", group.path, engine.name());
+    };
+    std::string result;
+    auto family = [&](const char * name, const char * type, const char * help, auto value) {
+        result += fmt::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+        for (const auto & [group, engine] : groups)
+        {
+            result += fmt::format("{}{{{}}} {}\n", name, labels(group, *engine), value(group));
+        }
+    };
+    family("ping_group_targets", "gauge", "Targets in the group and the groups below it.", [](const group_snapshot & group) { return group.targets; });
+    family("ping_group_down", "gauge", "Targets with a recent loss of 50% or more.", [](const group_snapshot & group) { return group.down; });
+    family("ping_group_replies_total", "counter", "Echo replies received.", [](const group_snapshot & group) { return group.replies; });
+    family("ping_group_losses_total", "counter", "Probes lost or answered with an icmp error.", [](const group_snapshot & group) { return group.losses; });
+
+    // the last bucket of the histogram holds everything above the others, it is the +Inf bucket
+    const char * name = "ping_group_rtt_seconds";
+    result += fmt::format("# HELP {} Round trip times of the echo replies.\n# TYPE {} histogram\n", name, name);
+    for (const auto & [group, engine] : groups)
+    {
+        auto group_labels = labels(group, *engine);
+        uint64_t count = 0;
+        for (size_t bucket = 0; bucket + 1 < rtt_histogram_buckets; ++bucket)
+        {
+            count += group.histogram[bucket];
+            result += fmt::format("{}_bucket{{{},le=\"{}\"}} {}\n", name, group_labels, (1ull << bucket) / 1e6, count);
+        }
+        count += group.histogram[rtt_histogram_buckets - 1];
+        result += fmt::format("{}_bucket{{{},le=\"+Inf\"}} {}\n", name, group_labels, count);
+        result += fmt::format("{}_sum{{{}}} {}\n{}_count{{{}}} {}\n", name, group_labels, group.rtt_total_ms / 1000.0, name, group_labels, count);
+    }
+    return result;
+}
+
+control_server::control_server(const std::string & path, std::vector<std::unique_ptr<probe_engine>> & engines, std::chrono::milliseconds default_interval) :
+    m_path(path),
+    m_engines(engines),
+    m_default_interval(default_interval)
+{
+    auto address = make_unix_address(path);
+    m_listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0)
+    {
+        throw std::runtime_error(fmt::format("could not create control socket: {}", std::strerror(errno)));
+    }
+    ::unlink(path.c_str()); // a socket file left behind by a daemon that was killed
+    if (::bind(m_listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(m_listen_fd, 16) != 0)
+    {
+        auto error = errno;
+        ::close(m_listen_fd);
+        throw std::runtime_error(fmt::format("could not listen on control socket '{}': {}", path, std::strerror(error)));
+    }
+}
+
+control_server::~control_server()
+{
+    if (m_inotify_fd >= 0)
+    {
+        ::close(m_inotify_fd);
+    }
+    ::close(m_listen_fd);
+    ::unlink(m_path.c_str());
+}
+
+void control_server::watch_target_file(const std::string & path)
+{
+    m_target_file = path;
+    auto response = reload();
+    fmt::print("{}", response);
+    if (response.rfind("error:", 0) == 0)
+    {
+        throw std::runtime_error(fmt::format("could not load target file '{}'", path));
+    }
+
+    // editors and deployment tools often replace the file instead of writing it, so watch the directory for both
+    auto slash = path.rfind('/');
+    auto directory = slash == std::string::npos ? std::string(".") : path.substr(0, std::max<size_t>(slash, 1));
+    m_inotify_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify_fd < 0 || ::inotify_add_watch(m_inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        throw std::runtime_error(fmt::format("could not watch '{}': {}", directory, std::strerror(errno)));
+    }
+}
+
+std::string control_server::reload()
+{
+    if (m_target_file.empty())
+    {
+        return "error: no target file is watched\n";
+    }
+    try
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto specs = read_target_file(m_target_file, m_default_interval);
+        if (m_shard_agent != nullptr)
+        {
+            specs.erase(std::remove_if(specs.begin(), specs.end(), [&](const target_spec & spec) { return !m_shard_agent->owns(m_shard_agent->shard_of(spec.address)); }),
+                        specs.end());
+        }
+        reload_result result;
+        for (auto & engine : m_engines)
+        {
+            result = apply_target_list(*engine, specs); // every engine probes the same targets, so the results are the same
+        }
+        auto duration = std::chrono::duration_cast<double_milliseconds>(std::chrono::steady_clock::now() - start);
+        return fmt::format("reloaded {}: {} added, {} removed, {} changed, {} unchanged in {:.1f}ms\nok\n", m_target_file, result.added, result.removed,
+                           result.changed, result.unchanged, duration.count());
+    }
+    catch (const std::exception & e)
+    {
+        // a broken file leaves the current targets in place
+        return fmt::format("error: {}\n", e.what());
+    }
+}
+
+void control_server::checkpoint_every(const std::string & path, std::chrono::seconds interval)
+{
+    m_checkpoint_file = path;
+    m_checkpoint_interval = interval;
+}
+
+std::string control_server::checkpoint()
+{
+    if (m_checkpoint_file.empty())
+    {
+        return "error: no checkpoint file is configured\n";
+    }
+    try
+    {
+        std::string response;
+        for (const auto & engine : m_engines)
+        {
+            auto start = std::chrono::steady_clock::now();
+            auto path = checkpoint_path(m_checkpoint_file, *engine);
+            auto written = write_checkpoint(path, *engine);
+            auto duration = std::chrono::duration_cast<double_milliseconds>(std::chrono::steady_clock::now() - start);
+            response += fmt::format("checkpoint of {} targets written to {} in {:.1f}ms\n", written, path, duration.count());
+        }
+        return response + "ok\n";
+    }
+    catch (const std::exception & e)
+    {
+        return fmt::format("error: {}\n", e.what());
+    }
+}
+
+void control_server::push_every(const std::string & destination, std::chrono::seconds interval)
+{
+    m_pusher = std::make_unique<stats_pusher>(destination);
+    m_pusher->seed(m_engines);
+    m_push_interval = interval;
+}
+
+void control_server::shard_with(shard_agent & agent)
+{
+    m_shard_agent = &agent;
+    m_shard_agent->heartbeat(0);
+}
+
+void control_server::run()
+{
+    struct sigaction action{};
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    std::map<int, std::string> clients; // connection to the part of a line received so far
+    auto file_name = m_target_file.substr(m_target_file.rfind('/') + 1);
+    auto next_checkpoint = std::chrono::steady_clock::now() + m_checkpoint_interval;
+    auto next_heartbeat = std::chrono::steady_clock::now();
+    auto next_push = std::chrono::steady_clock::now() + m_push_interval;
+    sync_with_interfaces();
+    while (!m_shutdown && stop_requested == 0)
+    {
+        if (m_pusher && std::chrono::steady_clock::now() >= next_push)
+        {
+            try
+            {
+                m_pusher->push(m_engines);
+            }
+            catch (const std::exception & e)
+            {
+                fmt::print("error: {}\n", e.what());
+            }
+            next_push += m_push_interval;
+        }
+        if (m_shard_agent != nullptr && std::chrono::steady_clock::now() >= next_heartbeat)
+        {
+            if (m_shard_agent->heartbeat(m_engines.front()->targets()->targets.size()))
+            {
+                fmt::print("agent {} owns {} of {} shards.\n", m_shard_agent->slot(), m_shard_agent->owned(), m_shard_agent->shards());
+                fmt::print("{}", reload());
+            }
+            next_heartbeat = std::chrono::steady_clock::now() + m_shard_agent->heartbeat_interval();
+        }
+        if (!m_checkpoint_file.empty() && std::chrono::steady_clock::now() >= next_checkpoint)
+        {
+            auto response = checkpoint();
+            if (response.rfind("error:", 0) == 0)
+            {
+                fmt::print("{}", response);
+            }
+            next_checkpoint += m_checkpoint_interval;
+        }
+
+        std::vector<pollfd> fds{{m_listen_fd, POLLIN, 0}, {m_inotify_fd, POLLIN, 0}, {m_network_monitor.get_fd(), POLLIN, 0}};
+        auto engine_count = m_engines.size(); // the interface changes below can add engines that have no entry in fds
+        for (const auto & engine : m_engines)
+        {
+            fds.push_back({engine->anomaly_fd(), POLLIN, 0});
+        }
+        auto first_client = fds.size();
+        for (const auto & client : clients)
+        {
+            fds.push_back({client.first, POLLIN, 0});
+        }
+        if (::poll(fds.data(), fds.size(), 500) <= 0)
+        {
+            continue; // timeout or a signal, check the stop conditions
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            auto fd = ::accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0)
+            {
+                clients[fd];
+            }
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            bool changed = false;
+            alignas(inotify_event) char events[4096];
+            for (ssize_t length; (length = ::read(m_inotify_fd, events, sizeof(events))) > 0;)
+            {
+                for (ssize_t offset = 0; offset < length;)
+                {
+                    const auto * event = reinterpret_cast<const inotify_event *>(events + offset);
+                    if (event->len > 0 && file_name == event->name)
+                    {
+                        changed = true;
+                    }
+                    offset += sizeof(inotify_event) + event->len;
+                }
+            }
+            if (changed)
+            {
+                fmt::print("{}", reload());
+            }
+        }
+        if (fds[2].revents & POLLIN)
+        {
+            auto changes = m_network_monitor.read_changes();
+            for (const auto & change : changes)
+            {
+                fmt::print("{}.\n", describe_network_change(change));
+            }
+            if (m_network_monitor.take_overflow())
+            {
+                fmt::print("interface notifications were dropped, reading all interfaces.\n");
+                sync_with_interfaces();
+            }
+            else if (!changes.empty())
+            {
+                sync_with_interfaces();
+            }
+        }
+        for (size_t i = 0; i < engine_count; ++i)
+        {
+            if (fds[3 + i].revents & POLLIN)
+            {
+                for (const auto & event : m_engines[i]->take_anomalies())
+                {
+                    fmt::print("{}.\n", describe_anomaly(event));
+                }
+            }
+        }
+        for (size_t i = first_client; i < fds.size(); ++i)
+        {
+            if (fds[i].revents == 0)
+            {
+                continue;
+            }
+            auto fd = fds[i].fd;
+            char buffer[4096];
+            auto received = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (received <= 0)
+            {
+                ::close(fd);
+                clients.erase(fd);
+                continue;
+            }
+            auto & pending = clients[fd];
+            pending.append(buffer, received);
+            for (auto end = pending.find('\n'); end != std::string::npos; end = pending.find('\n'))
+            {
+                write_all(fd, execute(pending.substr(0, end)));
+                pending.erase(0, end + 1);
+            }
+        }
+    }
+    for (const auto & client : clients)
+    {
+        ::close(client.first);
+    }
+    if (m_pusher)
+    {
+        // the growth since the last push, a restart restores the totals from the checkpoint below and does not push them again
+        try
+        {
+            m_pusher->push(m_engines);
+        }
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+        }
+    }
+    if (!m_checkpoint_file.empty())
+    {
+        fmt::print("{}", checkpoint());
+    }
+}
+
+// the state after a change is read from a new dump rather than pieced together from the notifications, which may
+// have been dropped. changes are rare, and a dump takes a millisecond or so.
+void control_server::sync_with_interfaces()
+{
+    std::vector<network_interface> interfaces;
+    try
+    {
+        interfaces = get_network_interfaces();
+    }
+    catch (const std::exception & e)
+    {
+        fmt::print("error: {}\n", e.what());
+        return;
+    }
+
+    // an engine that follows the routing table can always probe, the others need their interface up and their address on it
+    auto usable = [&](const engine_options & options) {
+        if (options.device.empty() && !options.source)
+        {
+            return true;
+        }
+        for (const auto & interface : interfaces)
+        {
+            if ((interface.flags & IFF_UP) == 0 || (interface.flags & IFF_RUNNING) == 0 || (!options.device.empty() && interface.name != options.device))
+            {
+                continue;
+            }
+            if (!options.source || std::any_of(interface.addresses.begin(), interface.addresses.end(),
+                                               [&](in_addr address) { return address.s_addr == options.source->s_addr; }))
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+    for (auto & engine : m_engines)
+    {
+        auto paused = !usable(engine->options());
+        if (paused != engine->paused())
+        {
+            engine->set_paused(paused);
+            fmt::print("{} probing through {}.\n", paused ? "paused" : "resumed", engine->name());
+        }
+    }
+    if (!m_follow_physical || m_engines.empty())
+    {
+        return;
+    }
+
+    // a new card gets an engine for every source address the daemon probes from
+    std::vector<std::optional<in_addr>> sources;
+    for (const auto & engine : m_engines)
+    {
+        const auto & source = engine->options().source;
+        if (std::none_of(sources.begin(), sources.end(), [&](const std::optional<in_addr> & known) {
+                return known.has_value() == source.has_value() && (!source || known->s_addr == source->s_addr);
+            }))
+        {
+            sources.push_back(source);
+        }
+    }
+    for (const auto & interface : interfaces)
+    {
+        if (!interface.physical ||
+            std::any_of(m_engines.begin(), m_engines.end(), [&](const std::unique_ptr<probe_engine> & engine) { return engine->options().device == interface.name; }))
+        {
+            continue;
+        }
+        for (const auto & source : sources)
+        {
+            try
+            {
+                auto options = m_engines.front()->options();
+                options.device = interface.name;
+                options.source = source;
+                options.first_id = claim_icmp_ids(options.id_count);
+                auto engine = std::make_unique<probe_engine>(options);
+                std::vector<std::shared_ptr<engine_target>> targets;
+                for (const auto & target : m_engines.front()->targets()->targets)
+                {
+                    targets.push_back(std::make_shared<engine_target>(target->address, target->sockaddr, target->interval(), target->group));
+                }
+                engine->publish(make_target_set(std::move(targets)));
+                engine->set_paused(!usable(options));
+                engine->start();
+                fmt::print("probing {} targets through {}, a new interface.\n", engine->targets()->targets.size(), engine->name());
+                m_engines.push_back(std::move(engine));
+            }
+            catch (const std::exception & e)
+            {
+                fmt::print("error: could not probe through {}: {}\n", interface.name, e.what());
+            }
+        }
+    }
+}
+
+std::string control_server::execute(const std::string & line)
+{
+    std::istringstream input(line);
+    std::string command;
+    std::vector<std::string> arguments;
+    input >> command;
+    for (std::string argument; input >> argument;)
+    {
+        arguments.push_back(argument);
+    }
+
+    try
+    {
+        // every engine probes the same targets through its own interface, so changes go to all of them
+        if (command == "add" && !arguments.empty() && arguments.size() <= 3)
+        {
+            // the arguments are a line of a target file
+            auto spec = parse_target_list(line.substr(line.find(command) + command.size()), m_default_interval).front();
+            bool added = false;
+            for (auto & engine : m_engines)
+            {
+                added = engine->add_target(spec.address, spec.interval, spec.group) || added;
+            }
+            return added ? "ok\n" : fmt::format("error: {} is already probed\n", arguments[0]);
+        }
+        if (command == "remove" && arguments.size() == 1)
+        {
+            bool removed = false;
+            for (auto & engine : m_engines)
+            {
+                removed = engine->remove_target(arguments[0]) || removed;
+            }
+            return removed ? "ok\n" : fmt::format("error: {} is not probed\n", arguments[0]);
+        }
+        if (command == "interval" && arguments.size() == 2)
+        {
+            // the interval is an atomic of the shared target, so no new set has to be published
+            int64_t interval = 0;
+            const auto & text = arguments[1];
+            auto [last, error] = std::from_chars(text.data(), text.data() + text.size(), interval);
+            if (error != std::errc() || last != text.data() + text.size() || interval < min_target_interval.count())
+            {
+                return fmt::format("error: invalid interval '{}', the shortest is {} ms\n", arguments[1], min_target_interval.count());
+            }
+            bool found = false;
+            for (auto & engine : m_engines)
+            {
+                auto targets = engine->targets();
+                for (const auto & target : targets->targets)
+                {
+                    if (arguments[0] == "*" || target->address == arguments[0])
+                    {
+                        target->interval_ms = interval;
+                        found = true;
+                    }
+                }
+            }
+            return found || arguments[0] == "*" ? "ok\n" : fmt::format("error: {} is not probed\n", arguments[0]);
+        }
+        if (command == "list" && arguments.empty())
+        {
+            std::string response;
+            for (const auto & target : m_engines.front()->targets()->targets)
+            {
+                response += target->group.empty() ? fmt::format("{} {} ms\n", target->address, target->interval().count())
+                                                  : fmt::format("{} {} ms {}\n", target->address, target->interval().count(), target->group);
+            }
+            return response + "ok\n";
+        }
+        if (command == "stats" && arguments.size() <= 1)
+        {
+            std::string response;
+            for (const auto & engine : m_engines)
+            {
+                auto targets = engine->targets();
+                for (const auto & target : targets->targets)
+                {
+                    if (arguments.empty() || target->address == arguments[0])
+                    {
+                        response += format_snapshot(target->snapshot(), *engine);
+                    }
+                }
+            }
+            if (response.empty() && !arguments.empty())
+            {
+                return fmt::format("error: {} is not probed\n", arguments[0]);
+            }
+            return response + "ok\n";
+        }
+        if (command == "histogram" && arguments.size() == 1)
+        {
+            std::string response;
+            for (const auto & engine : m_engines)
+            {
+                auto target = engine->targets()->find(arguments[0]);
+                if (!target)
+                {
+                    return fmt::format("error: {} is not probed\n", arguments[0]);
+                }
+                auto snapshot = target->snapshot();
+                if (!engine->name().empty())
+                {
+                    response += fmt::format("via {}\n", engine->name());
+                }
+                for (size_t bucket = 0; bucket < rtt_histogram_buckets; ++bucket)
+                {
+                    if (snapshot.histogram[bucket] > 0)
+                    {
+                        response += fmt::format("< {} us {}\n", 1ull << bucket, snapshot.histogram[bucket]);
+                    }
+                }
+            }
+            return response + "ok\n";
+        }
+        if (command == "worst" && (arguments.size() == 1 || arguments.size() == 2) && (arguments[0] == "loss" || arguments[0] == "p99"))
+        {
+            // every engine keeps its own ranking, the short lists are merged here
+            auto metric = arguments[0] == "loss" ? worst_metric::loss : worst_metric::p99;
+            auto count = arguments.size() == 2 ? std::stoul(arguments[1]) : 10;
+            std::vector<std::pair<worst_target, const probe_engine *>> worst;
+            for (const auto & engine : m_engines)
+            {
+                for (auto & target : engine->worst(metric, count))
+                {
+                    worst.emplace_back(std::move(target), engine.get());
+                }
+            }
+            std::stable_sort(worst.begin(), worst.end(), [](const auto & a, const auto & b) { return a.first.score > b.first.score; });
+            worst.resize(std::min(worst.size(), count));
+            std::string response;
+            for (const auto & [target, engine] : worst)
+            {
+                auto via = engine->name().empty() ? "" : " via " + engine->name();
+                response += metric == worst_metric::loss ? fmt::format("{}{} loss {:.1f}%\n", target.address, via, target.score)
+                                                         : fmt::format("{}{} p99 {:.3f} ms\n", target.address, via, target.score);
+            }
+            return response + "ok\n";
+        }
+        if (command == "subnet" && arguments.size() <= 1)
+        {
+            auto prefix = arguments.empty() ? std::string("0.0.0.0/0") : arguments[0];
+            auto slash = prefix.find('/');
+            in_addr address{};
+            auto length = slash == std::string::npos ? 32 : std::stoi(prefix.substr(slash + 1));
+            if (inet_aton(prefix.substr(0, slash).c_str(), &address) == 0 || length < 0 || length > 32)
+            {
+                return fmt::format("error: {} is not an ipv4 prefix\n", prefix);
+            }
+            std::string response;
+            for (const auto & engine : m_engines)
+            {
+                if (auto subnet = engine->subnet(address, static_cast<uint8_t>(length)))
+                {
+                    response += fmt::format("{}{} targets {} down {} answering {} loss {:.1f}% srtt {:.3f} ms\n", subnet->prefix,
+                                            engine->name().empty() ? "" : " via " + engine->name(), subnet->targets, subnet->down, subnet->answering,
+                                            subnet->loss * 100.0, subnet->srtt_ms);
+                }
+            }
+            if (response.empty())
+            {
+                return fmt::format("error: no targets in {}\n", prefix);
+            }
+            return response + "ok\n";
+        }
+        if ((command == "groups" && arguments.size() <= 1) || (command == "metrics" && arguments.empty()))
+        {
+            std::vector<std::pair<group_snapshot, const probe_engine *>> groups;
+            for (const auto & engine : m_engines)
+            {
+                if (auto tree = engine->groups())
+                {
+                    for (auto & group : tree->snapshot(arguments.empty() ? std::string_view() : std::string_view(arguments[0])))
+                    {
+                        groups.emplace_back(std::move(group), engine.get());
+                    }
+                }
+            }
+            if (command == "metrics")
+            {
+                return format_metrics(groups) + "ok\n";
+            }
+            if (groups.empty() && !arguments.empty())
+            {
+                return fmt::format("error: no group {}\n", arguments[0]);
+            }
+            std::string response;
+            for (const auto & [group, engine] : groups)
+            {
+                response += format_group(group, *engine);
+            }
+            return response + "ok\n";
+        }
+        if (command == "interfaces" && arguments.empty())
+        {
+            std::string response;
+            for (const auto & interface : get_network_interfaces())
+            {
+                response += format_interface(interface);
+            }
+            return response + "ok\n";
+        }
+        if (command == "shards" && arguments.empty())
+        {
+            if (m_shard_agent == nullptr)
+            {
+                return "error: this daemon is not sharded\n";
+            }
+            std::string response;
+            for (const auto & agent : m_shard_agent->status())
+            {
+                response += fmt::format("agent {} pid {}{} shards {} targets {} heartbeat {} ms ago{}\n", agent.slot, agent.pid,
+                                        agent.slot == m_shard_agent->slot() ? " (this one)" : "", agent.shards, agent.targets,
+                                        agent.heartbeat_age.count(), agent.alive ? "" : ", dead");
+            }
+            return response + "ok\n";
+        }
+        if (command == "checkpoint" && arguments.empty())
+        {
+            return checkpoint();
+        }
+        if (command == "reload" && arguments.empty())
+        {
+            return reload();
+        }
+        if (command == "shutdown" && arguments.empty())
+        {
+            m_shutdown = true;
+            return "ok\n";
+        }
+    }
+    catch (const std::exception & e)
+    {
+        return fmt::format("error: {}\n", e.what());
+    }
+    return fmt::format("error: unknown command '{}'\n", line);
+}
+
+std::string send_control_command(const std::string & path, const std::string & command)
+{
+    auto address = make_unix_address(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        auto error = errno;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        throw std::runtime_error(fmt::format("could not connect to control socket '{}': {}", path, std::strerror(error)));
+    }
+    write_all(fd, command + "\n");
+
+    // the response ends with the line that starts with 'ok' or 'error:'
+    std::string response;
+    char buffer[4096];
+    while (true)
+    {
+        auto received = ::recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0)
+        {
+            break;
+        }
+        response.append(buffer, received);
+        auto last_line = response.rfind('\n', response.size() - 2);
+        last_line = last_line == std::string::npos ? 0 : last_line + 1;
+        if (response.back() == '\n' && (response.compare(last_line, 2, "ok") == 0 || response.compare(last_line, 6, "error:") == 0))
+        {
+            break;
+        }
+    }
+    ::close(fd);
+    return response;
+}
+
+} // namespace icmp_ns
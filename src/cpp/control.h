@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "engine.h"
+#include "network.h"
+#include "push.h"
+#include "shard.h"
+
+namespace icmp_ns {
+
+// serves the control protocol of a running daemon on a unix domain socket. every request is one line, every response is
+// zero or more lines followed by a line with 'ok' or 'error: <reason>'. the commands are:
+//   add <address> [<interval-ms>] [<group>]
+//                                   start probing a target, in a group like dc1/row3/rack7
+//   remove <address>                stop probing a target, its statistics are dropped
+//   interval <address>|* <ms>       change the interval of one or all targets
+//   list                            one line with the address, interval and group per target
+//   stats [<address>]               a statistics snapshot of one or all targets
+//   histogram <address>             the rtt histogram of a target
+//   worst loss|p99 [<count>]        the targets with the highest recent loss or p99, 10 by default
+//   subnet [<address>[/<length>]]   the loss and srtt of the targets within a prefix, all targets by default
+//   groups [<path>]                 the totals of a group and the groups below it, all groups by default
+//   metrics                         the totals of all groups in the text format of prometheus
+//   reload                          re-read the watched target file, see watch_target_file()
+//   checkpoint                      write a checkpoint now, see checkpoint_every()
+//   interfaces                      the network interfaces with their flags, mtu and addresses
+//   shards                          the agents of the shard block with their shards and targets, see shard_with()
+//   shutdown                        stop the daemon
+// there is one engine per interface that is probed through, commands apply to all of them while they keep probing.
+// the server follows the rtnetlink notifications: an engine is paused while its interface is down or its source address
+// is gone, and resumes when it is back.
+class control_server
+{
+public:
+    control_server(const std::string & path, std::vector<std::unique_ptr<probe_engine>> & engines, std::chrono::milliseconds default_interval);
+    ~control_server();
+    control_server(const control_server &) = delete;
+    control_server & operator=(const control_server &) = delete;
+
+    // applies the target list in 'path' now, and again whenever the file is written or replaced while run() serves clients
+    void watch_target_file(const std::string & path);
+
+    // writes a checkpoint to 'path' every 'interval' while run() serves clients, and once more when it returns
+    void checkpoint_every(const std::string & path, std::chrono::seconds interval);
+
+    // pushes what changed in the statistics of every target to the collector at 'destination' every 'interval' while run()
+    // serves clients, see stats_pusher
+    void push_every(const std::string & destination, std::chrono::seconds interval);
+
+    // probes only the targets of the watched file in the shards that 'agent' owns. its heartbeat is written and the shards
+    // are balanced with the other agents while run() serves clients, the targets are reloaded when they change hands.
+    void shard_with(shard_agent & agent);
+
+    // starts engines for the physical network cards that appear while run() serves clients, one per source address,
+    // with the targets of the first engine
+    void follow_physical_interfaces() { m_follow_physical = true; }
+
+    // serves clients until a shutdown command, SIGINT or SIGTERM
+    void run();
+
+    // executes one command line and returns the complete response
+    [[nodiscard]] std::string execute(const std::string & line);
+
+private:
+    [[nodiscard]] std::string reload();
+    [[nodiscard]] std::string checkpoint();
+    void sync_with_interfaces();
+
+    std::string m_path;
+    std::vector<std::unique_ptr<probe_engine>> & m_engines;
+    std::chrono::milliseconds m_default_interval;
+    int m_listen_fd = -1;
+    std::string m_target_file;
+    int m_inotify_fd = -1;
+    std::string m_checkpoint_file;
+    std::chrono::seconds m_checkpoint_interval{0};
+    shard_agent * m_shard_agent = nullptr;
+    std::unique_ptr<stats_pusher> m_pusher;
+    std::chrono::seconds m_push_interval{0};
+    network_monitor m_network_monitor;
+    bool m_follow_physical = false;
+    bool m_shutdown = false;
+};
+
+// connects to the control socket of a daemon, sends one command and returns the response
+[[nodiscard]] std::string send_control_command(const std::string & path, const std::string & command);
+
+} // namespace icmp_ns
@@ -0,0 +1,835 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <arpa/inet.h>
+#include <netinet/ip_icmp.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fmt/core.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "anomaly.h"
+#include "engine.h"
+#include "groups.h"
+#include "icmp.h"
+#include "prefix_trie.h"
+#include "worst.h"
+
+namespace icmp_ns {
+
+// new targets start at a random point of their interval, so a large list does not send all its probes in the same tick
+static std::chrono::steady_clock::time_point first_probe(std::chrono::milliseconds interval)
+{
+    thread_local std::mt19937 random(std::random_device{}());
+    std::uniform_int_distribution<int64_t> offset(0, std::max<int64_t>(interval.count() - 1, 0));
+    return std::chrono::steady_clock::now() + std::chrono::milliseconds(offset(random));
+}
+
+// when the probe thread next has to look at a target, see probe_engine::m_schedule
+static std::chrono::steady_clock::time_point next_event(const engine_target & target)
+{
+    if (!target.outstanding)
+    {
+        return target.next_probe;
+    }
+    return std::min(target.next_probe, target.probe_sent + std::chrono::milliseconds(target.timeout_ms.load(std::memory_order_relaxed)));
+}
+
+size_t rtt_histogram_bucket(double milliseconds)
+{
+    auto microseconds = static_cast<uint64_t>(milliseconds * 1000.0);
+    size_t bucket = 0;
+    while (microseconds > 0 && bucket < rtt_histogram_buckets - 1)
+    {
+        microseconds >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+// the srtt of a target that replied at least once
+static std::optional<double> answered_srtt(const engine_target & target)
+{
+    if (target.received.load(std::memory_order_relaxed) == 0)
+    {
+        return {};
+    }
+    return target.srtt_ms.load(std::memory_order_relaxed);
+}
+
+// whether the set holds this very target, and not another one with the same address
+static bool contains(const target_set & targets, const engine_target & target)
+{
+    auto position = targets.position(target.address);
+    return position && targets.targets[*position].get() == &target;
+}
+
+engine_target::engine_target(std::string target_address, std::chrono::milliseconds target_interval, std::string target_group) :
+    address(std::move(target_address)),
+    sockaddr(resolve_address(address)),
+    group(std::move(target_group)),
+    interval_ms(target_interval.count()),
+    next_probe(first_probe(target_interval))
+{
+}
+
+engine_target::engine_target(std::string target_address, const sockaddr_in & resolved, std::chrono::milliseconds target_interval, std::string target_group) :
+    address(std::move(target_address)),
+    sockaddr(resolved),
+    group(std::move(target_group)),
+    interval_ms(target_interval.count()),
+    next_probe(first_probe(target_interval))
+{
+}
+
+target_snapshot engine_target::snapshot() const
+{
+    target_snapshot result;
+    result.address = address;
+    result.group = group;
+    result.interval = interval();
+    result.sent = sent.load(std::memory_order_relaxed);
+    result.received = received.load(std::memory_order_relaxed);
+    result.lost = lost.load(std::memory_order_relaxed);
+    result.errors = errors.load(std::memory_order_relaxed);
+    result.last_ms = last_ms.load(std::memory_order_relaxed);
+    result.srtt_ms = srtt_ms.load(std::memory_order_relaxed);
+    result.rttvar_ms = rttvar_ms.load(std::memory_order_relaxed);
+    result.rtt_total_ms = rtt_total_ms.load(std::memory_order_relaxed);
+    result.timeout = std::chrono::milliseconds(timeout_ms.load(std::memory_order_relaxed));
+    for (size_t i = 0; i < rtt_histogram_buckets; ++i)
+    {
+        result.histogram[i] = histogram[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+static uint64_t index_slot_count(size_t targets)
+{
+    uint64_t slots = 16;
+    while (slots < targets * 2)
+    {
+        slots *= 2;
+    }
+    return slots;
+}
+
+std::optional<size_t> target_set::position(std::string_view address) const
+{
+    auto hash = std::hash<std::string_view>{}(address);
+    auto tag = hash >> 32;
+    auto mask = index.size() - 1;
+    for (auto slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        auto entry = index[slot];
+        if (entry == 0)
+        {
+            return {};
+        }
+        auto position = (entry & 0xffffffff) - 1;
+        if ((entry >> 32) == tag && targets[position]->address == address)
+        {
+            return position;
+        }
+    }
+}
+
+std::shared_ptr<engine_target> target_set::find(std::string_view address) const
+{
+    auto found = position(address);
+    return found ? targets[*found] : nullptr;
+}
+
+std::shared_ptr<const target_set> make_target_set(std::vector<std::shared_ptr<engine_target>> targets)
+{
+    auto result = std::make_shared<target_set>();
+    result->targets.reserve(targets.size());
+    result->index.assign(index_slot_count(targets.size()), 0);
+    auto mask = result->index.size() - 1;
+    for (auto & target : targets)
+    {
+        auto hash = std::hash<std::string_view>{}(target->address);
+        auto slot = hash & mask;
+        bool duplicate = false;
+        for (; result->index[slot] != 0; slot = (slot + 1) & mask)
+        {
+            auto entry = result->index[slot];
+            if ((entry >> 32) == (hash >> 32) && result->targets[(entry & 0xffffffff) - 1]->address == target->address)
+            {
+                duplicate = true;
+                break;
+            }
+        }
+        if (!duplicate)
+        {
+            result->index[slot] = (hash >> 32) << 32 | (result->targets.size() + 1);
+            result->targets.push_back(std::move(target));
+        }
+    }
+    return result;
+}
+
+probe_engine::probe_engine(const engine_options & options) :
+    m_options(options),
+    m_in_flight(static_cast<size_t>(std::max<uint16_t>(options.id_count, 1)) * 65536)
+{
+    m_options.id_count = static_cast<uint16_t>(m_in_flight.size() / 65536);
+    // a random first slot, so the sequence numbers of a new engine do not start where every other one does
+    std::mt19937 random(std::random_device{}());
+    m_next_slot = std::uniform_int_distribution<uint32_t>(0, static_cast<uint32_t>(m_in_flight.size() - 1))(random);
+    m_anomaly_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_anomaly_fd < 0)
+    {
+        throw std::runtime_error(fmt::format("could not create an eventfd: {}", std::strerror(errno)));
+    }
+    if (m_options.source)
+    {
+        m_socket.bind_to_address(*m_options.source);
+        m_name = inet_ntoa(*m_options.source);
+    }
+    if (!m_options.device.empty())
+    {
+        m_socket.bind_to_device(m_options.device);
+        m_name += (m_name.empty() ? "" : "%") + m_options.device;
+    }
+    m_socket.accept_replies_and_errors();
+    m_socket.set_receive_buffer_size(8 * 1024 * 1024);
+    m_packets.reserve(m_options.batch_size);
+    m_batch.reserve(m_options.batch_size);
+    m_batch_targets.reserve(m_options.batch_size);
+    publish(make_target_set({}));
+}
+
+probe_engine::~probe_engine()
+{
+    stop();
+    ::close(m_anomaly_fd);
+}
+
+void probe_engine::start()
+{
+    m_stopping = false;
+    m_thread = std::thread([this] { run(); });
+}
+
+void probe_engine::stop()
+{
+    m_stopping = true;
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+}
+
+std::shared_ptr<const target_set> probe_engine::targets() const
+{
+    return std::atomic_load(&m_targets);
+}
+
+void probe_engine::publish(std::shared_ptr<const target_set> targets)
+{
+    std::lock_guard<std::mutex> lock(m_writer_mutex);
+    publish_locked(std::move(targets));
+}
+
+void probe_engine::publish_locked(std::shared_ptr<const target_set> targets)
+{
+    // the shape of the indexes of the new set, and the state of the prefix trie as far as it can be read from here.
+    // the leaves that are a little behind are corrected by the probe thread the next time it sees their targets.
+    indexed_set next;
+    std::vector<in_addr> addresses;
+    std::vector<std::string_view> paths;
+    addresses.reserve(targets->targets.size());
+    paths.reserve(targets->targets.size());
+    for (const auto & target : targets->targets)
+    {
+        addresses.push_back(target->sockaddr.sin_addr);
+        paths.push_back(target->group);
+    }
+    next.prefixes = std::make_shared<prefix_trie>(addresses);
+    next.groups = std::make_shared<group_tree>(paths);
+    for (size_t i = 0; i < targets->targets.size(); ++i)
+    {
+        const auto & target = *targets->targets[i];
+        if (next.prefixes->leaf(i) != prefix_trie::no_node)
+        {
+            next.prefixes->set_leaf(next.prefixes->leaf(i), target.recent_loss.load(std::memory_order_relaxed), answered_srtt(target));
+        }
+    }
+    next.prefixes->sum_up();
+
+    auto current = std::atomic_load(&m_targets);
+    for (const auto & target : targets->targets)
+    {
+        if (!current || !contains(*current, *target))
+        {
+            next.added.push_back(target);
+        }
+    }
+    if (current)
+    {
+        for (const auto & target : current->targets)
+        {
+            if (!contains(*targets, *target))
+            {
+                next.removed.push_back(target);
+            }
+        }
+    }
+    next.targets = targets;
+
+    // the set and its indexes are handed over together, a set the probe thread skips passes its changes on to the next
+    std::lock_guard<std::mutex> lock(m_index_mutex);
+    if (m_pending_index)
+    {
+        next.added.insert(next.added.end(), m_pending_index->added.begin(), m_pending_index->added.end());
+        next.removed.insert(next.removed.end(), m_pending_index->removed.begin(), m_pending_index->removed.end());
+    }
+    m_pending_index = std::move(next);
+    std::atomic_store(&m_targets, std::move(targets));
+}
+
+void probe_engine::update(const std::function<std::shared_ptr<const target_set>(const target_set & current)> & change)
+{
+    std::lock_guard<std::mutex> lock(m_writer_mutex);
+    if (auto targets = change(*std::atomic_load(&m_targets)))
+    {
+        publish_locked(std::move(targets));
+    }
+}
+
+bool probe_engine::add_target(const std::string & address, std::chrono::milliseconds interval, const std::string & group)
+{
+    bool added = false;
+    update([&](const target_set & current) -> std::shared_ptr<const target_set> {
+        if (current.find(address))
+        {
+            return nullptr;
+        }
+        auto targets = current.targets;
+        targets.push_back(std::make_shared<engine_target>(address, interval, group));
+        added = true;
+        return make_target_set(std::move(targets));
+    });
+    return added;
+}
+
+bool probe_engine::remove_target(const std::string & address)
+{
+    bool removed = false;
+    update([&](const target_set & current) -> std::shared_ptr<const target_set> {
+        auto position = current.position(address);
+        if (!position)
+        {
+            return nullptr;
+        }
+        auto targets = current.targets;
+        targets.erase(targets.begin() + *position);
+        removed = true;
+        return make_target_set(std::move(targets));
+    });
+    return removed;
+}
+
+void probe_engine::run()
+{
+    auto next_tick = std::chrono::steady_clock::now();
+    while (!m_stopping)
+    {
+        if (std::atomic_load(&m_targets) != m_indexed_targets)
+        {
+            index_targets();
+        }
+        auto paused = m_paused.load(std::memory_order_relaxed);
+        if (paused != m_was_paused)
+        {
+            m_was_paused = paused;
+            if (!paused)
+            {
+                restart_schedule();
+            }
+        }
+        if (!paused)
+        {
+            send_due_probes(std::chrono::steady_clock::now());
+        }
+
+        next_tick += m_options.tick;
+        auto now = std::chrono::steady_clock::now();
+        if (next_tick < now)
+        {
+            next_tick = now; // do not try to catch up on ticks that were missed
+        }
+        receive_replies(next_tick);
+        correlate_anomalies(std::chrono::steady_clock::now());
+        publish_anomalies();
+        publish_worst();
+    }
+}
+
+void probe_engine::observe(engine_target & target, anomaly_metric metric, double value)
+{
+    const auto & options = metric == anomaly_metric::rtt ? m_options.rtt_changes : m_options.loss_changes;
+    auto & detector = metric == anomaly_metric::rtt ? target.rtt_changes : target.loss_changes;
+    auto change = detector.add(value, options);
+    if (metric == anomaly_metric::loss)
+    {
+        target.recent_loss.store(detector.baseline(), std::memory_order_relaxed);
+    }
+    if (change)
+    {
+        anomaly_event event{std::chrono::system_clock::now(), target.address, m_name, metric, *change, 1};
+        if (metric == anomaly_metric::loss && locate(target) && target.prefix_leaf != prefix_trie::no_node)
+        {
+            m_held_anomalies.push_back({std::move(event), &target, std::chrono::steady_clock::now() + m_options.correlation_window});
+        }
+        else
+        {
+            m_pending_anomalies.push_back(std::move(event));
+        }
+    }
+    if (metric == anomaly_metric::loss)
+    {
+        rank(target, worst_metric::loss);
+        update_prefixes(target);
+    }
+    update_groups(target, metric, value);
+}
+
+void probe_engine::update_groups(engine_target & target, anomaly_metric metric, double value)
+{
+    if (!locate(target) || target.group_index == group_tree::no_group)
+    {
+        return;
+    }
+    if (metric == anomaly_metric::rtt)
+    {
+        m_groups->add_reply(target.group_index, value);
+        return;
+    }
+    if (value > 0.0)
+    {
+        m_groups->add_loss(target.group_index);
+    }
+    bool down = target.loss_changes.baseline() >= 0.5;
+    if (down != target.group_down)
+    {
+        target.group_down = down;
+        m_groups->set_down(target.group_index, down);
+    }
+}
+
+void probe_engine::update_prefixes(engine_target & target)
+{
+    if (!locate(target) || target.prefix_leaf == prefix_trie::no_node)
+    {
+        return;
+    }
+    m_prefixes->update(target.prefix_leaf, target.loss_changes.baseline(), answered_srtt(target), m_recovered);
+    for (auto node : m_recovered)
+    {
+        auto subnet = m_prefixes->aggregate(node);
+        m_pending_anomalies.push_back(
+            {std::chrono::system_clock::now(), subnet.prefix, m_name, anomaly_metric::loss, {false, subnet.loss, subnet.loss}, subnet.targets});
+    }
+    m_recovered.clear();
+}
+
+void probe_engine::correlate_anomalies(std::chrono::steady_clock::time_point now)
+{
+    // a target that went down while all the others in its subnet did too is reported with the subnet, once.
+    // its recovery is left out as well, the subnet is reported up when more than half of it is back, see prefix_trie::update()
+    while (!m_held_anomalies.empty() && m_held_anomalies.front().release <= now)
+    {
+        auto held = std::move(m_held_anomalies.front());
+        m_held_anomalies.pop_front();
+        auto & target = *held.target;
+        if (held.event.change.increase)
+        {
+            auto node = m_prefixes->down_prefix(target.prefix_leaf, m_options.min_subnet_targets);
+            if (node != prefix_trie::no_node)
+            {
+                target.loss_folded = true;
+                if (!m_prefixes->reported(node))
+                {
+                    m_prefixes->set_reported(node);
+                    auto subnet = m_prefixes->aggregate(node);
+                    m_pending_anomalies.push_back({held.event.time, subnet.prefix, m_name, anomaly_metric::loss, {true, held.event.change.from, subnet.loss}, subnet.targets});
+                }
+                continue;
+            }
+        }
+        else if (target.loss_folded)
+        {
+            target.loss_folded = false;
+            continue;
+        }
+        m_pending_anomalies.push_back(std::move(held.event));
+    }
+}
+
+void probe_engine::publish_anomalies()
+{
+    // the probe thread never waits for the reader, the events stay pending until the lock is free.
+    // a reader that does not keep up loses the events beyond the first thousand.
+    const size_t max_anomalies = 1000;
+    if (m_pending_anomalies.empty() || !m_anomaly_mutex.try_lock())
+    {
+        return;
+    }
+    for (auto & event : m_pending_anomalies)
+    {
+        if (m_anomalies.size() < max_anomalies)
+        {
+            m_anomalies.push_back(std::move(event));
+        }
+    }
+    m_anomaly_mutex.unlock();
+    m_pending_anomalies.clear();
+    uint64_t one = 1;
+    [[maybe_unused]] auto written = ::write(m_anomaly_fd, &one, sizeof(one));
+}
+
+void probe_engine::index_targets()
+{
+    // the writer built the indexes of the set, so taking it over costs O(changed targets + groups). a writer that holds the
+    // lock is done with the set in a moment, it is taken over on the next tick.
+    if (!m_index_mutex.try_lock())
+    {
+        return;
+    }
+    auto next = std::exchange(m_pending_index, std::nullopt);
+    m_index_mutex.unlock();
+    if (!next)
+    {
+        return;
+    }
+
+    for (auto & held : m_held_anomalies)
+    {
+        m_pending_anomalies.push_back(std::move(held.event));
+    }
+    m_held_anomalies.clear();
+    ++m_index_generation;
+    if (m_groups)
+    {
+        next->groups->carry_over(*m_groups);
+    }
+
+    // a target can be in both lists when the probe thread skipped a set, the flag tells what it has to do
+    for (const auto & target : next->removed)
+    {
+        if (target->indexed && !contains(*next->targets, *target))
+        {
+            target->indexed = false;
+            ++target->schedule_tag;
+            m_worst.remove(*target);
+            next->groups->remove_target(target->group, target->snapshot(), target->group_down);
+        }
+    }
+    for (const auto & target : next->added)
+    {
+        auto position = next->targets->position(target->address);
+        if (target->indexed || !position || next->targets->targets[*position] != target)
+        {
+            continue;
+        }
+        target->indexed = true;
+        if (target->timeout_ms.load(std::memory_order_relaxed) == 0)
+        {
+            target->timeout_ms.store(m_options.max_timeout.count(), std::memory_order_relaxed);
+        }
+        m_schedule.push_back({next_event(*target), target, ++target->schedule_tag});
+        std::push_heap(m_schedule.begin(), m_schedule.end(), scheduled_target::later);
+        target->group_down = target->loss_changes.baseline() >= 0.5;
+        auto group = next->groups->group(*position);
+        if (group != group_tree::no_group)
+        {
+            next->groups->add_target(group, target->snapshot(), target->group_down);
+        }
+        m_worst.update(*target, worst_metric::loss);
+        m_worst.update(*target, worst_metric::p99);
+    }
+
+    m_indexed_targets = std::move(next->targets);
+    std::atomic_store(&m_prefixes, std::move(next->prefixes));
+    std::atomic_store(&m_groups, std::move(next->groups));
+    m_worst_changed = true;
+}
+
+bool probe_engine::locate(engine_target & target)
+{
+    // once per target and set, the first time the probe thread sees the target after the set was indexed
+    if (target.index_generation == m_index_generation)
+    {
+        return target.indexed;
+    }
+    target.index_generation = m_index_generation;
+    target.prefix_leaf = prefix_trie::no_node;
+    target.group_index = group_tree::no_group;
+    if (!target.indexed)
+    {
+        return false;
+    }
+    auto position = *m_indexed_targets->position(target.address);
+    target.prefix_leaf = m_prefixes->leaf(position);
+    target.group_index = m_groups->group(position);
+
+    // the subnet it was reported down with, so the recovery is reported in the new trie as well
+    if (target.loss_folded && target.prefix_leaf != prefix_trie::no_node)
+    {
+        auto node = m_prefixes->down_prefix(target.prefix_leaf, m_options.min_subnet_targets);
+        if (node != prefix_trie::no_node)
+        {
+            m_prefixes->set_reported(node);
+        }
+        else
+        {
+            target.loss_folded = false;
+        }
+    }
+    return true;
+}
+
+void probe_engine::rank(engine_target & target, worst_metric metric)
+{
+    if (locate(target) && m_worst.update(target, metric))
+    {
+        m_worst_changed = true;
+    }
+}
+
+void probe_engine::publish_worst()
+{
+    if (!m_worst_changed)
+    {
+        return;
+    }
+    for (size_t metric = 0; metric < worst_metric_count; ++metric)
+    {
+        auto list = std::make_shared<const std::vector<worst_target>>(m_worst.worst(static_cast<worst_metric>(metric), m_options.worst_count));
+        std::atomic_store(&m_worst_lists[metric], std::move(list));
+    }
+    m_worst_changed = false;
+}
+
+std::vector<worst_target> probe_engine::worst(worst_metric metric, size_t count) const
+{
+    auto list = std::atomic_load(&m_worst_lists[static_cast<size_t>(metric)]);
+    if (!list)
+    {
+        return {};
+    }
+    return {list->begin(), list->begin() + static_cast<std::ptrdiff_t>(std::min(count, list->size()))};
+}
+
+std::optional<prefix_aggregate> probe_engine::subnet(in_addr prefix, uint8_t length) const
+{
+    auto prefixes = std::atomic_load(&m_prefixes);
+    return prefixes ? prefixes->find(prefix, length) : std::nullopt;
+}
+
+std::shared_ptr<const group_tree> probe_engine::groups() const
+{
+    return std::atomic_load(&m_groups);
+}
+
+std::vector<anomaly_event> probe_engine::take_anomalies()
+{
+    uint64_t count = 0;
+    [[maybe_unused]] auto read = ::read(m_anomaly_fd, &count, sizeof(count));
+    std::lock_guard<std::mutex> lock(m_anomaly_mutex);
+    return std::exchange(m_anomalies, {});
+}
+
+void probe_engine::send_due_probes(std::chrono::steady_clock::time_point now)
+{
+    // a probe that can not be sent (no route to it, the interface is down) is counted as an error right away
+    auto flush = [&] {
+        m_socket.send_batch(m_batch, [&](size_t index, int) {
+            m_batch_targets[index]->outstanding = false;
+            m_batch_targets[index]->errors.fetch_add(1, std::memory_order_relaxed);
+            observe(*m_batch_targets[index], anomaly_metric::loss, 1.0);
+        });
+        m_batch.clear();
+        m_packets.clear();
+        m_batch_targets.clear();
+    };
+
+    // every target that is popped is pushed again with a time after now, so the loop ends
+    while (!m_schedule.empty() && m_schedule.front().time <= now)
+    {
+        std::pop_heap(m_schedule.begin(), m_schedule.end(), scheduled_target::later);
+        if (m_schedule.back().tag != m_schedule.back().target->schedule_tag)
+        {
+            m_schedule.pop_back(); // removed from the set
+            continue;
+        }
+        const auto & target = m_schedule.back().target; // valid until the entry is pushed again
+        auto & entry = *target;
+        auto due = now >= entry.next_probe;
+        if (entry.outstanding && (due || now >= entry.probe_sent + std::chrono::milliseconds(entry.timeout_ms.load(std::memory_order_relaxed))))
+        {
+            entry.outstanding = false;
+            entry.lost.fetch_add(1, std::memory_order_relaxed);
+            observe(entry, anomaly_metric::loss, 1.0);
+        }
+        if (!due)
+        {
+            m_schedule.back().time = next_event(entry);
+            std::push_heap(m_schedule.begin(), m_schedule.end(), scheduled_target::later);
+            continue;
+        }
+
+        // a slot is re-used after id_count * 65536 probes, a probe that still waits for it by then is lost
+        auto slot = m_next_slot.load(std::memory_order_relaxed);
+        m_next_slot.store((slot + 1) % m_in_flight.size(), std::memory_order_relaxed);
+        auto & previous = m_in_flight[slot];
+        if (previous && previous->outstanding && previous->slot == slot)
+        {
+            previous->outstanding = false;
+            previous->lost.fetch_add(1, std::memory_order_relaxed);
+            observe(*previous, anomaly_metric::loss, 1.0);
+        }
+        previous = target;
+
+        entry.slot = slot;
+        entry.probe_sent = now;
+        entry.outstanding = true;
+        entry.next_probe += entry.interval();
+        if (entry.next_probe < now)
+        {
+            entry.next_probe = now + entry.interval(); // a target that fell behind continues at its interval, without a burst
+        }
+        entry.sent.fetch_add(1, std::memory_order_relaxed);
+
+        m_packets.push_back(make_icmp_packet(slot & 0xffff, {}, static_cast<uint16_t>(m_options.first_id + (slot >> 16))));
+        m_batch.push_back({&m_packets.back(), sizeof(ping_pkt), 0, &entry.sockaddr});
+        m_batch_targets.push_back(&entry);
+        m_schedule.back().time = next_event(entry);
+        std::push_heap(m_schedule.begin(), m_schedule.end(), scheduled_target::later);
+        if (m_batch.size() == m_options.batch_size)
+        {
+            flush();
+        }
+    }
+    if (!m_batch.empty())
+    {
+        flush();
+    }
+}
+
+void probe_engine::restart_schedule()
+{
+    // the probes that were outstanding when the engine paused are not counted as lost, whatever became of them
+    m_schedule.erase(std::remove_if(m_schedule.begin(), m_schedule.end(), [](const scheduled_target & scheduled) { return scheduled.tag != scheduled.target->schedule_tag; }),
+                     m_schedule.end());
+    for (auto & scheduled : m_schedule)
+    {
+        auto & target = *scheduled.target;
+        target.outstanding = false;
+        target.next_probe = first_probe(target.interval());
+        scheduled.time = target.next_probe;
+    }
+    std::make_heap(m_schedule.begin(), m_schedule.end(), scheduled_target::later);
+}
+
+void probe_engine::receive_replies(std::chrono::steady_clock::time_point until)
+{
+    const size_t max_packet_length = 1500;
+    while (true)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= until || !m_socket.wait_for_data(std::chrono::duration_cast<std::chrono::milliseconds>(until - now)))
+        {
+            return;
+        }
+        const auto & data_received = m_socket.receive(max_packet_length);
+        auto received = std::chrono::steady_clock::now();
+        auto message = decode_icmp_message(data_received, m_socket.get_received_from());
+        // ids wrap around at 65536, so the offset into the range is computed in 16 bits
+        auto id_offset = static_cast<uint16_t>(message ? message->id - m_options.first_id : 0);
+        if (!message || id_offset >= m_options.id_count)
+        {
+            continue;
+        }
+        auto slot = static_cast<uint32_t>(id_offset) << 16 | message->sequence;
+        const auto & target = m_in_flight[slot];
+        if (!target || !target->outstanding || target->slot != slot ||
+            target->sockaddr.sin_addr.s_addr != message->destination.s_addr)
+        {
+            continue;
+        }
+
+        auto & entry = *target;
+        entry.outstanding = false;
+        if (message->type != ICMP_ECHOREPLY)
+        {
+            entry.errors.fetch_add(1, std::memory_order_relaxed);
+            observe(entry, anomaly_metric::loss, 1.0);
+            continue;
+        }
+
+        // the adaptive timeout of RFC 6298: srtt + 4 * rttvar, within the configured bounds
+        auto rtt = std::chrono::duration_cast<double_milliseconds>(received - entry.probe_sent).count();
+        auto srtt = entry.srtt_ms.load(std::memory_order_relaxed);
+        auto rttvar = entry.rttvar_ms.load(std::memory_order_relaxed);
+        if (entry.received.load(std::memory_order_relaxed) == 0)
+        {
+            srtt = rtt;
+            rttvar = rtt / 2.0;
+        }
+        else
+        {
+            rttvar = 0.75 * rttvar + 0.25 * std::abs(srtt - rtt);
+            srtt = 0.875 * srtt + 0.125 * rtt;
+        }
+        auto timeout = std::clamp<int64_t>(std::ceil(srtt + 4.0 * rttvar), m_options.min_timeout.count(), m_options.max_timeout.count());
+
+        entry.last_ms.store(rtt, std::memory_order_relaxed);
+        entry.srtt_ms.store(srtt, std::memory_order_relaxed);
+        entry.rttvar_ms.store(rttvar, std::memory_order_relaxed);
+        entry.timeout_ms.store(timeout, std::memory_order_relaxed);
+        entry.rtt_total_ms.store(entry.rtt_total_ms.load(std::memory_order_relaxed) + rtt, std::memory_order_relaxed);
+        auto bucket = rtt_histogram_bucket(rtt);
+        entry.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+        ++entry.recent_histogram[bucket];
+        if (++entry.recent_replies == engine_target::recent_replies_limit)
+        {
+            entry.recent_replies = 0;
+            for (auto & count : entry.recent_histogram)
+            {
+                count /= 2;
+                entry.recent_replies += count;
+            }
+        }
+        // the p99 is read from the whole recent histogram, which costs more than the rest of the reply. one reply barely
+        // moves it, so the target is ranked again every 16 replies.
+        if (entry.received.fetch_add(1, std::memory_order_relaxed) % 16 == 15)
+        {
+            rank(entry, worst_metric::p99);
+        }
+        observe(entry, anomaly_metric::rtt, rtt);
+        observe(entry, anomaly_metric::loss, 0.0);
+    }
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "anomaly.h"
+#include "icmp.h"
+#include "prefix_trie.h"
+#include "worst.h"
+
+namespace icmp_ns {
+
+// bucket 0 counts rtts below 1us, bucket i counts rtts from 2^(i-1) to 2^i us, the last bucket everything above
+constexpr size_t rtt_histogram_buckets = 24;
+
+[[nodiscard]] size_t rtt_histogram_bucket(double milliseconds);
+
+// the shortest interval of a target, a shorter one would have it probed on every tick of the probe thread
+constexpr std::chrono::milliseconds min_target_interval{10};
+
+class group_tree;
+
+// a consistent-enough copy of the statistics of one target, taken while the probe thread keeps running
+struct target_snapshot
+{
+    std::string address;
+    std::string group;
+    std::chrono::milliseconds interval{};
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    uint64_t errors = 0;
+    double last_ms = 0.0;
+    double srtt_ms = 0.0;   // smoothed rtt, RFC 6298
+    double rttvar_ms = 0.0; // smoothed mean deviation of the rtt, RFC 6298
+    double rtt_total_ms = 0.0;
+    std::chrono::milliseconds timeout{};
+    std::array<uint64_t, rtt_histogram_buckets> histogram{};
+};
+
+// one probed target. it is shared between the target sets that contain it, so replacing the target set keeps its state.
+// the probe thread is the only writer of the statistics; they are atomics so snapshots can be taken from any thread.
+struct engine_target
+{
+    engine_target(std::string target_address, std::chrono::milliseconds target_interval, std::string target_group = {});
+    // for an address that was resolved before, for example by a previous run, see restore_checkpoint()
+    engine_target(std::string target_address, const sockaddr_in & resolved, std::chrono::milliseconds target_interval, std::string target_group = {});
+
+    [[nodiscard]] target_snapshot snapshot() const;
+    [[nodiscard]] std::chrono::milliseconds interval() const { return std::chrono::milliseconds(interval_ms.load(std::memory_order_relaxed)); }
+
+    // set once
+    const std::string address;
+    const sockaddr_in sockaddr;
+    const std::string group; // a path like dc1/row3/rack7, empty for none, see group_tree
+
+    // written by the control api, read by the probe thread
+    std::atomic<int64_t> interval_ms;
+
+    // written by the probe thread only
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> received{0};
+    std::atomic<uint64_t> lost{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<double> last_ms{0.0};
+    std::atomic<double> srtt_ms{0.0};
+    std::atomic<double> rttvar_ms{0.0};
+    std::atomic<double> rtt_total_ms{0.0};
+    std::atomic<int64_t> timeout_ms{0};
+    std::array<std::atomic<uint64_t>, rtt_histogram_buckets> histogram{};
+    std::atomic<double> recent_loss{0.0}; // the baseline of loss_changes, for the writer that builds the prefix trie of a new set
+
+    // change detection, owned by the probe thread
+    change_detector rtt_changes;
+    change_detector loss_changes; // a series of 1 for a lost or failed probe and 0 for a reply
+    bool loss_folded = false;     // its last loss change was reported as part of a subnet, so is its recovery
+
+    // the recent rtts, for ranking the p99: the histogram buckets, all halved when they add up to recent_replies_limit,
+    // so they hold the last 256 to 512 replies and a p99 that went up or down shows within a few hundred replies.
+    // owned by the probe thread, and not part of a checkpoint: a restored target is ranked again once it replies.
+    static constexpr uint16_t recent_replies_limit = 512;
+    std::array<uint16_t, rtt_histogram_buckets> recent_histogram{};
+    uint16_t recent_replies = 0;
+
+    // the place of the target in the worst_tracker, the prefix_trie and the group_tree of the engine, owned by the probe thread.
+    // the leaf and the group are looked up again the first time the target is seen after a new set was indexed.
+    std::array<uint16_t, worst_metric_count> worst_level{};
+    std::array<uint32_t, worst_metric_count> worst_position{};
+    uint32_t prefix_leaf = prefix_trie::no_node;
+    uint32_t group_index = 0xffffffff; // group_tree::no_group
+    bool group_down = false;
+    bool indexed = false;          // in the set the probe thread indexed last
+    uint32_t index_generation = 0; // the set prefix_leaf and group_index were looked up for, see probe_engine::locate()
+    uint32_t schedule_tag = 0;     // tells its current entry in the schedule of the engine from the ones of earlier sets
+
+    // schedule, owned by the probe thread
+    std::chrono::steady_clock::time_point next_probe;
+    std::chrono::steady_clock::time_point probe_sent;
+    uint32_t slot = 0; // the icmp id and sequence number of the outstanding probe, see probe_engine
+    bool outstanding = false;
+};
+
+// an immutable set of targets. it is never modified after it is published; a change builds a new set
+// that shares the unchanged targets with the old one.
+struct target_set
+{
+    std::vector<std::shared_ptr<engine_target>> targets;
+
+    // open addressing hash index of the addresses, every slot holds 32 bits of the hash and the position in targets plus one
+    // (0 is an empty slot). every change rebuilds it, and a flat array builds several times faster than a node based map.
+    std::vector<uint64_t> index;
+
+    [[nodiscard]] std::optional<size_t> position(std::string_view address) const;
+    [[nodiscard]] std::shared_ptr<engine_target> find(std::string_view address) const;
+};
+
+// builds a set and its address index, duplicate addresses keep their first entry
+[[nodiscard]] std::shared_ptr<const target_set> make_target_set(std::vector<std::shared_ptr<engine_target>> targets);
+
+struct engine_options
+{
+    std::chrono::milliseconds tick{10};          // how often the probe thread looks for targets that are due
+    std::chrono::milliseconds min_timeout{50};   // lower bound of the adaptive timeout
+    std::chrono::milliseconds max_timeout{3000}; // upper bound, and the timeout before the first reply
+    size_t batch_size = 1024;                    // echo requests per sendmmsg call
+    std::string device;                          // probe through this interface only (SO_BINDTODEVICE), empty for the routing table's choice
+    std::optional<in_addr> source;               // probe from this local address, nothing for the routing table's choice
+
+    // every engine sends with its own range of icmp ids, so engines that share the process tell their replies apart by the id
+    // alone. each id adds 65536 sequence numbers, the maximum number of probes that can be outstanding at the same time.
+    // claim the range with claim_icmp_ids(), so no other engine or process on the host uses it.
+    uint16_t first_id = 0;
+    uint16_t id_count = 4;
+
+    // how lasting changes in the rtt and the loss of a target are detected, see change_detector and take_anomalies().
+    // the rtt scale is at least 0.1 ms or 10% of the rtt, and five losses in a row signal a change from no loss at all.
+    change_detector_options rtt_changes{0.02, 0.5, 8.0, 2.5, 0.1, 0.1, 16};
+    change_detector_options loss_changes{0.02, 0.5, 8.0, 2.5, 0.25, 0.0, 16};
+
+    // loss changes are held back this long, so when all targets of a subnet go down together, and there are at least
+    // min_subnet_targets of them, they are reported as one event for the subnet, see prefix_trie
+    std::chrono::milliseconds correlation_window{3000};
+    uint32_t min_subnet_targets = 4;
+
+    size_t worst_count = 100; // how many of the worst targets per metric are published, see worst()
+};
+
+// probes a changing set of targets on a background thread, every target at its own interval.
+// the current set is published RCU-style: a writer copies the set, changes the copy and stores it, and the probe thread
+// loads the shared pointer once per tick. std::atomic_load and std::atomic_store of a shared_ptr are not lock-free in
+// libstdc++, they take a mutex from a small pool keyed by the address, but only for the copy of the pointer. the writer
+// also builds the prefix trie and the group tree of the new set and finds the targets that were added and removed, so
+// the probe thread takes the set over in O(changed targets + groups) and never waits for a writer, nor a writer for a tick.
+// a retired target is freed when the last tick, probe or snapshot that still uses it drops its reference.
+class probe_engine
+{
+public:
+    explicit probe_engine(const engine_options & options = {});
+    ~probe_engine();
+    probe_engine(const probe_engine &) = delete;
+    probe_engine & operator=(const probe_engine &) = delete;
+
+    void start();
+    void stop();
+
+    // the source address and interface this engine probes from, like 10.0.0.1%eth0, empty when it follows the routing table
+    [[nodiscard]] const std::string & name() const { return m_name; }
+    [[nodiscard]] const engine_options & options() const { return m_options; }
+
+    // a paused engine sends no probes, for example while its interface is down, so the outage does not count as loss of
+    // every target. when it resumes, the probes that were outstanding are forgotten and the targets start over at a random
+    // point of their interval, like new targets.
+    void set_paused(bool paused) { m_paused.store(paused, std::memory_order_relaxed); }
+    [[nodiscard]] bool paused() const { return m_paused.load(std::memory_order_relaxed); }
+
+    [[nodiscard]] std::shared_ptr<const target_set> targets() const;
+
+    // replaces the whole set, targets that the new set shares with the current one keep their state and schedule.
+    // O(targets log targets) on the calling thread, for the indexes of the new set.
+    void publish(std::shared_ptr<const target_set> targets);
+
+    // builds a new set from the current one and publishes it. concurrent writers are serialized,
+    // 'change' may return nullptr to leave the current set in place.
+    void update(const std::function<std::shared_ptr<const target_set>(const target_set & current)> & change);
+
+    // copy-on-write changes of the current set; they return false if the address is already present or not found
+    bool add_target(const std::string & address, std::chrono::milliseconds interval, const std::string & group = {});
+    bool remove_target(const std::string & address);
+
+    // becomes readable (an eventfd) when the probe thread detected changes, take_anomalies() returns them
+    [[nodiscard]] int anomaly_fd() const { return m_anomaly_fd; }
+    [[nodiscard]] std::vector<anomaly_event> take_anomalies();
+
+    // at most 'count' (up to worst_count) targets with the highest loss or p99, the worst first, as of the last tick
+    [[nodiscard]] std::vector<worst_target> worst(worst_metric metric, size_t count) const;
+
+    // the loss and srtt of the targets within a prefix, summed up by the probe thread, nothing if there are none
+    [[nodiscard]] std::optional<prefix_aggregate> subnet(in_addr prefix, uint8_t length) const;
+
+    // the totals of the groups of the targets, kept up to date by the probe thread, nullptr before its first tick
+    [[nodiscard]] std::shared_ptr<const group_tree> groups() const;
+
+    // the id and sequence number of the next probe, it is restored from a checkpoint before start()
+    [[nodiscard]] uint32_t next_slot() const { return m_next_slot.load(std::memory_order_relaxed); }
+    void set_next_slot(uint32_t slot) { m_next_slot.store(slot % m_in_flight.size(), std::memory_order_relaxed); }
+
+private:
+    // a published set with the indexes that the writer built for it, until the probe thread takes it over
+    struct indexed_set
+    {
+        std::shared_ptr<const target_set> targets;
+        std::shared_ptr<prefix_trie> prefixes;
+        std::shared_ptr<group_tree> groups;
+        // the changes since the set the probe thread indexed last, over all the sets it did not get to see
+        std::vector<std::shared_ptr<engine_target>> added;
+        std::vector<std::shared_ptr<engine_target>> removed;
+    };
+
+    void publish_locked(std::shared_ptr<const target_set> targets);
+    void run();
+    void send_due_probes(std::chrono::steady_clock::time_point now);
+    void restart_schedule();
+    void receive_replies(std::chrono::steady_clock::time_point until);
+    void observe(engine_target & target, anomaly_metric metric, double value);
+    void correlate_anomalies(std::chrono::steady_clock::time_point now);
+    void publish_anomalies();
+    void index_targets();
+    bool locate(engine_target & target);
+    void rank(engine_target & target, worst_metric metric);
+    void update_prefixes(engine_target & target);
+    void update_groups(engine_target & target, anomaly_metric metric, double value);
+    void publish_worst();
+
+    engine_options m_options;
+    std::string m_name;
+    std::shared_ptr<const target_set> m_targets; // only accessed through std::atomic_load and std::atomic_store
+    std::mutex m_writer_mutex;                   // serializes writers, the probe thread never takes it
+    std::mutex m_index_mutex;                    // guards m_pending_index, the probe thread only tries it
+    std::optional<indexed_set> m_pending_index;  // the indexes of m_targets, if the probe thread did not take them yet
+    std::atomic<bool> m_stopping{false};
+    std::atomic<bool> m_paused{false};
+    bool m_was_paused = false; // owned by the probe thread
+    std::thread m_thread;
+
+    // owned by the probe thread
+    icmp_socket m_socket;
+    std::vector<std::shared_ptr<engine_target>> m_in_flight; // indexed by slot: the offset of the id in the range * 65536 + sequence number
+    std::atomic<uint32_t> m_next_slot{0};                    // written by the probe thread only
+    std::vector<ping_pkt> m_packets;
+    std::vector<batch_packet> m_batch;
+    std::vector<engine_target *> m_batch_targets;
+
+    // when the probe thread next has to look at a target of the indexed set: its next probe, or the timeout of its
+    // outstanding probe if that comes first. a min-heap, so a tick costs O(log n) per due target instead of a scan of
+    // all targets. a reply or an interval change does not update it; the target then comes up early and is pushed again.
+    // a target that is removed from the set stays in the heap until it comes up, and is dropped then by its tag.
+    struct scheduled_target
+    {
+        std::chrono::steady_clock::time_point time;
+        std::shared_ptr<engine_target> target;
+        uint32_t tag; // the schedule_tag of the target when it was added
+
+        static bool later(const scheduled_target & a, const scheduled_target & b) { return a.time > b.time; }
+    };
+    std::vector<scheduled_target> m_schedule; // owned by the probe thread
+
+    // a loss change of a target in the prefix trie, until the correlation window has passed
+    struct held_anomaly
+    {
+        anomaly_event event;
+        engine_target * target; // kept alive by m_indexed_targets
+        std::chrono::steady_clock::time_point release;
+    };
+
+    // detected changes, collected by the probe thread and handed over without waiting for the lock
+    std::deque<held_anomaly> m_held_anomalies;      // owned by the probe thread
+    std::vector<anomaly_event> m_pending_anomalies; // owned by the probe thread
+    std::mutex m_anomaly_mutex;
+    std::vector<anomaly_event> m_anomalies;
+    int m_anomaly_fd = -1;
+
+    // the indexes of the probe thread: the worst targets, published once per tick, the prefix trie and the group tree.
+    // the indexed set keeps the targets in them alive, a new set adds and removes only the targets that changed.
+    std::shared_ptr<const target_set> m_indexed_targets; // owned by the probe thread
+    uint32_t m_index_generation = 0;                     // owned by the probe thread
+    worst_tracker m_worst;                               // owned by the probe thread
+    bool m_worst_changed = false;                        // owned by the probe thread
+    std::array<std::shared_ptr<const std::vector<worst_target>>, worst_metric_count> m_worst_lists; // only accessed through std::atomic_load and std::atomic_store
+    std::shared_ptr<prefix_trie> m_prefixes; // replaced by the probe thread with std::atomic_store, read with std::atomic_load
+    std::vector<uint32_t> m_recovered;       // owned by the probe thread
+    std::shared_ptr<group_tree> m_groups;    // like m_prefixes
+};
+
+} // namespace icmp_ns
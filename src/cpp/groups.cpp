@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "engine.h"
+#include "groups.h"
+
+namespace icmp_ns {
+
+double group_snapshot::percentile(double fraction) const
+{
+    uint64_t total = 0;
+    for (auto count : histogram)
+    {
+        total += count;
+    }
+    auto rank = static_cast<uint64_t>(std::ceil(fraction * total));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < rtt_histogram_buckets; ++bucket)
+    {
+        seen += histogram[bucket];
+        if (seen >= rank && histogram[bucket] > 0)
+        {
+            return static_cast<double>(1ull << bucket) / 1000.0;
+        }
+    }
+    return 0.0;
+}
+
+group_tree::group_tree(const std::vector<std::string_view> & paths) :
+    m_group_of(paths.size(), no_group)
+{
+    // every path and every prefix of it that ends before a '/'
+    std::map<std::string, uint32_t, std::less<>> groups;
+    for (auto path : paths)
+    {
+        for (auto end = path.find('/'); end != std::string_view::npos; end = path.find('/', end + 1))
+        {
+            groups.emplace(path.substr(0, end), 0);
+        }
+        if (!path.empty())
+        {
+            groups.emplace(path, 0);
+        }
+    }
+
+    m_group_count = groups.size();
+    m_groups.reset(new group_node[m_group_count]);
+    uint32_t index = 0;
+    for (auto & [path, group] : groups)
+    {
+        group = index;
+        auto & node = m_groups[index++];
+        node.path = path;
+        if (auto end = path.rfind('/'); end != std::string::npos)
+        {
+            node.parent = groups.find(std::string_view(path).substr(0, end))->second;
+        }
+    }
+
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        if (paths[i].empty())
+        {
+            continue;
+        }
+        m_group_of[i] = groups.find(paths[i])->second;
+        for (auto group = m_group_of[i]; group != no_group; group = m_groups[group].parent)
+        {
+            ++m_groups[group].targets;
+        }
+    }
+}
+
+void group_tree::add_target(uint32_t group, const target_snapshot & snapshot, bool down)
+{
+    for (; group != no_group; group = m_groups[group].parent)
+    {
+        auto & node = m_groups[group];
+        add(node.down, down ? 1u : 0u);
+        add(node.replies, snapshot.received);
+        add(node.losses, snapshot.lost + snapshot.errors);
+        add(node.rtt_total_ms, snapshot.rtt_total_ms);
+        for (size_t bucket = 0; bucket < rtt_histogram_buckets; ++bucket)
+        {
+            add(node.histogram[bucket], snapshot.histogram[bucket]);
+        }
+    }
+}
+
+void group_tree::remove_target(std::string_view path, const target_snapshot & snapshot, bool down)
+{
+    // the deepest group along the path that is still there, the groups above it are its parents
+    auto group = find(path);
+    while (group == no_group && !path.empty())
+    {
+        auto end = path.rfind('/');
+        path = path.substr(0, end == std::string_view::npos ? 0 : end);
+        group = find(path);
+    }
+    for (; group != no_group; group = m_groups[group].parent)
+    {
+        auto & node = m_groups[group];
+        add(node.down, down ? static_cast<uint32_t>(-1) : 0u);
+        add(node.replies, 0 - snapshot.received);
+        add(node.losses, 0 - (snapshot.lost + snapshot.errors));
+        add(node.rtt_total_ms, -snapshot.rtt_total_ms);
+        for (size_t bucket = 0; bucket < rtt_histogram_buckets; ++bucket)
+        {
+            add(node.histogram[bucket], 0 - snapshot.histogram[bucket]);
+        }
+    }
+}
+
+void group_tree::carry_over(const group_tree & previous)
+{
+    // both trees are sorted by path, so one pass over each finds the groups they have in common
+    size_t from = 0;
+    for (size_t i = 0; i < m_group_count; ++i)
+    {
+        auto & node = m_groups[i];
+        while (from < previous.m_group_count && previous.m_groups[from].path < node.path)
+        {
+            ++from;
+        }
+        if (from == previous.m_group_count)
+        {
+            return;
+        }
+        const auto & old = previous.m_groups[from];
+        if (old.path != node.path)
+        {
+            continue;
+        }
+        add(node.down, old.down.load(std::memory_order_relaxed));
+        add(node.replies, old.replies.load(std::memory_order_relaxed));
+        add(node.losses, old.losses.load(std::memory_order_relaxed));
+        add(node.rtt_total_ms, old.rtt_total_ms.load(std::memory_order_relaxed));
+        for (size_t bucket = 0; bucket < rtt_histogram_buckets; ++bucket)
+        {
+            add(node.histogram[bucket], old.histogram[bucket].load(std::memory_order_relaxed));
+        }
+    }
+}
+
+uint32_t group_tree::find(std::string_view path) const
+{
+    auto end = m_groups.get() + m_group_count;
+    auto found = std::lower_bound(m_groups.get(), end, path, [](const group_node & node, std::string_view value) { return node.path < value; });
+    return found != end && found->path == path ? static_cast<uint32_t>(found - m_groups.get()) : no_group;
+}
+
+void group_tree::add_reply(uint32_t group, double rtt_ms)
+{
+    auto bucket = rtt_histogram_bucket(rtt_ms);
+    for (; group != no_group; group = m_groups[group].parent)
+    {
+        auto & node = m_groups[group];
+        add(node.replies, 1u);
+        add(node.rtt_total_ms, rtt_ms);
+        add(node.histogram[bucket], 1u);
+    }
+}
+
+void group_tree::add_loss(uint32_t group)
+{
+    for (; group != no_group; group = m_groups[group].parent)
+    {
+        add(m_groups[group].losses, 1u);
+    }
+}
+
+void group_tree::set_down(uint32_t group, bool down)
+{
+    for (; group != no_group; group = m_groups[group].parent)
+    {
+        add(m_groups[group].down, down ? 1u : static_cast<uint32_t>(-1));
+    }
+}
+
+std::vector<group_snapshot> group_tree::snapshot(std::string_view path) const
+{
+    std::vector<group_snapshot> result;
+    for (size_t i = 0; i < m_group_count; ++i)
+    {
+        const auto & node = m_groups[i];
+        std::string_view candidate(node.path);
+        if (!path.empty() && candidate != path && !(candidate.size() > path.size() && candidate.substr(0, path.size()) == path && candidate[path.size()] == '/'))
+        {
+            continue;
+        }
+        group_snapshot group;
+        group.path = node.path;
+        group.targets = node.targets;
+        group.down = node.down.load(std::memory_order_relaxed);
+        group.replies = node.replies.load(std::memory_order_relaxed);
+        group.losses = node.losses.load(std::memory_order_relaxed);
+        group.rtt_total_ms = node.rtt_total_ms.load(std::memory_order_relaxed);
+        for (size_t bucket = 0; bucket < rtt_histogram_buckets; ++bucket)
+        {
+            group.histogram[bucket] = node.histogram[bucket].load(std::memory_order_relaxed);
+        }
+        result.push_back(std::move(group));
+    }
+    return result;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "engine.h"
+
+namespace icmp_ns {
+
+// a consistent-enough copy of the totals of one group, taken while the probe thread keeps running
+struct group_snapshot
+{
+    std::string path;
+    uint32_t targets = 0; // in the group and the groups below it
+    uint32_t down = 0;    // targets with a recent loss of 50% or more, the others are up
+    uint64_t replies = 0;
+    uint64_t losses = 0; // lost probes and icmp errors
+    double rtt_total_ms = 0.0;
+    std::array<uint64_t, rtt_histogram_buckets> histogram{};
+
+    // the upper bound of the histogram bucket that holds the percentile, in ms
+    [[nodiscard]] double percentile(double fraction) const;
+};
+
+// the groups of the targets of an engine. a target is labeled with a path like dc1/row3/rack7, and it counts in every
+// group along it: dc1, dc1/row3 and dc1/row3/rack7. every group keeps the totals of its targets, which the probe thread
+// updates with every sample on the few groups of its path, so the totals are never recomputed from the targets.
+// the groups are fixed when the tree is built; the probe thread is the only writer, the totals are atomics for the control api.
+class group_tree
+{
+public:
+    static constexpr uint32_t no_group = 0xffffffff;
+
+    // builds the groups of the paths, one per target, an empty path is in no group
+    explicit group_tree(const std::vector<std::string_view> & paths);
+    group_tree(const group_tree &) = delete;
+    group_tree & operator=(const group_tree &) = delete;
+
+    // the deepest group of the target at 'position' in the constructor's argument, no_group for none
+    [[nodiscard]] uint32_t group(size_t position) const { return m_group_of[position]; }
+
+    // adds the history of a target to the totals of its groups, once, when the target joins the tree
+    void add_target(uint32_t group, const target_snapshot & snapshot, bool down);
+
+    // takes the history of a target that left the set out of the groups along its path that are still in this tree
+    void remove_target(std::string_view path, const target_snapshot & snapshot, bool down);
+
+    // starts every group with the totals of the group with the same path in the tree of the previous set, O(groups)
+    void carry_over(const group_tree & previous);
+
+    // one sample of a target, O(depth of the path)
+    void add_reply(uint32_t group, double rtt_ms);
+    void add_loss(uint32_t group);
+    void set_down(uint32_t group, bool down);
+
+    // the group of a path, no_group if it is not in the tree
+    [[nodiscard]] uint32_t find(std::string_view path) const;
+
+    // the groups at or below 'path', all of them for an empty path, in the order of their paths
+    [[nodiscard]] std::vector<group_snapshot> snapshot(std::string_view path) const;
+
+private:
+    struct group_node
+    {
+        std::string path;
+        uint32_t parent = no_group;
+        uint32_t targets = 0;
+        std::atomic<uint32_t> down{0};
+        std::atomic<uint64_t> replies{0};
+        std::atomic<uint64_t> losses{0};
+        std::atomic<double> rtt_total_ms{0.0};
+        std::array<std::atomic<uint64_t>, rtt_histogram_buckets> histogram{};
+    };
+
+    // adds to a counter of the probe thread, which is the only writer, without a locked instruction
+    template <typename T, typename U>
+    static void add(std::atomic<T> & counter, U value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    std::unique_ptr<group_node[]> m_groups; // sorted by path, so a group comes before the groups below it
+    size_t m_group_count = 0;
+    std::vector<uint32_t> m_group_of;
+};
+
+} // namespace icmp_ns
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/ip_icmp.h>
+
+#include <cstring>
+#include <fmt/core.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "icmp.h"
+#include "icmp_ids.h"
+
+namespace icmp_ns {
+
+sockaddr_in resolve_address(const std::string & address)
+{
+    const uint16_t port = 0;
+    hostent * host_entity = gethostbyname(address.data());
+    if (host_entity == NULL)
+    {
+        throw std::runtime_error(fmt::format("gethostbyname for '{}' failed.", address));
+    }
+
+    sockaddr_in result{};
+    result.sin_family = host_entity->h_addrtype;
+    result.sin_port = htons(port);
+    result.sin_addr.s_addr = *(long *)host_entity->h_addr;
+    return result;
+}
+
+uint16_t calculate_checksum(const void * data, size_t size)
+{
+    return fold_checksum(sum_network_words(static_cast<const uint8_t *>(data), size));
+}
+
+uint16_t calculate_checksum(const ping_pkt & packet)
+{
+    return fold_checksum(sum_network_words(packet.hdr) + sum_network_words(packet.payload, icmp_payload_length));
+}
+
+ping_pkt make_icmp_packet(uint16_t sequence, std::optional<uint16_t> flow, std::optional<uint16_t> id)
+{
+    auto icmp_packet = make_echo_request(id ? *id : process_icmp_id(), sequence);
+    if (flow)
+    {
+        set_flow_checksum(icmp_packet, *flow);
+    }
+    return icmp_packet;
+}
+
+icmp_payload_template::icmp_payload_template(size_t max_length) :
+    m_payload(max_length),
+    m_prefix_sums(max_length / 2 + 1)
+{
+    for (size_t i = 0; i < max_length; ++i)
+    {
+        m_payload[i] = static_cast<char>('0' + i);
+    }
+    for (size_t word = 0; word < max_length / 2; ++word)
+    {
+        m_prefix_sums[word + 1] = m_prefix_sums[word] + sum_network_words(&m_payload[word * 2], 2);
+    }
+}
+
+icmp_header icmp_payload_template::make_header(uint16_t sequence, size_t length) const
+{
+    auto header = make_echo_header(ICMP_ECHO, process_icmp_id(), sequence);
+
+    // the header is 8 bytes, so the payload starts at an even offset and its words line up with the precomputed sums
+    uint32_t sum = sum_network_words(header) + m_prefix_sums[length / 2];
+    if (length % 2 == 1)
+    {
+        sum += sum_network_words(&m_payload[length - 1], 1);
+    }
+    store_be16(header.checksum, fold_checksum(sum));
+    return header;
+}
+
+void set_flow_checksum(ping_pkt & packet, uint16_t checksum)
+{
+    // a valid packet sums to 0xFFFF (in one's complement arithmetic) including its checksum field.
+    // with the compensation word and the checksum field zeroed the packet sums to 'sum',
+    // so the compensation word must be the one's complement of 'sum + checksum'.
+    auto * compensation = reinterpret_cast<uint8_t *>(&packet.payload[0]);
+    store_be16(compensation, 0);
+    store_be16(packet.hdr.checksum, 0);
+    uint32_t sum = static_cast<uint16_t>(~calculate_checksum(packet));
+    sum += checksum;
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    store_be16(compensation, static_cast<uint16_t>(~sum));
+    store_be16(packet.hdr.checksum, checksum);
+}
+
+bool verify_reply(const ping_pkt & sent, const ping_pkt & received, int expected_id)
+{
+    if (received.hdr.type != ICMP_ECHOREPLY)
+    {
+        return false;
+    }
+    if (received.hdr.code != 0)
+    {
+        return false;
+    }
+    if (echo_id(received.hdr) != expected_id)
+    {
+        return false;
+    }
+    if (echo_sequence(received.hdr) != echo_sequence(sent.hdr))
+    {
+        return false;
+    }
+    if (memcmp(&sent.payload[0], &received.payload[0], icmp_payload_length) != 0)
+    {
+        return false;
+    }
+    return true;
+}
+
+// the ip header length is variable, the ihl field holds its length in 32-bit words. returns 0 if it is truncated.
+static size_t get_ip_header_length(const std::vector<char> & packet, size_t offset, ipv4_header & header)
+{
+    if (packet.size() < offset + sizeof(ipv4_header))
+    {
+        return 0;
+    }
+    std::memcpy(&header, &packet[offset], sizeof(header));
+    return ipv4_header_length(header);
+}
+
+bool is_icmp_error(uint8_t type)
+{
+    switch (type)
+    {
+    case ICMP_DEST_UNREACH:
+    case ICMP_SOURCE_QUENCH:
+    case ICMP_TIME_EXCEEDED:
+    case ICMP_PARAMETERPROB: return true;
+    default: return false;
+    }
+}
+
+static std::string describe_unreachable(uint8_t code)
+{
+    switch (code)
+    {
+    case ICMP_NET_UNREACH: return "network unreachable";
+    case ICMP_HOST_UNREACH: return "host unreachable";
+    case ICMP_PROT_UNREACH: return "protocol unreachable";
+    case ICMP_PORT_UNREACH: return "port unreachable";
+    case ICMP_FRAG_NEEDED: return "fragmentation needed";
+    case ICMP_SR_FAILED: return "source route failed";
+    case ICMP_NET_UNKNOWN: return "network unknown";
+    case ICMP_HOST_UNKNOWN: return "host unknown";
+    case ICMP_HOST_ISOLATED: return "source host isolated";
+    case ICMP_NET_ANO: return "network administratively prohibited";
+    case ICMP_HOST_ANO: return "host administratively prohibited";
+    case ICMP_NET_UNR_TOS: return "network unreachable for type of service";
+    case ICMP_HOST_UNR_TOS: return "host unreachable for type of service";
+    case ICMP_PKT_FILTERED: return "communication administratively prohibited";
+    case ICMP_PREC_VIOLATION: return "host precedence violation";
+    case ICMP_PREC_CUTOFF: return "precedence cutoff in effect";
+    default: return "unknown code";
+    }
+}
+
+std::string describe_icmp_message(uint8_t type, uint8_t code)
+{
+    switch (type)
+    {
+    case ICMP_ECHOREPLY: return "Echo Reply";
+    case ICMP_TIMESTAMPREPLY: return "Timestamp Reply";
+    case ICMP_DEST_UNREACH: return fmt::format("Destination Unreachable ({}, code {})", describe_unreachable(code), code);
+    case ICMP_SOURCE_QUENCH: return "Source Quench";
+    case ICMP_TIME_EXCEEDED: return code == ICMP_EXC_FRAGTIME ? "Time Exceeded (fragment reassembly)" : "Time Exceeded (TTL)";
+    case ICMP_PARAMETERPROB: return fmt::format("Parameter Problem (code {})", code);
+    default: return fmt::format("ICMP type {} code {}", type, code);
+    }
+}
+
+std::optional<icmp_message> decode_icmp_message(const std::vector<char> & packet, in_addr source)
+{
+    ipv4_header outer_ip;
+    auto outer_length = get_ip_header_length(packet, 0, outer_ip);
+    if (outer_length == 0 || packet.size() < outer_length + sizeof(icmp_header))
+    {
+        return {};
+    }
+    icmp_header header;
+    std::memcpy(&header, &packet[outer_length], sizeof(header));
+
+    icmp_message message;
+    message.source = source;
+    message.type = header.type;
+    message.code = header.code;
+    if (header.type == ICMP_ECHOREPLY || header.type == ICMP_TIMESTAMPREPLY)
+    {
+        message.destination = source;
+        message.id = echo_id(header);
+        message.sequence = echo_sequence(header);
+        if (header.type == ICMP_TIMESTAMPREPLY)
+        {
+            icmp_timestamp_message reply;
+            if (packet.size() < outer_length + sizeof(reply))
+            {
+                return {};
+            }
+            std::memcpy(&reply, &packet[outer_length], sizeof(reply));
+            message.timestamps = icmp_timestamps{load_be32(reply.originate), load_be32(reply.receive), load_be32(reply.transmit)};
+        }
+        return message;
+    }
+    if (!is_icmp_error(header.type))
+    {
+        return {};
+    }
+
+    // an icmp error quotes the ip header and at least the first 8 bytes of the packet that caused it,
+    // for an echo (or timestamp) request those 8 bytes are exactly its icmp header, including the id and sequence.
+    auto quoted_offset = outer_length + sizeof(icmp_header);
+    ipv4_header quoted_ip;
+    auto quoted_length = get_ip_header_length(packet, quoted_offset, quoted_ip);
+    if (quoted_length == 0 || packet.size() < quoted_offset + quoted_length + sizeof(icmp_header))
+    {
+        return {};
+    }
+    icmp_header quoted_icmp;
+    std::memcpy(&quoted_icmp, &packet[quoted_offset + quoted_length], sizeof(quoted_icmp));
+    if (quoted_ip.protocol != IPPROTO_ICMP || (quoted_icmp.type != ICMP_ECHO && quoted_icmp.type != ICMP_TIMESTAMP))
+    {
+        return {};
+    }
+    message.destination.s_addr = htonl(load_be32(quoted_ip.destination));
+    if (header.type == ICMP_DEST_UNREACH && header.code == ICMP_FRAG_NEEDED)
+    {
+        message.mtu = next_hop_mtu(header);
+    }
+    message.id = echo_id(quoted_icmp);
+    message.sequence = echo_sequence(quoted_icmp);
+    return message;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fmt/core.h>
+#include <functional>
+#include <initializer_list>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "realtime.h"
+#include "wire.h"
+
+using double_milliseconds = std::chrono::duration<double, std::milli>;
+
+namespace icmp_ns {
+
+// you can choose to send more or less dummy payload data
+static const int icmp_payload_length = 64 - sizeof(icmp_header);
+struct ping_pkt
+{
+    icmp_header hdr;
+    char payload[icmp_payload_length];
+};
+
+static_assert(sizeof(ping_pkt) == 64 && offsetof(ping_pkt, payload) == sizeof(icmp_header), "ping_pkt is sent as raw bytes");
+
+// the payload of every echo request, '0', '1', '2'... and its part of the checksum, computed at compile time
+[[nodiscard]] constexpr std::array<char, icmp_payload_length> make_echo_payload()
+{
+    std::array<char, icmp_payload_length> payload{};
+    for (int i = 0; i < icmp_payload_length; ++i)
+    {
+        payload[i] = static_cast<char>('0' + i);
+    }
+    return payload;
+}
+inline constexpr auto echo_payload = make_echo_payload();
+inline constexpr uint32_t echo_payload_sum = sum_network_words(echo_payload.data(), echo_payload.size());
+
+// an echo request, built at compile time when the id and sequence are constants. otherwise it is a copy of the
+// constant payload and an 8-byte header whose checksum only needs the sum of its own 4 words.
+[[nodiscard]] constexpr ping_pkt make_echo_request(uint16_t id, uint16_t sequence)
+{
+    ping_pkt packet{};
+    packet.hdr = make_echo_header(ICMP_ECHO, id, sequence);
+    for (int i = 0; i < icmp_payload_length; ++i)
+    {
+        packet.payload[i] = echo_payload[i];
+    }
+    store_be16(packet.hdr.checksum, fold_checksum(sum_network_words(packet.hdr) + echo_payload_sum));
+    return packet;
+}
+
+// a timestamp request with 'originate' as its originate time, the receive and transmit times are left zero for the target
+[[nodiscard]] constexpr icmp_timestamp_message make_timestamp_request(uint16_t id, uint16_t sequence, uint32_t originate)
+{
+    icmp_timestamp_message message{};
+    message.header = make_echo_header(ICMP_TIMESTAMP, id, sequence); // every icmp query has the id and sequence of an echo request
+    store_be32(message.originate, originate);
+    store_be16(message.header.checksum, fold_checksum(sum_network_words(message)));
+    return message;
+}
+
+// a correct checksum makes the whole packet sum to 0xFFFF, which folds to 0
+static_assert(fold_checksum(sum_network_words(make_timestamp_request(0x1234, 7, 45296789))) == 0);
+static_assert(fold_checksum(sum_network_words(make_echo_request(0x1234, 7).hdr) + sum_network_words(make_echo_request(0x1234, 7).payload, icmp_payload_length)) == 0);
+
+// the checksum of network order data, to be stored with store_be16()
+[[nodiscard]] uint16_t calculate_checksum(const void * data, size_t size);
+[[nodiscard]] uint16_t calculate_checksum(const ping_pkt & packet);
+
+// the times in a timestamp reply, in milliseconds since midnight UT
+struct icmp_timestamps
+{
+    uint32_t originate = 0; // when the request was sent, as written in it by the sender
+    uint32_t receive = 0;   // when the target received the request
+    uint32_t transmit = 0;  // when the target sent the reply
+};
+
+// a received icmp message reduced to the fields needed to match it to the echo (or timestamp) request that caused it.
+// for an echo reply the id and sequence are read from the reply itself,
+// for an error message (like time exceeded or destination unreachable) they are read from the echo request that is quoted inside the error.
+struct icmp_message
+{
+    in_addr source{};      // the host that sent the message, for errors this is the router that reported it
+    in_addr destination{}; // the destination of the original echo request
+    uint8_t type = 0;
+    uint8_t code = 0;
+    uint16_t id = 0;
+    uint16_t sequence = 0;
+    uint16_t mtu = 0; // the next-hop mtu reported in a fragmentation needed error, 0 if not reported
+    std::optional<icmp_timestamps> timestamps; // the times in a timestamp reply
+};
+
+// returns true for the icmp error messages that quote the packet that caused them
+[[nodiscard]] bool is_icmp_error(uint8_t type);
+
+// returns a readable description like "Destination Unreachable (host unreachable, code 1)"
+[[nodiscard]] std::string describe_icmp_message(uint8_t type, uint8_t code);
+
+// decodes a raw packet (including its ip header), returns nothing for messages that can not be matched to an echo request.
+[[nodiscard]] std::optional<icmp_message> decode_icmp_message(const std::vector<char> & packet, in_addr source);
+
+struct batch_packet
+{
+    const void * data;
+    size_t size;
+    int ttl;                                  // 0 means the TTL set on the socket is used
+    const sockaddr_in * destination = nullptr; // nullptr means the address the socket was created for
+    const void * payload = nullptr;            // optionally sent right after 'data', see icmp_payload_template
+    size_t payload_size = 0;
+};
+
+// resolves a hostname or ipaddress, throws if it can not be resolved
+[[nodiscard]] sockaddr_in resolve_address(const std::string & address);
+
+class icmp_socket
+{
+public:
+    explicit icmp_socket(std::string address) :
+        m_address(address)
+    {
+        dns_lookup_and_store_address();
+        open_socket();
+    }
+
+    // a socket that is not tied to one destination, every packet passed to send_batch() carries its own destination.
+    icmp_socket()
+    {
+        open_socket();
+    }
+
+    icmp_socket(const icmp_socket &) = delete;
+    icmp_socket & operator=(const icmp_socket &) = delete;
+
+    ~icmp_socket()
+    {
+        ::close(m_socket_fd);
+    }
+
+    void open_socket()
+    {
+        m_socket_fd = ::socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+        if (m_socket_fd < 0)
+        {
+            throw std::runtime_error(fmt::format("descriptor for icmp_socket to '{}' could not be "
+                                                 "created. (requires root)",
+                                                 m_address));
+        }
+    }
+
+    void dns_lookup_and_store_address()
+    {
+        m_sockaddr_in = resolve_address(m_address);
+        m_name = inet_ntoa(m_sockaddr_in.sin_addr);
+    }
+
+    template <typename T>
+    bool set_socket_option(int level, int option, const T value)
+    {
+        return setsockopt(m_socket_fd, level, option, &value, sizeof(value)) == 0;
+    }
+
+    void set_TTL(const int ttl)
+    {
+        if (!set_socket_option(SOL_IP, IP_TTL, ttl))
+        {
+            throw std::runtime_error(fmt::format("could not set TTL to '{}'", ttl));
+        }
+    }
+
+    // IP_PMTUDISC_PROBE sets the don't fragment bit but ignores the path mtu the kernel has cached,
+    // so packets larger than a known path mtu can still be sent to probe it.
+    void set_mtu_discover(int mode)
+    {
+        if (!set_socket_option(SOL_IP, IP_MTU_DISCOVER, mode))
+        {
+            throw std::runtime_error(fmt::format("could not set IP_MTU_DISCOVER to '{}'", mode));
+        }
+    }
+
+    void set_receive_timeout(std::chrono::milliseconds timeout)
+    {
+        int total_ms = timeout.count();
+        int seconds = total_ms / 1000;
+        int useconds = (total_ms - (seconds * 1000)) * 1000;
+        timeval tv_out{};
+        tv_out.tv_sec = seconds;
+        tv_out.tv_usec = useconds;
+        if (!set_socket_option(SOL_SOCKET, SO_RCVTIMEO, tv_out))
+        {
+            throw std::runtime_error(fmt::format("could not set receive timeout to '{}'ms", total_ms));
+        }
+    }
+
+    // enlarges the kernel receive buffer, so a burst of replies to a batch of probes is not dropped.
+    void set_receive_buffer_size(int bytes)
+    {
+        // SO_RCVBUFFORCE may exceed net.core.rmem_max but requires CAP_NET_ADMIN, SO_RCVBUF is capped at rmem_max
+        if (!set_socket_option(SOL_SOCKET, SO_RCVBUFFORCE, bytes) && !set_socket_option(SOL_SOCKET, SO_RCVBUF, bytes))
+        {
+            throw std::runtime_error(fmt::format("could not set receive buffer size to '{}' bytes", bytes));
+        }
+    }
+
+    // a raw icmp socket receives a copy of every icmp message, including the echo requests we send to a local address.
+    // the kernel drops all message types that are not accepted here before they are queued on the socket.
+    void set_icmp_filter(std::initializer_list<int> accepted_types)
+    {
+        const int icmp_filter_option = 1; // ICMP_FILTER from <linux/icmp.h>, that header clashes with <netinet/ip_icmp.h>
+        uint32_t filter = ~0u;
+        for (auto type : accepted_types)
+        {
+            filter &= ~(1u << type);
+        }
+        if (!set_socket_option(SOL_RAW, icmp_filter_option, filter))
+        {
+            throw std::runtime_error("could not set icmp filter");
+        }
+    }
+
+    // sends every packet out of one interface and only receives packets that arrived on it (SO_BINDTODEVICE),
+    // whatever interface the routing table would choose. requires CAP_NET_RAW, which a raw socket needs anyway.
+    void bind_to_device(const std::string & device)
+    {
+        if (setsockopt(m_socket_fd, SOL_SOCKET, SO_BINDTODEVICE, device.c_str(), device.size()) != 0)
+        {
+            throw std::runtime_error(fmt::format("could not bind icmp socket to device '{}': {}", device, std::strerror(errno)));
+        }
+    }
+
+    // sends every packet from a local address, and only receives packets sent to that address.
+    // on a multi-homed host this selects the source address (and so the return path) of every probe.
+    void bind_to_address(in_addr address)
+    {
+        sockaddr_in local{};
+        local.sin_family = AF_INET;
+        local.sin_addr = address;
+        if (::bind(m_socket_fd, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0)
+        {
+            throw std::runtime_error(fmt::format("could not bind icmp socket to source address '{}': {}", inet_ntoa(address), std::strerror(errno)));
+        }
+    }
+
+    // only queue echo replies and the icmp errors that can be about an echo request
+    void accept_replies_and_errors()
+    {
+        set_icmp_filter({ICMP_ECHOREPLY, ICMP_DEST_UNREACH, ICMP_SOURCE_QUENCH, ICMP_TIME_EXCEEDED, ICMP_PARAMETERPROB});
+    }
+
+    // the same for timestamp requests, see timestamp_probe()
+    void accept_timestamp_replies_and_errors()
+    {
+        set_icmp_filter({ICMP_TIMESTAMPREPLY, ICMP_DEST_UNREACH, ICMP_SOURCE_QUENCH, ICMP_TIME_EXCEEDED, ICMP_PARAMETERPROB});
+    }
+
+    // allocates and touches the receive buffer up front, so receiving a reply never causes a page fault.
+    void prefault_buffers(size_t bytes)
+    {
+        m_receive_buffer.resize(bytes);
+        prefault(m_receive_buffer.data(), m_receive_buffer.size());
+    }
+
+    // asks the kernel to timestamp every packet when it arrives (SO_TIMESTAMPNS), see get_received_timestamp().
+    // these timestamps do not include the time it takes to wake up the receiving thread.
+    void enable_receive_timestamps()
+    {
+        if (!set_socket_option(SOL_SOCKET, SO_TIMESTAMPNS, 1))
+        {
+            throw std::runtime_error("could not enable receive timestamps");
+        }
+    }
+
+    [[nodiscard]] const std::vector<char> & receive(size_t bytes)
+    {
+        m_receive_buffer.resize(bytes);
+        iovec vector{&m_receive_buffer[0], m_receive_buffer.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec))];
+        msghdr header{};
+        header.msg_name = &m_received_from;
+        header.msg_namelen = sizeof(m_received_from);
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        auto bytes_received = recvmsg(m_socket_fd, &header, 0);
+        m_received_timestamp.reset();
+        if (bytes_received <= 0)
+        {
+            m_receive_buffer.clear();
+            return m_receive_buffer; // return empty meaning, we received no reply within the timeout
+        }
+        for (auto * message = CMSG_FIRSTHDR(&header); message != nullptr; message = CMSG_NXTHDR(&header, message))
+        {
+            if (message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                timespec timestamp;
+                std::memcpy(&timestamp, CMSG_DATA(message), sizeof(timestamp));
+                m_received_timestamp = std::chrono::seconds(timestamp.tv_sec) + std::chrono::nanoseconds(timestamp.tv_nsec);
+            }
+        }
+        m_receive_buffer.resize(bytes_received);
+        return m_receive_buffer;
+    }
+
+    // waits until data can be received or the timeout expires, returns false on timeout.
+    [[nodiscard]] bool wait_for_data(std::chrono::milliseconds timeout) const
+    {
+        pollfd descriptor{m_socket_fd, POLLIN, 0};
+        return ::poll(&descriptor, 1, static_cast<int>(std::max<std::chrono::milliseconds::rep>(timeout.count(), 0))) > 0;
+    }
+
+    // sends all packets with a single sendmmsg() call, so they leave back-to-back.
+    // the TTL is passed per packet as ancillary data, so no setsockopt is needed between packets.
+    // sending stops at the first packet that is too large for the outgoing interface (EMSGSIZE),
+    // returns the number of packets that were sent.
+    size_t send_batch(const std::vector<batch_packet> & packets) const
+    {
+        return send_messages(packets, nullptr);
+    }
+
+    // like send_batch(), but a packet that can not be sent (no route, interface down, too large) is passed to 'failed'
+    // with its index and errno and skipped, so one bad destination does not hold back the packets after it.
+    size_t send_batch(const std::vector<batch_packet> & packets, const std::function<void(size_t index, int error)> & failed) const
+    {
+        return send_messages(packets, &failed);
+    }
+
+    size_t send_messages(const std::vector<batch_packet> & packets, const std::function<void(size_t, int)> * failed) const
+    {
+        struct ttl_control
+        {
+            alignas(cmsghdr) char buffer[CMSG_SPACE(sizeof(int))];
+        };
+        std::vector<mmsghdr> messages(packets.size());
+        std::vector<iovec> vectors(packets.size() * 2);
+        std::vector<ttl_control> controls(packets.size());
+        for (size_t i = 0; i < packets.size(); ++i)
+        {
+            // the kernel gathers the packet from up to two parts, a payload can be shared by many packets this way
+            auto * parts = &vectors[i * 2];
+            parts[0].iov_base = const_cast<void *>(packets[i].data);
+            parts[0].iov_len = packets[i].size;
+            parts[1].iov_base = const_cast<void *>(packets[i].payload);
+            parts[1].iov_len = packets[i].payload_size;
+            auto & header = messages[i].msg_hdr;
+            header.msg_name = const_cast<sockaddr_in *>(packets[i].destination != nullptr ? packets[i].destination : &m_sockaddr_in);
+            header.msg_namelen = sizeof(sockaddr_in);
+            header.msg_iov = parts;
+            header.msg_iovlen = packets[i].payload_size > 0 ? 2 : 1;
+            if (packets[i].ttl > 0)
+            {
+                header.msg_control = controls[i].buffer;
+                header.msg_controllen = sizeof(controls[i].buffer);
+                auto * control = CMSG_FIRSTHDR(&header);
+                control->cmsg_level = SOL_IP;
+                control->cmsg_type = IP_TTL;
+                control->cmsg_len = CMSG_LEN(sizeof(int));
+                std::memcpy(CMSG_DATA(control), &packets[i].ttl, sizeof(int));
+            }
+        }
+
+        // sendmmsg() only reports the error of a message that is the first one of the call,
+        // so a failed message is always the one at 'position'
+        size_t sent = 0;
+        size_t position = 0;
+        while (position < messages.size())
+        {
+            auto result = ::sendmmsg(m_socket_fd, &messages[position], messages.size() - position, 0);
+            if (result < 0 && failed != nullptr)
+            {
+                (*failed)(position, errno);
+                ++position;
+                continue;
+            }
+            if (result < 0 && errno == EMSGSIZE)
+            {
+                break;
+            }
+            if (result <= 0)
+            {
+                throw std::runtime_error(fmt::format("could not send packets to '{}'", m_address));
+            }
+            sent += result;
+            position += result;
+        }
+        return sent;
+    }
+
+    void send(const void * data, size_t size) const
+    {
+        auto result = ::sendto(m_socket_fd, data, size, 0, (sockaddr *)&m_sockaddr_in, sizeof(m_sockaddr_in));
+        if (result <= 0)
+        {
+            throw std::runtime_error(fmt::format("could not send packet to '{}'", m_address));
+        }
+    }
+
+    template <typename T>
+    [[nodiscard]] T get_received_data(size_t offset) const
+    {
+        T result;
+        std::memcpy(&result, &m_receive_buffer[offset], sizeof(T));
+        return result;
+    }
+
+    template <typename T>
+    void send_object(const T & object) const
+    {
+        send(&object, sizeof(object));
+    }
+
+    [[nodiscard]] int get_fd() const { return m_socket_fd; }
+    [[nodiscard]] std::string get_name() const { return m_name; }
+    [[nodiscard]] sockaddr_in get_sockadd_in() const { return m_sockaddr_in; }
+    [[nodiscard]] in_addr get_received_from() const { return m_received_from.sin_addr; }
+    // the kernel timestamp (CLOCK_REALTIME) of the last received packet, only available after enable_receive_timestamps()
+    [[nodiscard]] std::optional<std::chrono::nanoseconds> get_received_timestamp() const { return m_received_timestamp; }
+
+    sockaddr_in m_sockaddr_in{};
+    sockaddr_in m_received_from{};
+    std::optional<std::chrono::nanoseconds> m_received_timestamp;
+    int m_socket_fd;
+    std::string m_address;
+    std::string m_name;
+    std::vector<char> m_receive_buffer;
+};
+
+// with a flow id the checksum of the packet is fixed to that id, see set_flow_checksum().
+// the icmp id is process_icmp_id(), unless a socket uses a range of ids of its own (see engine_options::first_id).
+[[nodiscard]] ping_pkt make_icmp_packet(uint16_t sequence, std::optional<uint16_t> flow = {}, std::optional<uint16_t> id = {});
+
+// the payload of echo requests whose size is chosen at runtime, it has the same pattern as the payload of ping_pkt.
+// the payload is filled once and the checksum of every prefix of it is precomputed, so an echo request of any size and
+// sequence number only needs a new 8-byte header, which make_header() returns in O(1).
+// send the header as batch_packet::data and the first 'length' bytes of data() as batch_packet::payload.
+class icmp_payload_template
+{
+public:
+    explicit icmp_payload_template(size_t max_length);
+
+    [[nodiscard]] icmp_header make_header(uint16_t sequence, size_t length) const;
+    [[nodiscard]] const char * data() const { return m_payload.data(); }
+    [[nodiscard]] size_t max_length() const { return m_payload.size(); }
+
+private:
+    std::vector<char> m_payload;
+    std::vector<uint32_t> m_prefix_sums; // m_prefix_sums[i] is the sum of the first i 16-bit words of the payload
+};
+
+// routers that spread traffic over equal-cost paths (ECMP) hash the first bytes of the icmp header, including the checksum.
+// normally the checksum changes with every sequence number, so every probe can take a different path (Paris traceroute).
+// this sets the first two payload bytes so that the checksum becomes 'checksum', keeping all probes of a flow on one path
+// while the sequence number still identifies each probe. the checksum of the echo reply is then constant as well.
+void set_flow_checksum(ping_pkt & packet, uint16_t checksum);
+
+// when sending icmp ping packets using raw sockets verifing the echo.id is
+// required otherwise you maybe looking at unrelated ping replys
+[[nodiscard]] bool verify_reply(const ping_pkt & sent, const ping_pkt & received, int expected_id);
+
+} // namespace icmp_ns
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <fmt/core.h>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include "icmp_ids.h"
+
+namespace icmp_ns {
+
+namespace {
+
+constexpr size_t icmp_id_count = 65536;
+
+static_assert(std::atomic<int32_t>::is_always_lock_free, "the registry is shared between processes, its atomics must not use a lock of one process");
+
+bool process_exists(pid_t pid)
+{
+    return ::kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// the ids claimed by this process, in the registry shared by all processes if it could be opened
+class icmp_id_registry
+{
+public:
+    icmp_id_registry() :
+        m_claimed(icmp_id_count, false)
+    {
+        auto fd = ::shm_open("/ping-icmp-ids", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0)
+        {
+            return;
+        }
+        // like a shard block: a registry of zeros is empty, so the processes that create it at the same time need no lock
+        struct stat status{};
+        if (::fstat(fd, &status) == 0 && (static_cast<size_t>(status.st_size) >= sizeof(owner_table) || ::ftruncate(fd, sizeof(owner_table)) == 0))
+        {
+            auto * data = ::mmap(nullptr, sizeof(owner_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            m_owners = data == MAP_FAILED ? nullptr : static_cast<owner_table *>(data);
+        }
+        ::close(fd);
+    }
+
+    ~icmp_id_registry()
+    {
+        if (m_owners == nullptr)
+        {
+            return;
+        }
+        for (size_t id = 0; id < icmp_id_count; ++id)
+        {
+            if (m_claimed[id])
+            {
+                auto current = m_pid;
+                m_owners->pids[id].compare_exchange_strong(current, 0);
+            }
+        }
+        ::munmap(m_owners, sizeof(owner_table));
+    }
+
+    icmp_id_registry(const icmp_id_registry &) = delete;
+    icmp_id_registry & operator=(const icmp_id_registry &) = delete;
+
+    uint16_t claim(uint16_t count)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto start = std::uniform_int_distribution<size_t>(0, icmp_id_count - 1)(m_random);
+        for (size_t offset = 0; offset < icmp_id_count; ++offset)
+        {
+            auto first = (start + offset) % icmp_id_count;
+            uint16_t claimed = 0;
+            while (claimed < count && claim_id((first + claimed) % icmp_id_count))
+            {
+                ++claimed;
+            }
+            if (claimed == count)
+            {
+                return static_cast<uint16_t>(first);
+            }
+            while (claimed > 0)
+            {
+                release_id((first + --claimed) % icmp_id_count);
+            }
+        }
+        throw std::runtime_error(fmt::format("no {} consecutive icmp ids are free", count));
+    }
+
+private:
+    struct owner_table
+    {
+        std::atomic<int32_t> pids[icmp_id_count]; // the process that claimed the id, 0 for none
+    };
+
+    bool claim_id(size_t id)
+    {
+        if (m_claimed[id])
+        {
+            return false;
+        }
+        if (m_owners != nullptr)
+        {
+            auto & owner = m_owners->pids[id];
+            auto current = owner.load();
+            if ((current != 0 && (current == m_pid || process_exists(current))) || !owner.compare_exchange_strong(current, m_pid))
+            {
+                return false;
+            }
+        }
+        m_claimed[id] = true;
+        return true;
+    }
+
+    void release_id(size_t id)
+    {
+        m_claimed[id] = false;
+        if (m_owners != nullptr)
+        {
+            m_owners->pids[id].store(0);
+        }
+    }
+
+    std::mutex m_mutex;
+    std::mt19937 m_random{std::random_device{}()};
+    int32_t m_pid = ::getpid();
+    owner_table * m_owners = nullptr;
+    std::vector<bool> m_claimed; // by this process
+};
+
+icmp_id_registry & registry()
+{
+    static icmp_id_registry ids;
+    return ids;
+}
+
+} // namespace
+
+uint16_t claim_icmp_ids(uint16_t count)
+{
+    return registry().claim(count);
+}
+
+uint16_t process_icmp_id()
+{
+    static const uint16_t id = claim_icmp_ids(1);
+    return id;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace icmp_ns {
+
+// a raw icmp socket receives the echo replies of every process on the host, it can only tell its own apart by the icmp id.
+// so the ids are not derived from the process id, where neighbouring processes get overlapping ranges, but claimed in a
+// registry in shared memory (/dev/shm/ping-icmp-ids) that maps every id to the process that uses it. the search for free
+// ids starts at a random id, an id is free when it has no owner or its owner process is gone, and the claims of a process
+// are released when it exits. when the registry can not be opened the ids are random, without the guarantee.
+
+// claims 'count' consecutive ids (modulo 65536) for this process and returns the first one
+[[nodiscard]] uint16_t claim_icmp_ids(uint16_t count);
+
+// the id of the probes that do not use a range of their own, claimed once per process
+[[nodiscard]] uint16_t process_icmp_id();
+
+} // namespace icmp_ns
@@ -0,0 +1,631 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fmt/core.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "icmp.h"
+#include "icmp_ids.h"
+#include "mesh.h"
+#include "policies.h"
+
+// a mesh backend sends the probe of one source to one destination and tells how every probe ended:
+//   static constexpr const char * name;
+//   void send(uint32_t source, uint32_t destination, int64_t now);
+//   template <typename F> void receive(int64_t timeout_ns, F && on_result);   calls on_result(source, destination, rtt_ns) for every
+//                                                                            reply that arrives before the timeout, and with
+//                                                                            std::nullopt for every probe that timed out
+//   size_t outstanding() const;                                              the probes that did not end yet
+
+namespace icmp_ns {
+
+static const char mesh_magic[8] = {'P', 'I', 'N', 'G', 'M', 'E', 'S', 'H'};
+const uint32_t mesh_version = 2;
+
+static_assert(sizeof(mesh_cell) == 16, "four cells per cache line");
+static_assert(std::is_trivially_copyable_v<mesh_cell>, "the cells are written to a snapshot as raw bytes");
+
+double mesh_bucket_limit(size_t bucket)
+{
+    return static_cast<double>(64ull << bucket) / 1000.0;
+}
+
+static size_t mesh_bucket(int64_t rtt_ns)
+{
+    auto microseconds = static_cast<uint64_t>(std::max<int64_t>(rtt_ns / 1000, 0));
+    if (microseconds < 64)
+    {
+        return 0;
+    }
+    size_t bucket = 63 - __builtin_clzll(microseconds) - 5;
+    return std::min(bucket, mesh_sketch_buckets - 1);
+}
+
+latency_matrix::latency_matrix(size_t peers, std::vector<uint32_t> sources) :
+    m_peers(peers),
+    m_sources(std::move(sources)),
+    m_rows(peers),
+    m_cells(m_sources.size() * peers)
+{
+    for (uint32_t row = 0; row < m_sources.size(); ++row)
+    {
+        m_rows[m_sources[row]] = row;
+    }
+}
+
+void latency_matrix::add_result(size_t source, size_t destination, std::optional<int64_t> rtt_ns)
+{
+    auto & cell = mutable_cell(source, destination);
+    if (cell.sent == UINT16_MAX)
+    {
+        cell.sent /= 2;
+        cell.received /= 2;
+    }
+    ++cell.sent;
+    if (!rtt_ns)
+    {
+        return;
+    }
+    ++cell.received;
+    auto bucket = mesh_bucket(*rtt_ns);
+    if (cell.sketch[bucket] == UINT8_MAX)
+    {
+        for (auto & count : cell.sketch)
+        {
+            count /= 2;
+        }
+    }
+    ++cell.sketch[bucket];
+}
+
+double latency_matrix::loss(size_t source, size_t destination) const
+{
+    const auto & cell = this->cell(source, destination);
+    return cell.sent > 0 ? 1.0 - static_cast<double>(cell.received) / cell.sent : 0.0;
+}
+
+double latency_matrix::percentile(size_t source, size_t destination, double fraction) const
+{
+    const auto & sketch = cell(source, destination).sketch;
+    uint32_t total = 0;
+    for (auto count : sketch)
+    {
+        total += count;
+    }
+    auto rank = static_cast<uint32_t>(std::ceil(fraction * total));
+    uint32_t seen = 0;
+    for (size_t bucket = 0; bucket < mesh_sketch_buckets; ++bucket)
+    {
+        seen += sketch[bucket];
+        if (seen >= rank && sketch[bucket] > 0)
+        {
+            return mesh_bucket_limit(bucket);
+        }
+    }
+    return 0.0;
+}
+
+static void write_all(int fd, const void * data, size_t size, const std::string & path)
+{
+    auto * bytes = static_cast<const char *>(data);
+    while (size > 0)
+    {
+        auto written = ::write(fd, bytes, size);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            auto error = errno;
+            ::close(fd);
+            throw std::runtime_error(fmt::format("could not write mesh snapshot '{}': {}", path, std::strerror(error)));
+        }
+        bytes += written;
+        size -= written;
+    }
+}
+
+void write_mesh_snapshot(const std::string & path, const std::vector<sockaddr_in> & peers, const latency_matrix & matrix, std::chrono::milliseconds interval,
+                         uint64_t rounds)
+{
+    mesh_snapshot_header header{};
+    std::memcpy(header.magic, mesh_magic, sizeof(header.magic));
+    header.version = mesh_version;
+    header.cell_size = sizeof(mesh_cell);
+    header.peers = static_cast<uint32_t>(peers.size());
+    header.sketch_buckets = mesh_sketch_buckets;
+    header.rows = static_cast<uint32_t>(matrix.sources().size());
+    header.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    header.interval_ms = interval.count();
+    header.rounds = rounds;
+
+    // padded, so the cells start at a multiple of their size
+    std::vector<in_addr> addresses((peers.size() + 3) / 4 * 4);
+    for (size_t i = 0; i < peers.size(); ++i)
+    {
+        addresses[i] = peers[i].sin_addr;
+    }
+
+    std::vector<uint32_t> sources((matrix.sources().size() + 3) / 4 * 4);
+    std::copy(matrix.sources().begin(), matrix.sources().end(), sources.begin());
+
+    auto temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error(fmt::format("could not open mesh snapshot '{}': {}", temporary, std::strerror(errno)));
+    }
+    write_all(fd, &header, sizeof(header), temporary);
+    write_all(fd, addresses.data(), addresses.size() * sizeof(in_addr), temporary);
+    write_all(fd, sources.data(), sources.size() * sizeof(uint32_t), temporary);
+    write_all(fd, matrix.cells().data(), matrix.cells().size() * sizeof(mesh_cell), temporary);
+    ::close(fd);
+    if (::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        throw std::runtime_error(fmt::format("could not replace mesh snapshot '{}': {}", path, std::strerror(errno)));
+    }
+}
+
+// probes the peers from this node over a raw icmp socket. a probe that is not answered within 'timeout_ns' is lost.
+// the timeout is one interval and a round sends at most 65535 probes, so a sequence is free again before it is reused.
+class raw_mesh_backend
+{
+public:
+    static constexpr const char * name = "raw";
+
+    raw_mesh_backend(const std::vector<sockaddr_in> & peers, uint32_t self, int64_t timeout_ns) :
+        m_peers(peers),
+        m_self(self),
+        m_timeout_ns(timeout_ns),
+        m_in_flight(65536)
+    {
+        m_socket.accept_replies_and_errors();
+        m_socket.set_receive_buffer_size(8 * 1024 * 1024);
+    }
+
+    void send(uint32_t, uint32_t destination, int64_t now)
+    {
+        auto sequence = m_sequence++;
+        if (m_in_flight[sequence].sent == 0)
+        {
+            ++m_outstanding;
+        }
+        m_in_flight[sequence] = {destination, now};
+        m_order.push_back(sequence);
+        m_packet = make_icmp_packet(sequence, {}, m_id);
+        m_batch.clear();
+        m_batch.push_back({&m_packet, sizeof(ping_pkt), 0, &m_peers[destination]});
+        // a probe that can not be sent times out like any other lost probe
+        m_socket.send_batch(m_batch, [](size_t, int) {});
+    }
+
+    template <typename F>
+    void receive(int64_t timeout_ns, F && on_result)
+    {
+        // every probe has the same timeout, so they expire in the order they were sent
+        auto now = steady_clock_policy::now();
+        for (; !m_order.empty(); m_order.pop_front())
+        {
+            auto & probe = m_in_flight[m_order.front()];
+            if (probe.sent != 0 && now - probe.sent <= m_timeout_ns)
+            {
+                break;
+            }
+            if (probe.sent != 0)
+            {
+                on_result(m_self, probe.destination, std::nullopt);
+                probe.sent = 0;
+                --m_outstanding;
+            }
+        }
+        if (!m_order.empty())
+        {
+            // wake up when the oldest probe expires, so a drain sees it lost before its deadline
+            timeout_ns = std::min(timeout_ns, m_in_flight[m_order.front()].sent + m_timeout_ns + 1 - now);
+        }
+
+        // rounded up, so the loop waits for the next slot instead of polling until it is due
+        if (!m_socket.wait_for_data(std::chrono::milliseconds((timeout_ns + 999999) / 1000000)))
+        {
+            return;
+        }
+        const auto & data = m_socket.receive(1500);
+        now = steady_clock_policy::now();
+        auto message = decode_icmp_message(data, m_socket.get_received_from());
+        if (!message || message->type != ICMP_ECHOREPLY || message->id != m_id)
+        {
+            return;
+        }
+        auto & probe = m_in_flight[message->sequence];
+        if (probe.sent == 0 || message->source.s_addr != m_peers[probe.destination].sin_addr.s_addr || now - probe.sent > m_timeout_ns)
+        {
+            return; // a late reply, its probe is lost when it expires
+        }
+        on_result(m_self, probe.destination, std::optional<int64_t>(now - probe.sent));
+        probe.sent = 0;
+        --m_outstanding;
+    }
+
+    [[nodiscard]] size_t outstanding() const { return m_outstanding; }
+
+private:
+    struct in_flight_probe
+    {
+        uint32_t destination = 0;
+        int64_t sent = 0; // 0 for a free sequence
+    };
+
+    const std::vector<sockaddr_in> & m_peers;
+    uint32_t m_self;
+    int64_t m_timeout_ns;
+    icmp_socket m_socket;
+    uint16_t m_id = process_icmp_id();
+    uint16_t m_sequence = 0;
+    std::vector<in_flight_probe> m_in_flight;
+    std::deque<uint16_t> m_order; // the sequences in the order they were sent, until they expire
+    size_t m_outstanding = 0;
+    ping_pkt m_packet{};
+    std::vector<batch_packet> m_batch;
+};
+
+// plays every peer, in-process and without a system call. the peers are spread over eight sites by their address:
+// 0.1 to 0.5 ms within a site and 3 to 21 ms between sites, the same both ways, with a little jitter.
+// one pair in about a thousand has a bad link that loses half the probes, the others lose one in ten thousand.
+class simulated_mesh_backend
+{
+public:
+    static constexpr const char * name = "simulated";
+
+    explicit simulated_mesh_backend(const std::vector<sockaddr_in> & peers) :
+        m_peers(peers)
+    {
+    }
+
+    void send(uint32_t source, uint32_t destination, int64_t)
+    {
+        auto a = ntohl(m_peers[source].sin_addr.s_addr);
+        auto b = ntohl(m_peers[destination].sin_addr.s_addr);
+        auto pair = mix((static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b));
+        auto random = next_random();
+        if (pair % 997 == 0 ? (random >> 32) % 2 != 0 : (random >> 32) % 10000 == 0)
+        {
+            m_results.push_back({source, destination, std::nullopt});
+            return;
+        }
+        int64_t latency_us = 100 + static_cast<int64_t>(pair >> 32) % 400;
+        auto site_a = mix(a) % 8;
+        auto site_b = mix(b) % 8;
+        if (site_a != site_b)
+        {
+            latency_us += 3000 * static_cast<int64_t>(site_a ^ site_b);
+        }
+        latency_us += static_cast<int64_t>(random % static_cast<uint64_t>(latency_us / 20 + 1));
+        m_results.push_back({source, destination, latency_us * 1000});
+    }
+
+    template <typename F>
+    void receive(int64_t timeout_ns, F && on_result)
+    {
+        if (m_results.empty())
+        {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(timeout_ns)); // nothing else will arrive
+            return;
+        }
+        for (const auto & result : m_results)
+        {
+            on_result(result.source, result.destination, result.rtt_ns);
+        }
+        m_results.clear();
+    }
+
+    [[nodiscard]] size_t outstanding() const { return m_results.size(); }
+
+private:
+    struct simulated_result
+    {
+        uint32_t source;
+        uint32_t destination;
+        std::optional<int64_t> rtt_ns; // nothing for a lost probe, which is known to be lost right away
+    };
+
+    static uint64_t mix(uint64_t value)
+    {
+        value *= 0x9E3779B97F4A7C15ull;
+        return value ^ (value >> 29);
+    }
+
+    uint64_t next_random()
+    {
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 7;
+        m_random ^= m_random << 17;
+        return m_random;
+    }
+
+    const std::vector<sockaddr_in> & m_peers;
+    std::vector<simulated_result> m_results;
+    uint64_t m_random = 88172645463325252ull;
+};
+
+template <typename Backend>
+class mesh_loop
+{
+public:
+    mesh_loop(Backend & backend, latency_matrix & matrix) :
+        m_backend(backend),
+        m_matrix(matrix)
+    {
+    }
+
+    // sends the n - 1 probes of every source in n - 1 slots spread over the interval that starts at 'start'
+    // and handles the replies until the interval ends. returns the number of probes sent.
+    size_t run_round(int64_t start, int64_t interval)
+    {
+        auto peers = static_cast<int64_t>(m_matrix.peers());
+        for (int64_t slot = 1; slot < peers; ++slot)
+        {
+            // in two parts, so interval * slot can not overflow
+            auto due = start + interval / peers * slot + interval % peers * slot / peers;
+            receive_until(due);
+            auto now = steady_clock_policy::now();
+            for (auto source : m_matrix.sources())
+            {
+                m_backend.send(source, static_cast<uint32_t>((source + slot) % peers), now);
+            }
+        }
+        receive_until(start + interval);
+        return m_matrix.sources().size() * (peers - 1);
+    }
+
+    // waits until every probe is answered or lost, at most until 'deadline'
+    void drain(int64_t deadline)
+    {
+        for (auto now = steady_clock_policy::now(); m_backend.outstanding() > 0 && now < deadline; now = steady_clock_policy::now())
+        {
+            receive(deadline - now);
+        }
+    }
+
+    [[nodiscard]] size_t replies() const { return m_replies; }
+    [[nodiscard]] size_t lost() const { return m_lost; }
+
+private:
+    void receive_until(int64_t time)
+    {
+        for (auto now = steady_clock_policy::now(); now < time; now = steady_clock_policy::now())
+        {
+            receive(time - now);
+        }
+    }
+
+    void receive(int64_t timeout_ns)
+    {
+        m_backend.receive(timeout_ns, [this](uint32_t source, uint32_t destination, std::optional<int64_t> rtt_ns) {
+            m_matrix.add_result(source, destination, rtt_ns);
+            ++(rtt_ns ? m_replies : m_lost);
+        });
+    }
+
+    Backend & m_backend;
+    latency_matrix & m_matrix;
+    size_t m_replies = 0;
+    size_t m_lost = 0;
+};
+
+static std::chrono::nanoseconds process_cpu_time()
+{
+    timespec time{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+    return std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec);
+}
+
+// a local address can be bound to, any other address can not
+static std::optional<uint32_t> find_local_peer(const std::vector<sockaddr_in> & peers)
+{
+    for (size_t i = 0; i < peers.size(); ++i)
+    {
+        int fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        auto address = peers[i];
+        address.sin_port = 0;
+        bool local = fd >= 0 && ::bind(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+        ::close(fd);
+        if (local)
+        {
+            return static_cast<uint32_t>(i);
+        }
+    }
+    return {};
+}
+
+static void print_mesh(const std::vector<std::string> & names, const latency_matrix & matrix)
+{
+    const auto & sources = matrix.sources();
+    if (sources.size() == 1)
+    {
+        auto source = sources.front();
+        for (size_t destination = 0; destination < matrix.peers(); ++destination)
+        {
+            if (destination == source)
+            {
+                continue;
+            }
+            const auto & cell = matrix.cell(source, destination);
+            fmt::print("{}: {} sent, {} received, {:.1f}% loss, rtt p50/p90/p99 = {:.3f}/{:.3f}/{:.3f} ms\n", names[destination], cell.sent, cell.received,
+                       100.0 * matrix.loss(source, destination), matrix.percentile(source, destination, 0.5), matrix.percentile(source, destination, 0.9),
+                       matrix.percentile(source, destination, 0.99));
+        }
+        return;
+    }
+
+    // too many pairs to list them all, the pairs with the most loss and the highest p99 stand out.
+    // the worst ten are kept in a heap with the best of them on top, the matrix is not copied.
+    struct pair
+    {
+        double loss;
+        double p99;
+        uint32_t source;
+        uint32_t destination;
+    };
+    auto worse = [](const pair & a, const pair & b) { return a.loss != b.loss ? a.loss > b.loss : a.p99 > b.p99; };
+    std::vector<pair> worst;
+    size_t pairs = 0;
+    double total_loss = 0.0;
+    for (auto source : sources)
+    {
+        for (size_t destination = 0; destination < matrix.peers(); ++destination)
+        {
+            if (destination == source)
+            {
+                continue;
+            }
+            pair candidate{matrix.loss(source, destination), 0.0, source, static_cast<uint32_t>(destination)};
+            ++pairs;
+            total_loss += candidate.loss;
+            if (worst.size() == 10 && candidate.loss < worst.front().loss)
+            {
+                continue; // the percentile is only worth reading for a pair that can make the list
+            }
+            candidate.p99 = matrix.percentile(source, destination, 0.99);
+            if (worst.size() < 10)
+            {
+                worst.push_back(candidate);
+                std::push_heap(worst.begin(), worst.end(), worse);
+            }
+            else if (worse(candidate, worst.front()))
+            {
+                std::pop_heap(worst.begin(), worst.end(), worse);
+                worst.back() = candidate;
+                std::push_heap(worst.begin(), worst.end(), worse);
+            }
+        }
+    }
+    std::sort_heap(worst.begin(), worst.end(), worse);
+    fmt::print("{} pairs, {:.3f}% loss on average, the worst:\n", pairs, pairs > 0 ? 100.0 * total_loss / pairs : 0.0);
+    for (const auto & entry : worst)
+    {
+        fmt::print("  {} -> {}: {:.1f}% loss, rtt p50/p99 = {:.3f}/{:.3f} ms\n", names[entry.source], names[entry.destination], 100.0 * entry.loss,
+                   matrix.percentile(entry.source, entry.destination, 0.5), entry.p99);
+    }
+}
+
+template <typename Backend>
+static void run_mesh_loop(Backend & backend, const std::vector<std::string> & names, const std::vector<sockaddr_in> & peers, std::vector<uint32_t> sources,
+                          const mesh_options & options)
+{
+    latency_matrix matrix(peers.size(), std::move(sources));
+    fmt::print("{} backend, {} peers, {} of {} rows measured by this node, {:.1f} MB.\n", Backend::name, peers.size(), matrix.sources().size(), peers.size(),
+               matrix.cells().size() * sizeof(mesh_cell) / 1e6);
+    mesh_loop<Backend> loop(backend, matrix);
+    auto interval = std::chrono::duration_cast<std::chrono::nanoseconds>(options.interval).count();
+    auto start = steady_clock_policy::now();
+    int round = 0;
+    for (; options.rounds == 0 || round < options.rounds; ++round)
+    {
+        auto replies = loop.replies();
+        auto lost = loop.lost();
+        auto cpu = process_cpu_time();
+        auto sent = loop.run_round(start + round * interval, interval);
+        auto used = std::chrono::duration<double>(process_cpu_time() - cpu).count();
+        fmt::print("round {}: {} probes, {} replies, {} lost, {:.3f}s cpu ({:.0f} ns per probe).\n", round + 1, sent, loop.replies() - replies,
+                   loop.lost() - lost, used, used * 1e9 / sent);
+        if (!options.snapshot.empty())
+        {
+            write_mesh_snapshot(options.snapshot, peers, matrix, options.interval, round + 1);
+        }
+    }
+    // the probes of the last slots are still in flight, they are answered or time out within one interval
+    loop.drain(steady_clock_policy::now() + interval);
+    if (!options.snapshot.empty())
+    {
+        write_mesh_snapshot(options.snapshot, peers, matrix, options.interval, round);
+    }
+    print_mesh(names, matrix);
+}
+
+void run_mesh(const std::vector<std::string> & peers, const mesh_options & options)
+{
+    if (peers.size() < 2)
+    {
+        throw std::runtime_error("a mesh needs at least two peers");
+    }
+    if (peers.size() > 65536)
+    {
+        throw std::runtime_error(fmt::format("a mesh of {} peers is larger than the 65536 the sequence numbers of a round can hold", peers.size()));
+    }
+    std::vector<sockaddr_in> addresses;
+    std::unordered_set<uint32_t> seen;
+    addresses.reserve(peers.size());
+    for (const auto & peer : peers)
+    {
+        addresses.push_back(resolve_address(peer));
+        if (!seen.insert(addresses.back().sin_addr.s_addr).second)
+        {
+            throw std::runtime_error(fmt::format("peer '{}' is in the mesh twice", peer));
+        }
+    }
+
+    std::optional<uint32_t> self;
+    if (!options.self.empty())
+    {
+        auto address = resolve_address(options.self).sin_addr;
+        auto found = std::find_if(addresses.begin(), addresses.end(), [&](const sockaddr_in & peer) { return peer.sin_addr.s_addr == address.s_addr; });
+        if (found == addresses.end())
+        {
+            throw std::runtime_error(fmt::format("'{}' is not one of the peers", options.self));
+        }
+        self = static_cast<uint32_t>(found - addresses.begin());
+    }
+
+    if (options.backend == raw_mesh_backend::name)
+    {
+        if (!self)
+        {
+            self = find_local_peer(addresses);
+        }
+        if (!self)
+        {
+            throw std::runtime_error("none of the peers is a local address, tell which one this node is with --self");
+        }
+        raw_mesh_backend backend(addresses, *self, std::chrono::duration_cast<std::chrono::nanoseconds>(options.interval).count());
+        return run_mesh_loop(backend, peers, addresses, {*self}, options);
+    }
+    if (options.backend == simulated_mesh_backend::name)
+    {
+        std::vector<uint32_t> sources;
+        for (uint32_t source = 0; source < addresses.size(); ++source)
+        {
+            if (!self || source == *self)
+            {
+                sources.push_back(source);
+            }
+        }
+        simulated_mesh_backend backend(addresses);
+        return run_mesh_loop(backend, peers, addresses, sources, options);
+    }
+    throw std::runtime_error(fmt::format("unknown backend '{}', mesh mode uses raw or simulated", options.backend));
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// full-mesh probing: every peer pings every other peer, the results form an n x n matrix with the source as row
+// and the destination as column. a node only keeps the rows it measures: its own, or all of them with the simulated backend.
+// the full matrix is the rows of the snapshots of all nodes together.
+//
+// a snapshot file holds the measured rows, all in host byte order except the addresses:
+//   mesh_snapshot_header
+//   in_addr per peer, zero padded to a multiple of 16 bytes
+//   uint32_t source index per row, zero padded to a multiple of 16 bytes
+//   mesh_cell per destination, row by row
+
+namespace icmp_ns {
+
+constexpr size_t mesh_sketch_buckets = 12;
+
+// the measurements of one source and destination pair, 16 bytes so four cells share a cache line: a row of 5000 peers
+// takes 80 kB, the whole matrix 400 MB. a probe is counted once it is answered or timed out, not while it is in flight,
+// so a snapshot taken right after a round does not count the probes of its last slots as lost. the counters decay:
+// when one would overflow, all counters of its kind are halved, so a cell describes the last few hundred probes
+// and never has to be reset.
+struct mesh_cell
+{
+    std::array<uint8_t, mesh_sketch_buckets> sketch{}; // replies per rtt bucket, see mesh_bucket_limit()
+    uint16_t sent = 0;
+    uint16_t received = 0;
+};
+
+// the upper bound of a sketch bucket in ms: 64 us for the first, doubling per bucket, the last one holds everything above 65 ms
+[[nodiscard]] double mesh_bucket_limit(size_t bucket);
+
+// the rows of an n x n matrix that one node measures, other rows take no memory
+class latency_matrix
+{
+public:
+    latency_matrix(size_t peers, std::vector<uint32_t> sources);
+
+    // a probe from 'source' to 'destination' that was answered after 'rtt_ns', or timed out without one
+    void add_result(size_t source, size_t destination, std::optional<int64_t> rtt_ns);
+
+    [[nodiscard]] size_t peers() const { return m_peers; }
+    [[nodiscard]] const std::vector<uint32_t> & sources() const { return m_sources; }
+    [[nodiscard]] const mesh_cell & cell(size_t source, size_t destination) const { return m_cells[m_rows[source] * m_peers + destination]; }
+    [[nodiscard]] const std::vector<mesh_cell> & cells() const { return m_cells; }
+
+    // the fraction of the probes that was not answered in time, 0 for a pair that was not probed
+    [[nodiscard]] double loss(size_t source, size_t destination) const;
+
+    // the upper bound of the sketch bucket that holds the percentile, in ms, 0 without replies
+    [[nodiscard]] double percentile(size_t source, size_t destination, double fraction) const;
+
+private:
+    [[nodiscard]] mesh_cell & mutable_cell(size_t source, size_t destination) { return m_cells[m_rows[source] * m_peers + destination]; }
+
+    size_t m_peers;
+    std::vector<uint32_t> m_sources; // the source of every row
+    std::vector<uint32_t> m_rows;    // the row of every source, only valid for the sources that are measured
+    std::vector<mesh_cell> m_cells;
+};
+
+struct mesh_snapshot_header
+{
+    char magic[8]; // PINGMESH
+    uint32_t version;
+    uint32_t cell_size;
+    uint32_t peers;
+    uint32_t sketch_buckets;
+    uint32_t rows; // the rows in the file, the sources they belong to follow the addresses
+    uint32_t reserved;
+    uint64_t time_ms; // unix time the snapshot was taken
+    uint64_t interval_ms;
+    uint64_t rounds;
+};
+
+// writes the measured rows to a temporary file next to 'path' and renames it over 'path', so readers never see half a snapshot
+void write_mesh_snapshot(const std::string & path, const std::vector<sockaddr_in> & peers, const latency_matrix & matrix, std::chrono::milliseconds interval,
+                         uint64_t rounds);
+
+struct mesh_options
+{
+    std::string backend = "raw"; // raw or simulated
+    std::string self;             // the peer this node is, found among the local addresses when empty
+    int rounds = 4;               // 0 keeps probing until stopped
+    std::chrono::milliseconds interval{1000};
+    std::string snapshot; // written after every round when not empty
+};
+
+// probes every other peer once per round. the probes of a round are spread over the interval: in slot k of n every
+// source probes the peer k places after itself, so every peer is probed by one source per slot and not by all at once.
+// the simulated backend plays every peer unless 'self' is set, which measures the whole matrix in one process.
+void run_mesh(const std::vector<std::string> & peers, const mesh_options & options);
+
+} // namespace icmp_ns
@@ -3,20 +3,30 @@
  */
 
 #include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/ip_icmp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <cerrno>
 #include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fmt/chrono.h>
 #include <fmt/core.h>
+#include <functional>
+#include <map>
 #include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <vector>
+
+#include "network.h"
 
 std::string dns_lookup(const std::string & hostname)
 {
@@ -48,16 +58,250 @@ std::string reverse_dns_lookup(const std::string & ipaddress)
 
 std::vector<std::string> get_physical_networkcard_names()
 {
-    namespace fs = std::filesystem;
-
     std::vector<std::string> result;
-    for (const auto & entry : fs::directory_iterator("/sys/class/net/"))
+    for (const auto & interface : get_network_interfaces())
+    {
+        if (interface.physical)
+        {
+            result.push_back(interface.name);
+        }
+    }
+    return result;
+}
+
+static int open_netlink_socket(uint32_t groups)
+{
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    sockaddr_nl address{};
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = groups;
+    if (fd < 0 || bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        auto error = errno;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        throw std::runtime_error(fmt::format("could not open rtnetlink socket: {}", std::strerror(error)));
+    }
+    return fd;
+}
+
+// calls 'handle' for every message in a netlink datagram, returns false at the end of a dump
+static bool for_each_message(const char * data, size_t length, const std::function<void(const nlmsghdr *)> & handle)
+{
+    auto remaining = static_cast<int>(length);
+    for (auto * message = reinterpret_cast<const nlmsghdr *>(data); NLMSG_OK(message, remaining); message = NLMSG_NEXT(message, remaining))
+    {
+        if (message->nlmsg_type == NLMSG_DONE)
+        {
+            return false;
+        }
+        if (message->nlmsg_type == NLMSG_ERROR)
+        {
+            auto * error = static_cast<const nlmsgerr *>(NLMSG_DATA(message));
+            throw std::runtime_error(fmt::format("rtnetlink request failed: {}", std::strerror(-error->error)));
+        }
+        handle(message);
+    }
+    return true;
+}
+
+static void netlink_dump(int fd, uint16_t type, const std::function<void(const nlmsghdr *)> & handle)
+{
+    struct
+    {
+        nlmsghdr header;
+        rtgenmsg message;
+    } request{};
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = type;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.message.rtgen_family = type == RTM_GETADDR ? AF_INET : AF_UNSPEC;
+    if (send(fd, &request, sizeof(request), 0) < 0)
+    {
+        throw std::runtime_error(fmt::format("could not send rtnetlink request: {}", std::strerror(errno)));
+    }
+
+    std::vector<char> buffer(64 * 1024);
+    while (true)
+    {
+        auto received = recv(fd, buffer.data(), buffer.size(), 0);
+        if (received < 0)
+        {
+            throw std::runtime_error(fmt::format("could not receive rtnetlink reply: {}", std::strerror(errno)));
+        }
+        if (!for_each_message(buffer.data(), received, handle))
+        {
+            return;
+        }
+    }
+}
+
+// a link message describes the whole interface. IFLA_PARENT_DEV_NAME names the bus device behind it,
+// the same information as the 'device' link in /sys/class/net, which virtual interfaces do not have.
+static network_interface parse_link(const nlmsghdr * message, bool & has_parent)
+{
+    auto * info = static_cast<const ifinfomsg *>(NLMSG_DATA(message));
+    network_interface result;
+    result.index = info->ifi_index;
+    result.flags = info->ifi_flags;
+    has_parent = false;
+    auto remaining = static_cast<int>(IFLA_PAYLOAD(message));
+    for (auto * attribute = IFLA_RTA(info); RTA_OK(attribute, remaining); attribute = RTA_NEXT(attribute, remaining))
+    {
+        switch (attribute->rta_type)
+        {
+        case IFLA_IFNAME:
+            result.name = static_cast<const char *>(RTA_DATA(attribute));
+            break;
+        case IFLA_MTU:
+            std::memcpy(&result.mtu, RTA_DATA(attribute), sizeof(result.mtu));
+            break;
+        case IFLA_PARENT_DEV_NAME:
+            has_parent = true;
+            break;
+        default:
+            break;
+        }
+    }
+    result.physical = has_parent;
+    return result;
+}
+
+static std::optional<in_addr> parse_address(const nlmsghdr * message, int & index)
+{
+    auto * info = static_cast<const ifaddrmsg *>(NLMSG_DATA(message));
+    index = info->ifa_index;
+    if (info->ifa_family != AF_INET)
     {
-        auto path = entry.path();
-        if (fs::exists(path / "device/vendor"))
+        return {};
+    }
+    std::optional<in_addr> result;
+    auto remaining = static_cast<int>(IFA_PAYLOAD(message));
+    for (auto * attribute = IFA_RTA(info); RTA_OK(attribute, remaining); attribute = RTA_NEXT(attribute, remaining))
+    {
+        // IFA_LOCAL is the address of the interface itself, on point-to-point links IFA_ADDRESS is the peer
+        if (attribute->rta_type == IFA_LOCAL || (attribute->rta_type == IFA_ADDRESS && !result))
         {
-            result.push_back(path.stem());
+            in_addr address{};
+            std::memcpy(&address, RTA_DATA(attribute), sizeof(address));
+            result = address;
         }
     }
     return result;
-}
\ No newline at end of file
+}
+
+std::vector<network_interface> get_network_interfaces()
+{
+    int fd = open_netlink_socket(0);
+    std::vector<network_interface> result;
+    std::map<int, size_t> positions;
+    bool kernel_reports_parents = false;
+    try
+    {
+        netlink_dump(fd, RTM_GETLINK, [&](const nlmsghdr * message) {
+            if (message->nlmsg_type == RTM_NEWLINK)
+            {
+                bool has_parent = false;
+                positions[static_cast<const ifinfomsg *>(NLMSG_DATA(message))->ifi_index] = result.size();
+                result.push_back(parse_link(message, has_parent));
+                kernel_reports_parents = kernel_reports_parents || has_parent;
+            }
+        });
+        netlink_dump(fd, RTM_GETADDR, [&](const nlmsghdr * message) {
+            int index = 0;
+            auto address = message->nlmsg_type == RTM_NEWADDR ? parse_address(message, index) : std::nullopt;
+            if (address && positions.count(index) > 0)
+            {
+                result[positions[index]].addresses.push_back(*address);
+            }
+        });
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    // kernels before 5.15 do not send IFLA_PARENT_DEV_NAME, fall back to sysfs for those
+    if (!kernel_reports_parents)
+    {
+        for (auto & interface : result)
+        {
+            interface.physical = std::filesystem::exists("/sys/class/net/" + interface.name + "/device");
+        }
+    }
+    return result;
+}
+
+std::string describe_network_change(const network_change & change)
+{
+    switch (change.type)
+    {
+    case network_change::kind::link_changed:
+        return fmt::format("interface {} ({}) is {}, mtu {}", change.interface.name, change.interface.index,
+                           (change.interface.flags & IFF_RUNNING) != 0 ? "running" : (change.interface.flags & IFF_UP) != 0 ? "up" : "down", change.interface.mtu);
+    case network_change::kind::link_removed:
+        return fmt::format("interface {} ({}) was removed", change.interface.name, change.interface.index);
+    case network_change::kind::address_added:
+        return fmt::format("address {} was added to interface {}", inet_ntoa(change.address), change.interface.index);
+    case network_change::kind::address_removed:
+        return fmt::format("address {} was removed from interface {}", inet_ntoa(change.address), change.interface.index);
+    }
+    return {};
+}
+
+network_monitor::network_monitor() :
+    m_fd(open_netlink_socket(RTMGRP_LINK | RTMGRP_IPV4_IFADDR))
+{
+}
+
+network_monitor::~network_monitor()
+{
+    close(m_fd);
+}
+
+std::vector<network_change> network_monitor::read_changes()
+{
+    std::vector<network_change> result;
+    std::vector<char> buffer(64 * 1024);
+    while (true)
+    {
+        auto received = recv(m_fd, buffer.data(), buffer.size(), MSG_DONTWAIT);
+        if (received <= 0)
+        {
+            if (received < 0 && errno == ENOBUFS)
+            {
+                m_overflow = true;
+                continue; // the error is reported once, the notifications after it are queued again
+            }
+            return result;
+        }
+        for_each_message(buffer.data(), received, [&](const nlmsghdr * message) {
+            bool has_parent = false;
+            int index = 0;
+            switch (message->nlmsg_type)
+            {
+            case RTM_NEWLINK:
+            case RTM_DELLINK:
+                result.push_back({message->nlmsg_type == RTM_NEWLINK ? network_change::kind::link_changed : network_change::kind::link_removed,
+                                  parse_link(message, has_parent)});
+                break;
+            case RTM_NEWADDR:
+            case RTM_DELADDR:
+                if (auto address = parse_address(message, index))
+                {
+                    network_change change{message->nlmsg_type == RTM_NEWADDR ? network_change::kind::address_added : network_change::kind::address_removed,
+                                          {}, *address};
+                    change.interface.index = index;
+                    result.push_back(change);
+                }
+                break;
+            default:
+                break;
+            }
+        });
+    }
+}
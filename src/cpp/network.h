@@ -2,9 +2,67 @@
  * Copyright (c) 2023 Jan Wilmans, MIT License
  */
 
+#pragma once
+
+#include <netinet/in.h>
+
 #include <string>
+#include <utility>
 #include <vector>
 
 std::string dns_lookup(const std::string & hostname);
 std::string reverse_dns_lookup(const std::string & ipaddress);
-std::vector<std::string> get_physical_networkcard_names();
\ No newline at end of file
+std::vector<std::string> get_physical_networkcard_names();
+
+struct network_interface
+{
+    int index = 0;
+    std::string name;
+    unsigned flags = 0; // IFF_UP, IFF_RUNNING, IFF_LOOPBACK, ...
+    int mtu = 0;
+    bool physical = false; // backed by a bus device (pci, usb, virtio) rather than virtual (lo, veth, bridge, tunnel)
+    std::vector<in_addr> addresses;
+};
+
+// every interface with its ipv4 addresses, from one rtnetlink link dump and one address dump
+std::vector<network_interface> get_network_interfaces();
+
+struct network_change
+{
+    enum class kind
+    {
+        link_changed, // added, or its flags, mtu or name changed
+        link_removed,
+        address_added,
+        address_removed
+    };
+    kind type;
+    network_interface interface; // for address changes only the index is set
+    in_addr address{};
+};
+
+std::string describe_network_change(const network_change & change);
+
+// subscribes to rtnetlink link and ipv4 address notifications. poll get_fd() and call read_changes() when it is readable,
+// so interface changes are seen when they happen instead of by polling sysfs.
+class network_monitor
+{
+public:
+    network_monitor();
+    ~network_monitor();
+    network_monitor(const network_monitor &) = delete;
+    network_monitor & operator=(const network_monitor &) = delete;
+
+    [[nodiscard]] int get_fd() const { return m_fd; }
+
+    // the changes that are queued on the socket, it does not block
+    std::vector<network_change> read_changes();
+
+    // true once after the kernel dropped notifications because the socket buffer was full (ENOBUFS), the changes since
+    // then are only known from a new dump with get_network_interfaces()
+    [[nodiscard]] bool take_overflow() { return std::exchange(m_overflow, false); }
+
+private:
+    int m_fd = -1;
+    bool m_overflow = false;
+};
@@ -7,19 +7,37 @@
 #include <netinet/in.h>
 #include <netinet/ip_icmp.h>
 #include <sys/socket.h>
-#include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <docopt.h>
 #include <fmt/chrono.h>
 #include <fmt/core.h>
+#include <memory>
 #include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
-
+#include <vector>
+
+#include "batch_ping.h"
+#include "capacity.h"
+#include "checkpoint.h"
+#include "control.h"
+#include "engine.h"
+#include "icmp.h"
+#include "icmp_ids.h"
+#include "mesh.h"
 #include "network.h"
-
-using double_milliseconds = std::chrono::duration<double, std::milli>;
+#include "pmtu.h"
+#include "realtime.h"
+#include "shard.h"
+#include "statistics.h"
+#include "sweep.h"
+#include "target_list.h"
+#include "timestamp.h"
+#include "traceroute.h"
 
 std::string to_hex_string(std::string_view data)
 {
@@ -43,246 +61,547 @@ std::string to_hex_string(std::string_view data)
 }
 
 namespace icmp_ns {
-// you can choose to send more or less dummy payload data
-static const int icmp_payload_length = 64 - sizeof(struct icmphdr);
-struct ping_pkt
+
+const int ip_header_length = 20;
+const int raw_icmp_response_length = ip_header_length + sizeof(ping_pkt);
+
+// the outcome of one echo request: a reply, an icmp error about it, or nothing at all before the timeout
+struct ping_result
 {
-    struct icmphdr hdr;
-    char payload[icmp_payload_length];
+    std::optional<double_milliseconds> duration; // time until the reply or the error arrived
+    std::optional<icmp_message> error;
 };
 
-[[nodiscard]] unsigned short calculate_checksum(const ping_pkt & packet)
+// the socket is re-used for every ping, the sequence number tells the replies apart
+[[nodiscard]] ping_result ping(icmp_socket & socket, uint16_t sequence, std::optional<uint16_t> flow, std::chrono::milliseconds timeout)
 {
-    auto * view = reinterpret_cast<const unsigned short *>(&packet);
-    auto size = sizeof(ping_pkt);
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    const uint16_t my_icmp_id = process_icmp_id();
+    const size_t max_packet_length = 1500;
 
-    unsigned int sum = 0;
-    for (; size > 1; size -= 2)
-    {
-        sum += *view++;
-    }
-    if (size == 1)
-    {
-        sum += *(unsigned char *)view;
-    }
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
-    return ~sum;
-}
-class icmp_socket
-{
-public:
-    explicit icmp_socket(std::string address) :
-        m_address(address)
-    {
-        dns_lookup_and_store_address();
-        m_socket_fd = ::socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-        if (m_socket_fd < 0)
-        {
-            throw std::runtime_error(fmt::format("descriptor for icmp_socket to '{}' could not be "
-                                                 "created. (requires root)",
-                                                 m_address));
-        }
-    }
+    auto packet = make_icmp_packet(sequence, flow);
+    // fmt::print("  send {} bytes with id {}.\n", sizeof(packet),
+    // echo_id(packet.hdr)); fmt::print("  {}\n", vic::to_hex_string(&packet, 1));
+    auto start_timepoint = std::chrono::steady_clock::now();
+    socket.send_object(packet);
 
-    ~icmp_socket()
+    while (std::chrono::steady_clock::now() < deadline)
     {
-        ::close(m_socket_fd);
-    }
+        const auto & data_received = socket.receive(max_packet_length);
+        auto end_timepoint = std::chrono::steady_clock::now();
+        auto duration = std::chrono::duration_cast<double_milliseconds>(
+            end_timepoint - start_timepoint);
 
-    void dns_lookup_and_store_address()
-    {
-        const uint16_t port = 0;
-        hostent * host_entity = gethostbyname(m_address.data());
-        if (host_entity == NULL)
+        // a router that can not deliver our echo request tells us so, there is no need to wait for the timeout
+        auto message = decode_icmp_message(data_received, socket.get_received_from());
+        if (message && is_icmp_error(message->type) && message->id == my_icmp_id && message->sequence == sequence &&
+            message->destination.s_addr == socket.get_sockadd_in().sin_addr.s_addr)
         {
-            throw std::runtime_error(fmt::format("gethostbyname for '{}' failed.", m_address));
+            return {duration, message};
         }
-        m_name = inet_ntoa(*(struct in_addr *)host_entity->h_addr);
-
-        m_sockaddr_in.sin_family = host_entity->h_addrtype;
-        m_sockaddr_in.sin_port = htons(port);
-        m_sockaddr_in.sin_addr.s_addr = *(long *)host_entity->h_addr;
-    }
-
-    template <typename T>
-    bool set_socket_option(int level, int option, const T value)
-    {
-        return setsockopt(m_socket_fd, level, option, &value, sizeof(value)) == 0;
-    }
 
-    void set_TTL(const int ttl)
-    {
-        if (!set_socket_option(SOL_IP, IP_TTL, ttl))
+        if (data_received.size() == raw_icmp_response_length)
         {
-            throw std::runtime_error(fmt::format("could not set TTL to '{}'", ttl));
+            auto data = socket.get_received_data<ping_pkt>(ip_header_length);
+            if (verify_reply(packet, data, my_icmp_id))
+            {
+                return {duration, {}};
+            }
+            fmt::print("  warning unrelated message received of {} bytes with id {}.\n", data_received.size(), echo_id(data.hdr));
+            continue;
         }
-    }
-
-    void set_receive_timeout(std::chrono::milliseconds timeout)
-    {
-        int total_ms = timeout.count();
-        int seconds = total_ms / 1000;
-        int useconds = (total_ms - (seconds * 1000)) * 1000;
-        timeval tv_out{};
-        tv_out.tv_sec = seconds;
-        tv_out.tv_usec = useconds;
-        if (!set_socket_option(SOL_SOCKET, SO_RCVTIMEO, tv_out))
+        if (!data_received.empty())
         {
-            throw std::runtime_error(fmt::format("could not set receive timeout to '{}'ms", total_ms));
+            fmt::print("  warning unrelated message received of {} bytes.\n", data_received.size());
         }
     }
 
-    [[nodiscard]] std::vector<char> receive(size_t bytes)
-    {
-        m_receive_buffer.resize(bytes);
-        auto bytes_received = recvfrom(m_socket_fd, &m_receive_buffer[0], m_receive_buffer.size(), 0, nullptr, nullptr);
-        if (bytes_received <= 0)
+    return {}; // timeout, no response received
+}
+
+void print_statistics(const std::string & title, const rtt_statistics & statistics)
+{
+    fmt::print("{}: {} replies, rtt min/avg/max/stddev = {:.3f}/{:.3f}/{:.3f}/{:.3f} ms, variance = {:.6f} ms^2\n", title, statistics.count(),
+               statistics.min(), statistics.mean(), statistics.max(), statistics.stddev(), statistics.variance());
+}
+
+rtt_statistics run_pings(const std::string & address, int count, std::optional<uint16_t> flow, std::chrono::milliseconds timeout, const realtime_options & options)
+{
+    rtt_statistics statistics;
+    run_probe_thread(options, [&] {
+        icmp_socket socket(address);
+        socket.set_TTL(64);
+        socket.set_receive_timeout(timeout);
+        if (options.enabled)
         {
-            return {}; // return empty meaning, we received no reply within the timeout
+            socket.prefault_buffers(raw_icmp_response_length);
         }
-        m_receive_buffer.resize(bytes_received);
-        return m_receive_buffer;
-    }
 
-    void send(const void * data, size_t size) const
-    {
-        auto result = ::sendto(m_socket_fd, data, size, 0, (sockaddr *)&m_sockaddr_in, sizeof(m_sockaddr_in));
-        if (result <= 0)
+        for (int i = 0; i < count; ++i)
         {
-            throw std::runtime_error(fmt::format("could not send packet to '{}'", m_address));
+            auto result = ping(socket, static_cast<uint16_t>(i), flow, timeout);
+            if (result.error)
+            {
+                fmt::print("ping to {} failed: {} from {} after {:.2f}ms.\n", address, describe_icmp_message(result.error->type, result.error->code),
+                           inet_ntoa(result.error->source), result.duration->count());
+            }
+            else if (result.duration)
+            {
+                fmt::print("ping from {}: time={:.2f}ms.\n", address, result.duration->count());
+                statistics.add(result.duration->count());
+            }
+            else
+            {
+                fmt::print("ping from {} timed out, no response after {}.\n", address, timeout);
+            }
         }
-    }
+    });
+    return statistics;
+}
 
-    template <typename T>
-    [[nodiscard]] T get_received_data(size_t offset) const
+} // namespace icmp_ns
+
+static const char usage[] = R"(ping - send ICMP echo requests to a network host.
+
+Usage:
+  ping [options] <address>
+  ping --mtr [options] <target>...
+  ping --capacity [options] <target>...
+  ping --sweep [options] <target>...
+  ping --batch [options] <target>...
+  ping --timestamp [options] <target>...
+  ping --mesh [options] [<target>...]
+  ping --daemon [options] [<target>...]
+  ping --control [options] <command>...
+  ping -h | --help
+
+Options:
+  -h, --help                   Show this screen.
+  -c <count>, --count=<count>  Number of echo requests to send [default: 4].
+  --realtime                   Lock memory, prefault buffers and run the probe thread under SCHED_FIFO.
+  --priority=<priority>        SCHED_FIFO priority of the probe thread [default: 50].
+  --cpus=<list>                Pin the probe thread to these cpus, for example 3 or 2-3.
+  --compare                    Probe with normal scheduling first and then in realtime mode, and report the variance reduction.
+  --traceroute                 Probe every TTL from 1 to --max-hops at once and print the path to <address>.
+  --max-hops=<hops>            Highest TTL probed in traceroute and mtr mode [default: 30].
+  --mtr                        Continuously probe every hop to every <target> and keep loss and rtt statistics per hop,
+                               the --count is the number of rounds, 0 keeps probing until stopped.
+  --interval=<ms>              Time between two rounds in mtr, batch, timestamp and mesh mode, and between two probes to a target in daemon mode [default: 1000].
+  --flow=<id>                  Keep the icmp checksum fixed at <id> (0-65535), so ECMP routers send all probes along one path.
+  --flows=<n>                  Trace or measure flows 0 to <n>-1 in parallel to discover every ECMP path [default: 1].
+  --pmtu                       Discover the path mtu to <address> with batches of don't fragment echo requests of different sizes.
+  --max-mtu=<bytes>            Largest packet size probed in pmtu mode [default: 9000].
+  --capacity                   Estimate the bottleneck capacity to every <target> from the spacing of replies to back-to-back echo requests.
+  --size=<bytes>               Ip packet size used in capacity mode and the largest size in sweep mode, it must fit the path mtu [default: 1500].
+  --trains=<n>                 Number of packet trains sent to every target in capacity mode [default: 20].
+  --sweep                      Probe every <target> with payload sizes from 0 to --size interleaved, and fit a line through
+                               the rtt per size to separate the base latency from the cost per byte. --count is the number of rounds.
+  --batch                      Ping every <target> once per round, --count rounds --interval apart, with a probe loop built from
+                               the chosen --backend, --clock and --stats.
+  --backend=<name>             How batch and mesh mode send and receive: raw, dgram (batch only) or simulated [default: raw].
+                               dgram is an unprivileged icmp socket (see net.ipv4.ping_group_range), simulated answers in-process.
+  --clock=<name>               How batch mode times replies: steady, tsc or kernel [default: steady]. steady and tsc time
+                               when the probe loop handles a reply, tsc reads the cpu's time stamp counter, kernel is when it arrived.
+  --stats=<name>               What batch mode reports per target: summary (min/avg/max/stddev) or histogram (percentiles) [default: summary].
+  --timestamp                  Send icmp timestamp requests to every <target>, --count rounds --interval apart, and estimate
+                               the delay of each direction and the target's clock offset from the times in the replies.
+  --mesh                       Probe every other peer of a full mesh once per round, --count rounds --interval apart, spread
+                               over the interval. The peers are the <target>s and the addresses in --targets, this node is the
+                               peer with a local address or --self. The simulated --backend plays every peer of the mesh.
+  --self=<address>             The peer this node is in mesh mode.
+  --mesh-snapshot=<file>       Write the latency matrix of the mesh to <file> after every round, see mesh.h for the format.
+  --daemon                     Keep probing every <target> until stopped, and accept commands to add or remove targets,
+                               change intervals and read statistics on the --socket control socket.
+  --control                    Send <command> to a running daemon and print the response, for example: ping --control stats
+  --socket=<path>              Unix domain socket of the daemon control api [default: /tmp/ping.sock].
+  --targets=<file>             Probe the targets in <file> in daemon or mesh mode, one address, optional interval in ms and optional group per line.
+                               The file is reloaded when it changes, targets that did not change keep their statistics.
+  --checkpoint=<file>          Restore the targets and their state from <file> when the daemon starts, and save them to it
+                               every --checkpoint-interval seconds and when it stops.
+  --checkpoint-interval=<s>    Time between two checkpoints in daemon mode [default: 60].
+  --push=<address>             Push what changed in the statistics of every target to a collector every --push-interval
+                               seconds in daemon mode, over the unix datagram socket <address> or udp to <host>:<port>.
+  --push-interval=<s>          Time between two pushes [default: 10].
+  --shard-block=<name>         Split the --targets with the other daemons that use the shared memory block <name> in /dev/shm.
+                               The targets are hashed into --shards shards, every daemon probes its fair share of them and
+                               takes over the shards of a daemon that stops or dies. Each daemon needs its own --socket.
+  --shards=<n>                 Number of shards of a new shard block [default: 64].
+  --devices=<list>             Probe every target through each of these interfaces in parallel in daemon mode, for example
+                               eth0,eth1, or 'physical' for every physical network card. Statistics are kept per interface.
+  --sources=<list>             Probe every target from each of these local addresses in parallel in daemon mode, for example
+                               10.0.0.1,10.0.1.1. Combined with --devices every source is used on every interface.
+)";
+
+static std::optional<uint16_t> parse_flow(const docopt::value & value)
+{
+    if (!value)
     {
-        T result;
-        std::memcpy(&result, &m_receive_buffer[offset], sizeof(T));
-        return result;
+        return {};
     }
-
-    template <typename T>
-    void send_object(const T & object) const
+    auto flow = value.asLong();
+    if (flow < 0 || flow > 65535)
     {
-        send(&object, sizeof(object));
+        throw std::runtime_error(fmt::format("the --flow must be 0 to 65535, not {}", flow));
     }
+    return static_cast<uint16_t>(flow);
+}
 
-    [[nodiscard]] int get_fd() const { return m_socket_fd; }
-    [[nodiscard]] std::string get_name() const { return m_name; }
-    [[nodiscard]] sockaddr_in get_sockadd_in() const { return m_sockaddr_in; }
-
-    sockaddr_in m_sockaddr_in{};
-    int m_socket_fd;
-    std::string m_address;
-    std::string m_name;
-    std::vector<char> m_receive_buffer;
-};
-
-[[nodiscard]] ping_pkt make_icmp_packet()
+// the highest ttl probed in traceroute and mtr mode, it has to fit the ttl field of the ip header
+static int parse_max_hops(const docopt::value & value)
 {
-    ping_pkt icmp_packet = {};
-    icmp_packet.hdr.type = ICMP_ECHO;
-    icmp_packet.hdr.un.echo.id = getpid();
-    icmp_packet.hdr.un.echo.sequence = 0;
-
-    // the payload is arbitrary, it can be any data but it is good practice to send some recognizable string.
-    // its important to make sure to calculate the checksum _after_ filling the payload.
-    for (size_t i = 0; i < icmp_payload_length; ++i)
+    auto hops = value.asLong();
+    if (hops < 1 || hops > 255)
     {
-        icmp_packet.payload[i] = static_cast<char>('0' + i);
+        throw std::runtime_error(fmt::format("the --max-hops must be 1 to 255, not {}", hops));
     }
-    icmp_packet.hdr.checksum = calculate_checksum(icmp_packet);
-    return icmp_packet;
+    return static_cast<int>(hops);
 }
 
-// when sending icmp ping packets using raw sockets verifing the echo.id is
-// required otherwise you maybe looking at unrelated ping replys
-[[nodiscard]] bool verify_reply(const ping_pkt & sent, const ping_pkt & received, int expected_id)
+// a comma separated list of interfaces or addresses, a missing option is a list with one empty entry: the routing table's choice
+static std::vector<std::string> parse_list(const docopt::value & value)
 {
-    if (received.hdr.type != ICMP_ECHOREPLY)
+    if (!value)
     {
-        return false;
+        return {""};
     }
-    if (received.hdr.code != 0)
+    std::vector<std::string> result;
+    std::string_view list = value.asString();
+    while (!list.empty())
     {
-        return false;
+        auto comma = std::min(list.find(','), list.size());
+        result.emplace_back(list.substr(0, comma));
+        list.remove_prefix(std::min(comma + 1, list.size()));
     }
-    if (received.hdr.un.echo.id != expected_id)
+    return result;
+}
+
+// the interfaces to probe through in daemon mode, 'physical' stands for every physical network card
+static std::vector<std::string> parse_devices(const docopt::value & value)
+{
+    if (!value || value.asString() != "physical")
     {
-        return false;
+        return parse_list(value);
     }
-    if (memcmp(&sent.payload[0], &received.payload[0], icmp_payload_length) != 0)
+    auto devices = get_physical_networkcard_names();
+    if (devices.empty())
     {
-        return false;
+        throw std::runtime_error("no physical network interfaces found");
     }
-    return true;
+    return devices;
 }
 
-[[nodiscard]] std::optional<double_milliseconds> ping(const std::string & address, std::chrono::milliseconds timeout)
+int main(int argc, char * argv[])
 {
-    auto deadline = std::chrono::steady_clock::now() + timeout;
-    icmp_socket socket(address);
-    socket.set_TTL(64);
-    socket.set_receive_timeout(timeout);
-    const uint16_t my_icmp_id = getpid();
-    const int ip_header_length = 20;
-    const int raw_icmp_response_length = ip_header_length + sizeof(ping_pkt);
-
-    auto packet = make_icmp_packet();
-    // fmt::print("  send {} bytes with id {}.\n", sizeof(packet),
-    // packet.hdr.un.echo.id); fmt::print("  {}\n", vic::to_hex_string(&packet, 1));
-    auto start_timepoint = std::chrono::steady_clock::now();
-    socket.send_object(packet);
+    using namespace std::chrono_literals;
+    auto arguments = docopt::docopt(usage, {argv + 1, argv + argc}, true, "ping 1.2");
 
-    while (std::chrono::steady_clock::now() < deadline)
+    if (arguments["--mtr"].asBool())
     {
-        auto data_received = socket.receive(raw_icmp_response_length);
-        auto end_timepoint = std::chrono::steady_clock::now();
-        auto duration = std::chrono::duration_cast<double_milliseconds>(
-            end_timepoint - start_timepoint);
+        try
+        {
+            icmp_ns::mtr_options mtr_options;
+            mtr_options.max_hops = parse_max_hops(arguments["--max-hops"]);
+            mtr_options.interval = std::chrono::milliseconds(arguments["--interval"].asLong());
+            mtr_options.rounds = arguments["--count"].asLong();
+            mtr_options.flow = parse_flow(arguments["--flow"]);
+            mtr_options.flows = arguments["--flows"].asLong();
+            icmp_ns::mtr(arguments["<target>"].asStringList(), mtr_options);
+        }
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+            return -1;
+        }
+        return 0;
+    }
 
-        if (data_received.size() == raw_icmp_response_length)
+    if (arguments["--capacity"].asBool())
+    {
+        try
         {
-            auto data = socket.get_received_data<ping_pkt>(ip_header_length);
-            if (verify_reply(packet, data, my_icmp_id))
+            icmp_ns::capacity_options capacity_options;
+            capacity_options.packet_size = arguments["--size"].asLong();
+            capacity_options.trains = arguments["--trains"].asLong();
+            for (const auto & target : arguments["<target>"].asStringList())
             {
-                return duration;
+                icmp_ns::estimate_capacity(target, capacity_options);
             }
-            fmt::print("  warning unrelated message received of {} bytes with id {}.\n", data_received.size(), data.hdr.un.echo.id);
-            continue;
         }
-        fmt::print("  warning unrelated message received of {} bytes.\n", data_received.size());
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+            return -1;
+        }
+        return 0;
     }
 
-    return {}; // timeout, no response received
-}
+    if (arguments["--daemon"].asBool())
+    {
+        try
+        {
+            auto interval = std::chrono::milliseconds(arguments["--interval"].asLong());
+            if (interval < icmp_ns::min_target_interval)
+            {
+                throw std::runtime_error(fmt::format("the --interval of a target must be at least {} ms", icmp_ns::min_target_interval.count()));
+            }
+            auto checkpoint_interval = std::chrono::seconds(arguments["--checkpoint-interval"].asLong());
+            if (checkpoint_interval <= 0s)
+            {
+                throw std::runtime_error("the --checkpoint-interval must be at least 1 s");
+            }
+            auto push_interval = std::chrono::seconds(arguments["--push-interval"].asLong());
+            if (push_interval <= 0s)
+            {
+                throw std::runtime_error("the --push-interval must be at least 1 s");
+            }
+            // one engine per source address and interface, each with its own socket and range of icmp ids
+            std::vector<std::unique_ptr<icmp_ns::probe_engine>> engines;
+            for (const auto & source : parse_list(arguments["--sources"]))
+            {
+                for (const auto & device : parse_devices(arguments["--devices"]))
+                {
+                    icmp_ns::engine_options engine_options;
+                    engine_options.device = device;
+                    if (!source.empty())
+                    {
+                        engine_options.source = icmp_ns::resolve_address(source).sin_addr;
+                    }
+                    engine_options.first_id = icmp_ns::claim_icmp_ids(engine_options.id_count);
+                    engines.push_back(std::make_unique<icmp_ns::probe_engine>(engine_options));
+                }
+            }
+            icmp_ns::control_server server(arguments["--socket"].asString(), engines, interval);
+            if (arguments["--devices"] && arguments["--devices"].asString() == "physical")
+            {
+                server.follow_physical_interfaces();
+            }
+            std::unique_ptr<icmp_ns::shard_agent> shard_agent;
+            if (arguments["--shard-block"])
+            {
+                if (!arguments["--targets"])
+                {
+                    throw std::runtime_error("a sharded daemon probes the targets of a --targets file");
+                }
+                shard_agent = std::make_unique<icmp_ns::shard_agent>(arguments["--shard-block"].asString(), arguments["--shards"].asLong(), 1s);
+                server.shard_with(*shard_agent);
+                fmt::print("agent {} of shard block {} owns {} of {} shards.\n", shard_agent->slot(), arguments["--shard-block"].asString(),
+                           shard_agent->owned(), shard_agent->shards());
+            }
+            for (auto & engine : engines)
+            {
+                if (arguments["--checkpoint"])
+                {
+                    auto path = icmp_ns::checkpoint_path(arguments["--checkpoint"].asString(), *engine);
+                    auto start = std::chrono::steady_clock::now();
+                    auto restored = icmp_ns::restore_checkpoint(path, *engine);
+                    fmt::print("restored {} targets from {} in {:.1f}ms.\n", restored, path,
+                               std::chrono::duration_cast<double_milliseconds>(std::chrono::steady_clock::now() - start).count());
+                }
+                for (const auto & target : arguments["<target>"].asStringList())
+                {
+                    engine->add_target(target, interval); // a target that was restored keeps its state
+                }
+            }
+            if (arguments["--checkpoint"])
+            {
+                server.checkpoint_every(arguments["--checkpoint"].asString(), checkpoint_interval);
+            }
+            if (arguments["--push"])
+            {
+                server.push_every(arguments["--push"].asString(), push_interval);
+            }
+            if (arguments["--targets"])
+            {
+                server.watch_target_file(arguments["--targets"].asString());
+            }
+            for (auto & engine : engines)
+            {
+                engine->start();
+                fmt::print("probing {} targets{}, control socket {}.\n", engine->targets()->targets.size(),
+                           engine->name().empty() ? "" : " through " + engine->name(), arguments["--socket"].asString());
+            }
+            server.run();
+            for (auto & engine : engines)
+            {
+                engine->stop();
+            }
+        }
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+            return -1;
+        }
+        return 0;
+    }
 
-} // namespace icmp_ns
+    if (arguments["--control"].asBool())
+    {
+        try
+        {
+            std::string command;
+            for (const auto & word : arguments["<command>"].asStringList())
+            {
+                command += (command.empty() ? "" : " ") + word;
+            }
+            auto response = icmp_ns::send_control_command(arguments["--socket"].asString(), command);
+            fmt::print("{}", response);
+            return response.find("error:") == std::string::npos ? 0 : -1;
+        }
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+            return -1;
+        }
+    }
 
-int main(int argc, char * argv[])
-{
-    using namespace std::chrono_literals;
-    if (argc < 2)
+    if (arguments["--sweep"].asBool())
     {
-        fmt::print("usage: ping_test <address>\n\n");
-        return -1;
+        try
+        {
+            icmp_ns::sweep_options sweep_options;
+            sweep_options.max_payload = arguments["--size"].asLong() - icmp_ns::ip_header_length - sizeof(icmp_ns::icmp_header);
+            sweep_options.rounds = arguments["--count"].asLong();
+            icmp_ns::payload_sweep(arguments["<target>"].asStringList(), sweep_options);
+        }
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+            return -1;
+        }
+        return 0;
     }
 
-    auto address = dns_lookup(argv[1]);
-    fmt::print("PING {} ({}).\n", address, reverse_dns_lookup(address));
+    if (arguments["--batch"].asBool())
+    {
+        try
+        {
+            icmp_ns::batch_options batch_options;
+            batch_options.backend = arguments["--backend"].asString();
+            batch_options.clock = arguments["--clock"].asString();
+            batch_options.stats = arguments["--stats"].asString();
+            batch_options.rounds = arguments["--count"].asLong();
+            batch_options.interval = std::chrono::milliseconds(arguments["--interval"].asLong());
+            icmp_ns::run_batch_pings(arguments["<target>"].asStringList(), batch_options);
+        }
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+            return -1;
+        }
+        return 0;
+    }
+
+    if (arguments["--mesh"].asBool())
+    {
+        try
+        {
+            icmp_ns::mesh_options mesh_options;
+            mesh_options.backend = arguments["--backend"].asString();
+            mesh_options.rounds = arguments["--count"].asLong();
+            mesh_options.interval = std::chrono::milliseconds(arguments["--interval"].asLong());
+            if (arguments["--self"])
+            {
+                mesh_options.self = arguments["--self"].asString();
+            }
+            if (arguments["--mesh-snapshot"])
+            {
+                mesh_options.snapshot = arguments["--mesh-snapshot"].asString();
+            }
+            auto peers = arguments["<target>"].asStringList();
+            if (arguments["--targets"])
+            {
+                for (const auto & spec : icmp_ns::read_target_file(arguments["--targets"].asString(), mesh_options.interval))
+                {
+                    peers.push_back(spec.address);
+                }
+            }
+            icmp_ns::run_mesh(peers, mesh_options);
+        }
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+            return -1;
+        }
+        return 0;
+    }
+
+    if (arguments["--timestamp"].asBool())
+    {
+        try
+        {
+            icmp_ns::timestamp_options timestamp_options;
+            timestamp_options.rounds = arguments["--count"].asLong();
+            timestamp_options.interval = std::chrono::milliseconds(arguments["--interval"].asLong());
+            icmp_ns::timestamp_probe(arguments["<target>"].asStringList(), timestamp_options);
+        }
+        catch (const std::exception & e)
+        {
+            fmt::print("error: {}\n", e.what());
+            return -1;
+        }
+        return 0;
+    }
+
+    auto address = dns_lookup(arguments["<address>"].asString());
 
     const auto timeout = 2500ms;
-    for (int i = 0; i < 4; ++i)
+
+    try
     {
-        auto duration = icmp_ns::ping(address, timeout);
-        if (duration)
+        const int count = arguments["--count"].asLong();
+        const auto flow = parse_flow(arguments["--flow"]);
+        icmp_ns::realtime_options options;
+        options.enabled = arguments["--realtime"].asBool() || arguments["--compare"].asBool();
+        options.priority = arguments["--priority"].asLong();
+        if (arguments["--cpus"])
+        {
+            options.cpus = icmp_ns::parse_cpu_list(arguments["--cpus"].asString());
+        }
+
+        if (arguments["--traceroute"].asBool())
+        {
+            icmp_ns::traceroute_options traceroute_options;
+            traceroute_options.max_hops = parse_max_hops(arguments["--max-hops"]);
+            traceroute_options.timeout = timeout;
+            traceroute_options.flow = flow;
+            traceroute_options.flows = arguments["--flows"].asLong();
+            icmp_ns::traceroute(address, traceroute_options);
+            return 0;
+        }
+
+        if (arguments["--pmtu"].asBool())
         {
-            fmt::print("ping from {}: time={:.2f}ms.\n", address, duration->count());
+            icmp_ns::pmtu_options pmtu_options;
+            pmtu_options.max_mtu = arguments["--max-mtu"].asLong();
+            pmtu_options.timeout = timeout;
+            return icmp_ns::discover_path_mtu(address, pmtu_options) > 0 ? 0 : -1;
         }
-        else
+
+        fmt::print("PING {} ({}).\n", address, reverse_dns_lookup(address));
+        if (arguments["--compare"].asBool())
         {
-            fmt::print("ping from {} timed out, no response after {}.\n", address, timeout);
+            auto normal = icmp_ns::run_pings(address, count, flow, timeout, {});
+            icmp_ns::lock_memory();
+            auto realtime = icmp_ns::run_pings(address, count, flow, timeout, options);
+            icmp_ns::print_statistics("normal scheduling", normal);
+            icmp_ns::print_statistics("realtime scheduling", realtime);
+            if (normal.variance() > 0.0)
+            {
+                fmt::print("variance reduced by {:.1f}%, stddev reduced by {:.1f}%.\n", 100.0 * (1.0 - realtime.variance() / normal.variance()),
+                           100.0 * (1.0 - realtime.stddev() / normal.stddev()));
+            }
+            return 0;
         }
+
+        if (options.enabled)
+        {
+            icmp_ns::lock_memory();
+        }
+        icmp_ns::run_pings(address, count, flow, timeout, options);
+    }
+    catch (const std::exception & e)
+    {
+        fmt::print("error: {}\n", e.what());
+        return -1;
     }
 }
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <netinet/ip_icmp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "icmp.h"
+#include "pmtu.h"
+#include "probe_table.h"
+
+namespace icmp_ns {
+
+// the ip and icmp headers are part of the mtu, the payload is what remains
+static const int icmp_overhead = sizeof(ipv4_header) + sizeof(icmp_header);
+
+// spreads up to 'count' sizes evenly over (lower, upper], the last one is always 'upper'
+static std::vector<int> spread_sizes(int lower, int upper, int count)
+{
+    std::vector<int> result;
+    for (int i = 1; i <= count; ++i)
+    {
+        auto size = lower + ((upper - lower) * i + count - 1) / count;
+        if (result.empty() || result.back() != size)
+        {
+            result.push_back(size);
+        }
+    }
+    return result;
+}
+
+int discover_path_mtu(const std::string & address, const pmtu_options & options)
+{
+    // an ipv4 packet is at most 65535 bytes, and every link carries at least 68
+    if (options.min_mtu < 68 || options.max_mtu < options.min_mtu || options.max_mtu > 65535)
+    {
+        throw std::runtime_error(fmt::format("mtu range {} to {} is not within 68 to 65535 bytes", options.min_mtu, options.max_mtu));
+    }
+    if (options.probes_per_round < 1)
+    {
+        throw std::runtime_error(fmt::format("invalid number of probes per round '{}'", options.probes_per_round));
+    }
+    icmp_socket socket(address);
+    socket.accept_replies_and_errors();
+    socket.set_mtu_discover(IP_PMTUDISC_PROBE);
+    socket.set_receive_buffer_size(options.probes_per_round * (options.max_mtu + 1024));
+    const auto destination = socket.get_sockadd_in().sin_addr;
+
+    icmp_payload_template payload(options.max_mtu - icmp_overhead);
+    probe_table probes;
+    int confirmed = 0; // the largest size that got a reply
+    int upper = options.max_mtu;
+    for (int round = 1; std::max(confirmed, options.min_mtu - 1) < upper; ++round)
+    {
+        auto lower = std::max(confirmed, options.min_mtu - 1);
+        auto sizes = spread_sizes(lower, upper, options.probes_per_round);
+        fmt::print("round {}: probing {} sizes from {} to {} bytes\n", round, sizes.size(), sizes.front(), sizes.back());
+
+        std::vector<icmp_header> headers;
+        std::vector<batch_packet> batch;
+        std::vector<uint16_t> sequences;
+        headers.reserve(sizes.size());
+        auto now = std::chrono::steady_clock::now();
+        for (uint32_t index = 0; index < sizes.size(); ++index)
+        {
+            size_t payload_length = sizes[index] - icmp_overhead;
+            sequences.push_back(probes.add(index, destination, 0, now));
+            headers.push_back(payload.make_header(sequences.back(), payload_length));
+            batch.push_back({&headers.back(), sizeof(icmp_header), 0, nullptr, payload.data(), payload_length});
+        }
+
+        // the sizes are sent from small to large, the first one that does not fit the outgoing interface ends the batch
+        auto sent = socket.send_batch(batch);
+        if (sent < sizes.size())
+        {
+            fmt::print("  {} bytes: too big for the outgoing interface\n", sizes[sent]);
+            upper = std::min(upper, sizes[sent] - 1);
+            for (auto index = sent; index < sizes.size(); ++index)
+            {
+                probes.complete(sequences[index]);
+            }
+        }
+
+        std::vector<bool> answered(sizes.size());
+        auto pending = sent;
+        auto deadline = now + options.timeout;
+        while (pending > 0)
+        {
+            auto reply = receive_probe_reply(socket, probes, deadline);
+            if (!reply)
+            {
+                break;
+            }
+            auto index = reply->sent_probe.target;
+            auto size = sizes[index];
+            answered[index] = true;
+            --pending;
+
+            const auto & message = reply->message;
+            if (message.type == ICMP_ECHOREPLY)
+            {
+                fmt::print("  {} bytes: reply in {:.3f} ms\n", size, reply->rtt.count());
+                confirmed = std::max(confirmed, size);
+            }
+            else if (message.type == ICMP_DEST_UNREACH && message.code == ICMP_FRAG_NEEDED)
+            {
+                std::string from = inet_ntoa(message.source);
+                fmt::print("  {} bytes: fragmentation needed, next-hop mtu {} reported by {}\n", size, message.mtu, from);
+                upper = std::min(upper, size - 1);
+                if (message.mtu >= options.min_mtu && message.mtu < size)
+                {
+                    upper = std::min<int>(upper, message.mtu);
+                }
+            }
+            else
+            {
+                fmt::print("  {} bytes: {} from {}\n", size, describe_icmp_message(message.type, message.code), inet_ntoa(message.source));
+                fmt::print("path mtu to {} could not be determined.\n", address);
+                return 0;
+            }
+        }
+
+        // a router that drops packets that are too big without sending an error is a 'black hole', the size is treated as too big
+        for (size_t index = 0; index < sent; ++index)
+        {
+            if (!answered[index])
+            {
+                fmt::print("  {} bytes: no reply\n", sizes[index]);
+                upper = std::min(upper, sizes[index] - 1);
+                probes.complete(sequences[index]);
+            }
+        }
+
+        // a reply to a size above a size that got no reply means the smaller one was lost, not too big
+        upper = std::max(upper, confirmed);
+    }
+
+    if (confirmed == 0)
+    {
+        fmt::print("no reply from {}, path mtu could not be determined.\n", address);
+        return 0;
+    }
+    fmt::print("path mtu to {} is {} bytes ({} bytes of icmp payload).\n", address, confirmed, confirmed - icmp_overhead);
+    return confirmed;
+}
+
+} // namespace icmp_ns
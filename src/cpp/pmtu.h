@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+
+namespace icmp_ns {
+
+struct pmtu_options
+{
+    int min_mtu = 68; // every ipv4 link must be able to carry 68 bytes
+    int max_mtu = 9000;
+    int probes_per_round = 16;
+    std::chrono::milliseconds timeout{2500};
+};
+
+// finds the largest packet that reaches 'address' without fragmentation.
+// every round sends echo requests of several sizes with the don't fragment bit set at once, and narrows the range using
+// the replies and the fragmentation needed errors. returns the path mtu in bytes, or 0 if no echo request got a reply.
+int discover_path_mtu(const std::string & address, const pmtu_options & options);
+
+} // namespace icmp_ns
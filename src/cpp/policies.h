@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/ip_icmp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fmt/core.h>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "icmp.h"
+#include "icmp_ids.h"
+#include "statistics.h"
+#include "tsc_clock.h"
+
+// the policies that probe_loop is built from. a policy is a plain class with the members probe_loop calls,
+// there are no virtual functions: every combination is compiled into its own loop and the calls are inlined.
+//
+// a backend sends echo requests and delivers the replies:
+//   static constexpr const char * name;
+//   void send(const std::vector<outgoing_probe> & probes, int64_t now);   now is the clock policy's time of sending
+//   template <typename F> void receive(int64_t timeout_ns, F && on_reply); calls on_reply(sequence, source, timestamp)
+//                                                                          for every reply that arrives before the timeout
+// a clock tells the time in nanoseconds:
+//   static constexpr const char * name;
+//   static int64_t now();
+//   static int64_t receive_time(std::optional<int64_t> timestamp);       the time a reply arrived
+// a stats policy collects the rtts of one target:
+//   static constexpr const char * name;
+//   void add(int64_t rtt_ns);
+//   std::string describe() const;
+
+namespace icmp_ns {
+
+struct outgoing_probe
+{
+    const sockaddr_in * destination;
+    uint16_t sequence;
+};
+
+// raw icmp socket, requires root or CAP_NET_RAW. the kernel timestamps the replies, which the kernel clock policy uses.
+class raw_backend
+{
+public:
+    static constexpr const char * name = "raw";
+
+    raw_backend()
+    {
+        m_socket.accept_replies_and_errors();
+        m_socket.set_receive_buffer_size(8 * 1024 * 1024);
+        m_socket.enable_receive_timestamps();
+    }
+
+    void send(const std::vector<outgoing_probe> & probes, int64_t)
+    {
+        m_packets.clear();
+        m_batch.clear();
+        m_packets.reserve(probes.size());
+        for (const auto & probe : probes)
+        {
+            m_packets.push_back(make_icmp_packet(probe.sequence, {}, m_id));
+            m_batch.push_back({&m_packets.back(), sizeof(ping_pkt), 0, probe.destination});
+        }
+        m_socket.send_batch(m_batch, [](size_t, int) {});
+    }
+
+    template <typename F>
+    void receive(int64_t timeout_ns, F && on_reply)
+    {
+        if (!m_socket.wait_for_data(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::nanoseconds(timeout_ns))))
+        {
+            return;
+        }
+        const auto & data = m_socket.receive(1500);
+        auto message = decode_icmp_message(data, m_socket.get_received_from());
+        if (message && message->type == ICMP_ECHOREPLY && message->id == m_id)
+        {
+            auto timestamp = m_socket.get_received_timestamp();
+            on_reply(message->sequence, message->source, timestamp ? std::optional<int64_t>(timestamp->count()) : std::nullopt);
+        }
+    }
+
+private:
+    icmp_socket m_socket;
+    uint16_t m_id = process_icmp_id();
+    std::vector<ping_pkt> m_packets;
+    std::vector<batch_packet> m_batch;
+};
+
+// unprivileged "ping socket" (SOCK_DGRAM, IPPROTO_ICMP), allowed for the groups in net.ipv4.ping_group_range.
+// the kernel sets the icmp id to the socket's port and only queues the replies to this socket, without an ip header.
+class dgram_backend
+{
+public:
+    static constexpr const char * name = "dgram";
+
+    dgram_backend()
+    {
+        m_fd = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+        if (m_fd < 0)
+        {
+            throw std::runtime_error(fmt::format("could not create an icmp datagram socket: {} (see net.ipv4.ping_group_range)", std::strerror(errno)));
+        }
+        int enable = 1;
+        setsockopt(m_fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+    }
+
+    ~dgram_backend()
+    {
+        ::close(m_fd);
+    }
+
+    dgram_backend(const dgram_backend &) = delete;
+    dgram_backend & operator=(const dgram_backend &) = delete;
+
+    void send(const std::vector<outgoing_probe> & probes, int64_t)
+    {
+        for (const auto & probe : probes)
+        {
+            auto packet = make_icmp_packet(probe.sequence);
+            ::sendto(m_fd, &packet, sizeof(packet), 0, reinterpret_cast<const sockaddr *>(probe.destination), sizeof(sockaddr_in));
+        }
+    }
+
+    template <typename F>
+    void receive(int64_t timeout_ns, F && on_reply)
+    {
+        pollfd descriptor{m_fd, POLLIN, 0};
+        if (::poll(&descriptor, 1, static_cast<int>(timeout_ns / 1000000)) <= 0)
+        {
+            return;
+        }
+        ping_pkt reply{};
+        sockaddr_in from{};
+        iovec vector{&reply, sizeof(reply)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(timespec))];
+        msghdr header{};
+        header.msg_name = &from;
+        header.msg_namelen = sizeof(from);
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        if (::recvmsg(m_fd, &header, MSG_DONTWAIT) < static_cast<ssize_t>(sizeof(icmp_header)) || reply.hdr.type != ICMP_ECHOREPLY)
+        {
+            return;
+        }
+        std::optional<int64_t> timestamp;
+        for (auto * message = CMSG_FIRSTHDR(&header); message != nullptr; message = CMSG_NXTHDR(&header, message))
+        {
+            if (message->cmsg_level == SOL_SOCKET && message->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                timespec time;
+                std::memcpy(&time, CMSG_DATA(message), sizeof(time));
+                timestamp = time.tv_sec * 1000000000LL + time.tv_nsec;
+            }
+        }
+        on_reply(echo_sequence(reply.hdr), from.sin_addr, timestamp);
+    }
+
+private:
+    int m_fd = -1;
+};
+
+// answers every probe itself, without a system call. the reply is stamped with the send time plus a latency that is
+// fixed per destination (0.1 to 5 ms, derived from its address) with a little jitter, so the kernel clock policy sees
+// realistic rtts and the steady clock policy measures only the cost of the loop itself.
+class simulated_backend
+{
+public:
+    static constexpr const char * name = "simulated";
+
+    void send(const std::vector<outgoing_probe> & probes, int64_t now)
+    {
+        for (const auto & probe : probes)
+        {
+            m_replies.push({now + latency(probe.destination->sin_addr), probe.sequence, probe.destination->sin_addr});
+        }
+    }
+
+    template <typename F>
+    void receive(int64_t timeout_ns, F && on_reply)
+    {
+        if (m_replies.empty())
+        {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(timeout_ns)); // nothing else will arrive
+            return;
+        }
+        auto reply = m_replies.front();
+        m_replies.pop();
+        on_reply(reply.sequence, reply.source, std::optional<int64_t>(reply.arrival));
+    }
+
+    [[nodiscard]] int64_t latency(in_addr address)
+    {
+        uint32_t hash = address.s_addr * 2654435761u;
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 17;
+        m_random ^= m_random << 5;
+        return 100000 + static_cast<int64_t>(hash % 4900000) + static_cast<int64_t>(m_random % 20000);
+    }
+
+private:
+    struct simulated_reply
+    {
+        int64_t arrival;
+        uint16_t sequence;
+        in_addr source;
+    };
+    std::queue<simulated_reply> m_replies;
+    uint32_t m_random = 2463534242u;
+};
+
+// std::chrono::steady_clock, the time when the probe loop handles the reply
+struct steady_clock_policy
+{
+    static constexpr const char * name = "steady";
+
+    static int64_t now() { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+    static int64_t receive_time(std::optional<int64_t>) { return now(); }
+};
+
+// the time the kernel received the reply (SO_TIMESTAMPNS, CLOCK_REALTIME), without the scheduling delay of the probe loop
+struct kernel_clock_policy
+{
+    static constexpr const char * name = "kernel";
+
+    static int64_t now()
+    {
+        timespec time;
+        clock_gettime(CLOCK_REALTIME, &time);
+        return time.tv_sec * 1000000000LL + time.tv_nsec;
+    }
+    static int64_t receive_time(std::optional<int64_t> timestamp) { return timestamp ? *timestamp : now(); }
+};
+
+// the time stamp counter, see tsc_clock. on the same time line as the steady clock policy, but cheaper to read.
+// run_batch_pings() calibrates it before the loop starts.
+struct tsc_clock_policy
+{
+    static constexpr const char * name = "tsc";
+
+    static int64_t now() { return tsc_clock::now(); }
+    static int64_t receive_time(std::optional<int64_t>) { return now(); }
+};
+
+// count, min, avg, max and stddev in O(1) memory, see rtt_statistics
+class summary_stats
+{
+public:
+    static constexpr const char * name = "summary";
+
+    void add(int64_t rtt_ns) { m_statistics.add(static_cast<double>(rtt_ns) / 1e6); }
+
+    [[nodiscard]] std::string describe() const
+    {
+        return fmt::format("{} replies, rtt min/avg/max/stddev = {:.3f}/{:.3f}/{:.3f}/{:.3f} ms", m_statistics.count(), m_statistics.min(), m_statistics.mean(),
+                           m_statistics.max(), m_statistics.stddev());
+    }
+
+private:
+    rtt_statistics m_statistics;
+};
+
+// a log-linear histogram in the style of HdrHistogram: every power of two microseconds is split into 16 linear buckets,
+// so every percentile is known within about 6% with a fixed 4 kB per target.
+class histogram_stats
+{
+public:
+    static constexpr const char * name = "histogram";
+
+    void add(int64_t rtt_ns)
+    {
+        auto microseconds = static_cast<uint64_t>(std::max<int64_t>(rtt_ns / 1000, 0));
+        ++m_buckets[bucket(microseconds)];
+        ++m_count;
+    }
+
+    [[nodiscard]] double percentile(double fraction) const
+    {
+        auto rank = static_cast<uint64_t>(std::ceil(fraction * m_count));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_buckets.size(); ++i)
+        {
+            seen += m_buckets[i];
+            if (seen >= rank && m_buckets[i] > 0)
+            {
+                return upper_bound(i) / 1000.0;
+            }
+        }
+        return 0.0;
+    }
+
+    [[nodiscard]] std::string describe() const
+    {
+        return fmt::format("{} replies, rtt p50/p90/p99/p99.9 = {:.3f}/{:.3f}/{:.3f}/{:.3f} ms", m_count, percentile(0.5), percentile(0.9), percentile(0.99),
+                           percentile(0.999));
+    }
+
+private:
+    static constexpr size_t sub_buckets = 16;
+    static constexpr size_t magnitudes = 32;
+
+    static size_t bucket(uint64_t microseconds)
+    {
+        if (microseconds < sub_buckets)
+        {
+            return microseconds;
+        }
+        // the 4 bits below the highest set bit select the linear bucket within the power of two
+        size_t magnitude = 63 - __builtin_clzll(microseconds) - 4;
+        auto index = sub_buckets + magnitude * sub_buckets + ((microseconds >> magnitude) - sub_buckets);
+        return std::min(index, sub_buckets * magnitudes - 1);
+    }
+
+    static uint64_t upper_bound(size_t index)
+    {
+        if (index < sub_buckets)
+        {
+            return index + 1;
+        }
+        auto magnitude = (index - sub_buckets) / sub_buckets;
+        auto offset = (index - sub_buckets) % sub_buckets;
+        return (sub_buckets + offset + 1) << magnitude;
+    }
+
+    std::array<uint64_t, sub_buckets * magnitudes> m_buckets{};
+    uint64_t m_count = 0;
+};
+
+} // namespace icmp_ns
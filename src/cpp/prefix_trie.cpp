@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fmt/core.h>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "prefix_trie.h"
+
+namespace icmp_ns {
+
+// the loss of a target is summed up in steps of half a percent, so the small moves of its ewma do not walk the trie
+static const uint16_t loss_steps = 200;
+
+static uint32_t prefix_mask(uint8_t length)
+{
+    return length == 0 ? 0 : ~0u << (32 - length);
+}
+
+static std::string format_prefix(uint32_t address, uint8_t length)
+{
+    in_addr network{htonl(address)};
+    return fmt::format("{}/{}", inet_ntoa(network), length);
+}
+
+prefix_trie::prefix_trie(const std::vector<in_addr> & addresses) :
+    m_leaf_of(addresses.size(), no_node)
+{
+    std::vector<std::pair<uint32_t, size_t>> sorted;
+    sorted.reserve(addresses.size());
+    for (size_t i = 0; i < addresses.size(); ++i)
+    {
+        sorted.emplace_back(ntohl(addresses[i].s_addr), i);
+    }
+    std::sort(sorted.begin(), sorted.end());
+
+    m_leaves.reset(new leaf_node[sorted.size()]);
+    for (size_t i = 0; i < sorted.size(); ++i)
+    {
+        if (m_leaf_count > 0 && m_leaves[m_leaf_count - 1].address == sorted[i].first)
+        {
+            continue;
+        }
+        m_leaves[m_leaf_count].address = sorted[i].first;
+        m_leaf_of[sorted[i].second] = static_cast<uint32_t>(m_leaf_count);
+        ++m_leaf_count;
+    }
+    if (m_leaf_count > 0)
+    {
+        m_nodes.reset(new inner_node[m_leaf_count - 1]);
+        m_root = build(0, m_leaf_count, no_node);
+    }
+}
+
+// the leaves are sorted, so the leaves below a node are a range and the prefix they share is the one of its first and last leaf
+uint32_t prefix_trie::build(size_t first, size_t last, uint32_t parent)
+{
+    if (last - first == 1)
+    {
+        m_leaves[first].parent = parent;
+        return leaf_flag | static_cast<uint32_t>(first);
+    }
+    auto low = m_leaves[first].address;
+    auto length = static_cast<uint8_t>(__builtin_clz(low ^ m_leaves[last - 1].address));
+    auto index = static_cast<uint32_t>(m_node_count++);
+    auto & node = m_nodes[index];
+    node.prefix = low & prefix_mask(length);
+    node.length = length;
+    node.parent = parent;
+    node.targets = static_cast<uint32_t>(last - first);
+
+    auto split = std::partition_point(&m_leaves[first], &m_leaves[last],
+                                      [&](const leaf_node & leaf) { return ((leaf.address >> (31 - length)) & 1) == 0; }) - &m_leaves[0];
+    node.children[0] = build(first, static_cast<size_t>(split), index);
+    node.children[1] = build(static_cast<size_t>(split), last, index);
+    return index;
+}
+
+void prefix_trie::update(uint32_t leaf, double loss, std::optional<double> srtt_ms, std::vector<uint32_t> & recovered)
+{
+    auto & entry = m_leaves[leaf];
+    auto next_loss = static_cast<uint16_t>(std::clamp(loss, 0.0, 1.0) * loss_steps + 0.5);
+    auto next_srtt = srtt_ms ? static_cast<uint32_t>(*srtt_ms * 1000.0 + 0.5) : 0u;
+    bool next_down = loss >= 0.5;
+    bool next_answering = srtt_ms.has_value();
+
+    // the walk to the root is the expensive part, a cache miss for most levels. the srtt of a target moves a little
+    // with every reply, it is only passed on when it moved by more than 1/32 since the last time.
+    auto current_srtt = entry.srtt_us.load(std::memory_order_relaxed);
+    auto moved = next_srtt > current_srtt ? next_srtt - current_srtt : current_srtt - next_srtt;
+    if (next_answering && entry.answering.load(std::memory_order_relaxed) && moved <= current_srtt / 32)
+    {
+        next_srtt = current_srtt;
+    }
+
+    // the sums are unsigned, a negative difference wraps around and back again when it is added
+    auto loss_step = static_cast<uint32_t>(next_loss - entry.loss.load(std::memory_order_relaxed));
+    auto srtt_step = static_cast<uint64_t>(static_cast<int64_t>(next_srtt) - current_srtt);
+    auto down_step = static_cast<uint32_t>(static_cast<int>(next_down) - entry.down.load(std::memory_order_relaxed));
+    auto answering_step = static_cast<uint32_t>(static_cast<int>(next_answering) - entry.answering.load(std::memory_order_relaxed));
+    if (loss_step == 0 && srtt_step == 0 && down_step == 0 && answering_step == 0)
+    {
+        return;
+    }
+    entry.loss.store(next_loss, std::memory_order_relaxed);
+    entry.srtt_us.store(next_srtt, std::memory_order_relaxed);
+    entry.down.store(next_down, std::memory_order_relaxed);
+    entry.answering.store(next_answering, std::memory_order_relaxed);
+
+    for (auto index = entry.parent; index != no_node; index = m_nodes[index].parent)
+    {
+        auto & node = m_nodes[index];
+        node.loss.store(node.loss.load(std::memory_order_relaxed) + loss_step, std::memory_order_relaxed);
+        node.srtt_us.store(node.srtt_us.load(std::memory_order_relaxed) + srtt_step, std::memory_order_relaxed);
+        node.answering.store(node.answering.load(std::memory_order_relaxed) + answering_step, std::memory_order_relaxed);
+        if (down_step != 0)
+        {
+            auto down = node.down.load(std::memory_order_relaxed) + down_step;
+            node.down.store(down, std::memory_order_relaxed);
+            if (node.reported && (node.targets - down) * 2 > node.targets)
+            {
+                node.reported = false;
+                recovered.push_back(index);
+            }
+        }
+    }
+}
+
+void prefix_trie::set_leaf(uint32_t leaf, double loss, std::optional<double> srtt_ms)
+{
+    auto & entry = m_leaves[leaf];
+    entry.loss.store(static_cast<uint16_t>(std::clamp(loss, 0.0, 1.0) * loss_steps + 0.5), std::memory_order_relaxed);
+    entry.srtt_us.store(srtt_ms ? static_cast<uint32_t>(*srtt_ms * 1000.0 + 0.5) : 0u, std::memory_order_relaxed);
+    entry.down.store(loss >= 0.5, std::memory_order_relaxed);
+    entry.answering.store(srtt_ms.has_value(), std::memory_order_relaxed);
+}
+
+void prefix_trie::sum_up()
+{
+    // the nodes are numbered in preorder, so the children of a node come after it
+    auto add = [&](inner_node & node, uint32_t child) {
+        if ((child & leaf_flag) != 0)
+        {
+            const auto & leaf = m_leaves[child & ~leaf_flag];
+            node.loss.store(node.loss.load(std::memory_order_relaxed) + leaf.loss.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            node.srtt_us.store(node.srtt_us.load(std::memory_order_relaxed) + leaf.srtt_us.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            node.down.store(node.down.load(std::memory_order_relaxed) + leaf.down.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            node.answering.store(node.answering.load(std::memory_order_relaxed) + leaf.answering.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return;
+        }
+        const auto & inner = m_nodes[child];
+        node.loss.store(node.loss.load(std::memory_order_relaxed) + inner.loss.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        node.srtt_us.store(node.srtt_us.load(std::memory_order_relaxed) + inner.srtt_us.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        node.down.store(node.down.load(std::memory_order_relaxed) + inner.down.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        node.answering.store(node.answering.load(std::memory_order_relaxed) + inner.answering.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    };
+    for (auto index = m_node_count; index-- > 0;)
+    {
+        auto & node = m_nodes[index];
+        node.loss.store(0, std::memory_order_relaxed);
+        node.srtt_us.store(0, std::memory_order_relaxed);
+        node.down.store(0, std::memory_order_relaxed);
+        node.answering.store(0, std::memory_order_relaxed);
+        add(node, node.children[0]);
+        add(node, node.children[1]);
+    }
+}
+
+uint32_t prefix_trie::down_prefix(uint32_t leaf, uint32_t min_targets) const
+{
+    // a node whose targets are not all down has no parent whose targets are
+    uint32_t found = no_node;
+    for (auto index = m_leaves[leaf].parent; index != no_node; index = m_nodes[index].parent)
+    {
+        const auto & node = m_nodes[index];
+        if (node.down.load(std::memory_order_relaxed) != node.targets)
+        {
+            break;
+        }
+        if (node.targets >= min_targets)
+        {
+            found = index;
+        }
+    }
+    return found;
+}
+
+prefix_aggregate prefix_trie::aggregate(uint32_t node) const
+{
+    const auto & entry = m_nodes[node];
+    prefix_aggregate result;
+    result.prefix = format_prefix(entry.prefix, entry.length);
+    result.targets = entry.targets;
+    result.down = entry.down.load(std::memory_order_relaxed);
+    result.answering = entry.answering.load(std::memory_order_relaxed);
+    result.loss = entry.loss.load(std::memory_order_relaxed) / static_cast<double>(loss_steps) / entry.targets;
+    result.srtt_ms = result.answering > 0 ? entry.srtt_us.load(std::memory_order_relaxed) / 1000.0 / result.answering : 0.0;
+    return result;
+}
+
+std::optional<prefix_aggregate> prefix_trie::find(in_addr prefix, uint8_t length) const
+{
+    auto address = ntohl(prefix.s_addr);
+    for (auto index = m_root; index != no_node;)
+    {
+        if ((index & leaf_flag) != 0)
+        {
+            const auto & leaf = m_leaves[index & ~leaf_flag];
+            if (((leaf.address ^ address) & prefix_mask(length)) != 0)
+            {
+                return {};
+            }
+            prefix_aggregate result;
+            result.prefix = format_prefix(leaf.address, 32);
+            result.targets = 1;
+            result.down = leaf.down.load(std::memory_order_relaxed);
+            result.answering = leaf.answering.load(std::memory_order_relaxed);
+            result.loss = leaf.loss.load(std::memory_order_relaxed) / static_cast<double>(loss_steps);
+            result.srtt_ms = leaf.srtt_us.load(std::memory_order_relaxed) / 1000.0;
+            return result;
+        }
+        // the targets within the prefix are the ones below the first node that is at least as long
+        const auto & node = m_nodes[index];
+        if (((node.prefix ^ address) & prefix_mask(std::min(node.length, length))) != 0)
+        {
+            return {};
+        }
+        if (node.length >= length)
+        {
+            return aggregate(index);
+        }
+        index = node.children[(address >> (31 - node.length)) & 1];
+    }
+    return {};
+}
+
+size_t prefix_trie::memory_usage() const
+{
+    return m_leaf_count * sizeof(leaf_node) + m_node_count * sizeof(inner_node) + m_leaf_of.capacity() * sizeof(uint32_t);
+}
+
+} // namespace icmp_ns
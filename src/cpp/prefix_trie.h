@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace icmp_ns {
+
+// the targets below one prefix of a prefix_trie, summed up
+struct prefix_aggregate
+{
+    std::string prefix; // like 10.3.17.0/26
+    uint32_t targets = 0;
+    uint32_t down = 0;      // targets with a recent loss of 50% or more
+    uint32_t answering = 0; // targets that replied at least once
+    double loss = 0.0;      // the mean recent loss of the targets, 0 to 1
+    double srtt_ms = 0.0;   // the mean srtt of the answering targets
+};
+
+// a compressed binary radix (patricia) trie over the ipv4 addresses of a target set. the targets are the leaves, and there is
+// an inner node at every prefix where their addresses branch, so n targets take n - 1 inner nodes at any spread of addresses.
+// every inner node keeps the sums of the loss, the srtt and the down state of the targets below it; a change of a target
+// updates the nodes on its path to the root, O(depth), which is at most 32 and about log2(n) for addresses that are spread out.
+// the shape is fixed when the trie is built. the probe thread is the only writer, the sums are atomics for the control api.
+class prefix_trie
+{
+public:
+    static constexpr uint32_t no_node = 0xffffffff;
+
+    // builds the trie of the addresses, a second occurrence of an address is left out, see leaf()
+    explicit prefix_trie(const std::vector<in_addr> & addresses);
+    prefix_trie(const prefix_trie &) = delete;
+    prefix_trie & operator=(const prefix_trie &) = delete;
+
+    // the leaf of the address at 'position' in the constructor's argument, no_node for a duplicate
+    [[nodiscard]] uint32_t leaf(size_t position) const { return m_leaf_of[position]; }
+
+    // sets the state of a leaf and updates the sums above it. the loss is summed up in steps of half a percent, and the srtt
+    // is passed on when it moved by more than 1/32. adds the inner nodes that were reported down and now have more
+    // than half of their targets back up to 'recovered', and clears their reported flag.
+    void update(uint32_t leaf, double loss, std::optional<double> srtt_ms, std::vector<uint32_t> & recovered);
+
+    // sets the state of a leaf without the sums above it, for a trie that was just built. sum_up() computes the sums of all
+    // inner nodes in one pass over them, O(n) instead of the O(n depth) of updating every leaf.
+    void set_leaf(uint32_t leaf, double loss, std::optional<double> srtt_ms);
+    void sum_up();
+
+    // the shortest prefix above the leaf whose targets are all down, if it has at least 'min_targets' of them, or no_node
+    [[nodiscard]] uint32_t down_prefix(uint32_t leaf, uint32_t min_targets) const;
+
+    // the flag of a node that was reported down, owned by the probe thread
+    [[nodiscard]] bool reported(uint32_t node) const { return m_nodes[node].reported; }
+    void set_reported(uint32_t node) { m_nodes[node].reported = true; }
+
+    [[nodiscard]] prefix_aggregate aggregate(uint32_t node) const;
+
+    // the aggregate of the targets within the prefix, nothing if there are none. it is read while the probe thread updates it.
+    [[nodiscard]] std::optional<prefix_aggregate> find(in_addr prefix, uint8_t length) const;
+
+    [[nodiscard]] size_t memory_usage() const;
+
+private:
+    // a child is the index of an inner node, or leaf_flag with the index of a leaf
+    static constexpr uint32_t leaf_flag = 0x80000000;
+
+    struct inner_node
+    {
+        uint32_t prefix = 0; // host byte order
+        uint8_t length = 0;
+        bool reported = false;
+        uint32_t parent = no_node;
+        uint32_t children[2] = {no_node, no_node};
+        uint32_t targets = 0;
+        std::atomic<uint32_t> down{0};
+        std::atomic<uint32_t> answering{0};
+        std::atomic<uint32_t> loss{0}; // in steps of 1/200
+        std::atomic<uint64_t> srtt_us{0};
+    };
+
+    struct leaf_node
+    {
+        uint32_t address = 0; // host byte order
+        uint32_t parent = no_node;
+        std::atomic<uint32_t> srtt_us{0};
+        std::atomic<uint16_t> loss{0};
+        std::atomic<bool> down{false};
+        std::atomic<bool> answering{false};
+    };
+
+    uint32_t build(size_t first, size_t last, uint32_t parent);
+
+    std::unique_ptr<leaf_node[]> m_leaves;
+    std::unique_ptr<inner_node[]> m_nodes;
+    size_t m_leaf_count = 0;
+    size_t m_node_count = 0;
+    uint32_t m_root = no_node;
+    std::vector<uint32_t> m_leaf_of;
+};
+
+} // namespace icmp_ns
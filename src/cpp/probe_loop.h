@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <cstdint>
+#include <fmt/core.h>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "policies.h"
+
+namespace icmp_ns {
+
+// sends 'rounds' batches with one echo request to every target and collects the rtts per target.
+// the backend, clock and statistics are template policies (see policies.h), so each combination compiles to its own
+// loop without virtual calls; the policy is chosen once, outside the loop, by run_batch_pings().
+template <typename Backend, typename Clock, typename Stats>
+class probe_loop
+{
+public:
+    probe_loop(Backend & backend, const std::vector<sockaddr_in> & targets) :
+        m_backend(backend),
+        m_targets(targets),
+        m_stats(targets.size()),
+        m_in_flight(65536)
+    {
+        // a round sends one probe per sequence number, with more targets the sequences of one round would collide
+        if (targets.size() > m_in_flight.size())
+        {
+            throw std::runtime_error(fmt::format("a batch probes at most {} targets, not {}", m_in_flight.size(), targets.size()));
+        }
+        m_probes.reserve(targets.size());
+    }
+
+    // returns the number of replies received
+    uint64_t run(int rounds, std::chrono::nanoseconds interval, std::chrono::nanoseconds timeout)
+    {
+        uint64_t received = 0;
+        for (int round = 0; round < rounds; ++round)
+        {
+            auto round_start = Clock::now();
+            m_probes.clear();
+            for (uint32_t index = 0; index < m_targets.size(); ++index)
+            {
+                auto sequence = m_next_sequence++;
+                m_in_flight[sequence] = {round_start, index, true};
+                m_probes.push_back({&m_targets[index], sequence});
+            }
+            m_backend.send(m_probes, round_start);
+
+            size_t pending = m_probes.size();
+            auto deadline = round_start + timeout.count();
+            for (auto now = Clock::now(); pending > 0 && now < deadline; now = Clock::now())
+            {
+                m_backend.receive(deadline - now, [&](uint16_t sequence, in_addr source, std::optional<int64_t> timestamp) {
+                    auto & probe = m_in_flight[sequence];
+                    if (!probe.outstanding || m_targets[probe.target].sin_addr.s_addr != source.s_addr)
+                    {
+                        return;
+                    }
+                    probe.outstanding = false;
+                    m_stats[probe.target].add(Clock::receive_time(timestamp) - probe.sent);
+                    --pending;
+                    ++received;
+                });
+            }
+
+            // the probes of the round that did not get a reply are lost. a late reply is drained here, or dropped in a later
+            // round, instead of being taken for a reply to that round's probe with the same sequence number.
+            for (const auto & probe : m_probes)
+            {
+                m_in_flight[probe.sequence].outstanding = false;
+            }
+            auto next_round = round_start + interval.count();
+            while (round + 1 < rounds && Clock::now() < next_round)
+            {
+                m_backend.receive(next_round - Clock::now(), [](uint16_t, in_addr, std::optional<int64_t>) {});
+            }
+        }
+        return received;
+    }
+
+    [[nodiscard]] const std::vector<Stats> & stats() const { return m_stats; }
+
+private:
+    struct in_flight_probe
+    {
+        int64_t sent = 0;
+        uint32_t target = 0;
+        bool outstanding = false;
+    };
+
+    Backend & m_backend;
+    const std::vector<sockaddr_in> & m_targets;
+    std::vector<Stats> m_stats;
+    std::vector<in_flight_probe> m_in_flight; // indexed by sequence number
+    std::vector<outgoing_probe> m_probes;
+    uint16_t m_next_sequence = 0;
+};
+
+} // namespace icmp_ns
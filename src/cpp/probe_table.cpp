@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+
+#include <chrono>
+#include <optional>
+#include <vector>
+
+#include "icmp.h"
+#include "icmp_ids.h"
+#include "probe_table.h"
+
+namespace icmp_ns {
+
+void send_probes(icmp_socket & socket, probe_table & probes, const std::vector<probe_request> & requests)
+{
+    std::vector<ping_pkt> packets;
+    std::vector<batch_packet> batch;
+    packets.reserve(requests.size());
+    batch.reserve(requests.size());
+
+    auto now = std::chrono::steady_clock::now();
+    for (const auto & request : requests)
+    {
+        auto destination = request.destination != nullptr ? request.destination->sin_addr : socket.get_sockadd_in().sin_addr;
+        packets.push_back(make_icmp_packet(probes.add(request.target, destination, request.ttl, now), request.flow));
+        batch.push_back({&packets.back(), sizeof(ping_pkt), request.ttl, request.destination});
+    }
+    socket.send_batch(batch);
+}
+
+std::optional<probe_reply> receive_probe_reply(icmp_socket & socket, probe_table & probes, std::chrono::steady_clock::time_point deadline)
+{
+    const uint16_t my_icmp_id = process_icmp_id();
+    const size_t max_packet_length = 1500;
+    while (true)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline || !socket.wait_for_data(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now)))
+        {
+            return {};
+        }
+        const auto & data_received = socket.receive(max_packet_length);
+        auto end_timepoint = std::chrono::steady_clock::now();
+        auto message = decode_icmp_message(data_received, socket.get_received_from());
+        if (!message || message->id != my_icmp_id)
+        {
+            continue;
+        }
+        auto * probe = probes.find(message->sequence);
+        if (probe == nullptr || probe->destination.s_addr != message->destination.s_addr)
+        {
+            continue;
+        }
+        probe_reply reply{*probe, *message, std::chrono::duration_cast<double_milliseconds>(end_timepoint - probe->sent), socket.get_received_timestamp()};
+        probes.complete(message->sequence);
+        return reply;
+    }
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "icmp.h"
+
+namespace icmp_ns {
+
+// an echo request that was sent and is waiting for its reply (or an icmp error about it)
+struct probe
+{
+    std::chrono::steady_clock::time_point sent;
+    in_addr destination{};
+    uint32_t target = 0;
+    int ttl = 0;
+    bool outstanding = false;
+};
+
+// keeps track of the outstanding probes of one icmp id, indexed by their 16-bit sequence number.
+// looking up the probe that belongs to a reply is a single array access.
+class probe_table
+{
+public:
+    // one entry per sequence number, a batch of more probes would reuse the sequences of probes still outstanding
+    static constexpr size_t capacity = 65536;
+
+    probe_table() :
+        m_probes(capacity)
+    {
+    }
+
+    // registers a new probe and returns the sequence number to send it with
+    [[nodiscard]] uint16_t add(uint32_t target, in_addr destination, int ttl, std::chrono::steady_clock::time_point sent)
+    {
+        auto sequence = m_next_sequence++;
+        auto & entry = m_probes[sequence];
+        if (!entry.outstanding)
+        {
+            ++m_outstanding;
+        }
+        entry = {sent, destination, target, ttl, true};
+        return sequence;
+    }
+
+    // returns the outstanding probe for a sequence number, or nullptr for unknown or already answered sequences
+    [[nodiscard]] probe * find(uint16_t sequence)
+    {
+        auto & entry = m_probes[sequence];
+        return entry.outstanding ? &entry : nullptr;
+    }
+
+    void complete(uint16_t sequence)
+    {
+        auto & entry = m_probes[sequence];
+        if (entry.outstanding)
+        {
+            entry.outstanding = false;
+            --m_outstanding;
+        }
+    }
+
+    [[nodiscard]] size_t outstanding() const { return m_outstanding; }
+
+private:
+    std::vector<probe> m_probes;
+    uint16_t m_next_sequence = 0;
+    size_t m_outstanding = 0;
+};
+
+struct probe_request
+{
+    uint32_t target;
+    const sockaddr_in * destination; // nullptr means the address the socket was created for
+    int ttl;
+    std::optional<uint16_t> flow{}; // keeps the checksum constant, see set_flow_checksum()
+};
+
+// builds an echo request for every request, registers them in the probe table and sends them all in one batch
+void send_probes(icmp_socket & socket, probe_table & probes, const std::vector<probe_request> & requests);
+
+struct probe_reply
+{
+    probe sent_probe; // the probe as it was sent
+    icmp_message message;
+    double_milliseconds rtt;
+    std::optional<std::chrono::nanoseconds> received_timestamp; // see icmp_socket::enable_receive_timestamps()
+};
+
+// waits for the next echo reply or icmp error that belongs to an outstanding probe and completes that probe.
+// returns nothing when the deadline passes first.
+[[nodiscard]] std::optional<probe_reply> receive_probe_reply(icmp_socket & socket, probe_table & probes, std::chrono::steady_clock::time_point deadline);
+
+} // namespace icmp_ns
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fmt/core.h>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "engine.h"
+#include "push.h"
+#include "push_protocol.h"
+
+namespace icmp_ns {
+
+static_assert(push_histogram_buckets == rtt_histogram_buckets, "the histogram is pushed bucket by bucket");
+
+// the totals of a target, in the units of the protocol
+static push_record totals_of(const engine_target & target)
+{
+    auto snapshot = target.snapshot();
+    push_record totals;
+    totals.address = ntohl(target.sockaddr.sin_addr.s_addr);
+    totals.sent = snapshot.sent;
+    totals.received = snapshot.received;
+    totals.lost = snapshot.lost;
+    totals.errors = snapshot.errors;
+    totals.rtt_total_us = static_cast<uint64_t>(std::llround(snapshot.rtt_total_ms * 1000.0));
+    for (size_t bucket = 0; bucket < push_histogram_buckets; ++bucket)
+    {
+        totals.histogram[bucket] = snapshot.histogram[bucket];
+    }
+    return totals;
+}
+
+// what changed since 'pushed'. a target whose counters went back was replaced, its totals are all new.
+static push_record delta_of(const push_record & totals, const push_record & pushed)
+{
+    bool replaced = totals.sent < pushed.sent || totals.received < pushed.received || totals.lost < pushed.lost || totals.errors < pushed.errors ||
+                    totals.rtt_total_us < pushed.rtt_total_us;
+    for (size_t bucket = 0; bucket < push_histogram_buckets; ++bucket)
+    {
+        replaced = replaced || totals.histogram[bucket] < pushed.histogram[bucket];
+    }
+    if (replaced)
+    {
+        return totals;
+    }
+    push_record delta;
+    delta.address = totals.address;
+    delta.sent = totals.sent - pushed.sent;
+    delta.received = totals.received - pushed.received;
+    delta.lost = totals.lost - pushed.lost;
+    delta.errors = totals.errors - pushed.errors;
+    delta.rtt_total_us = totals.rtt_total_us - pushed.rtt_total_us;
+    for (size_t bucket = 0; bucket < push_histogram_buckets; ++bucket)
+    {
+        delta.histogram[bucket] = totals.histogram[bucket] - pushed.histogram[bucket];
+    }
+    return delta;
+}
+
+static bool unchanged(const push_record & delta)
+{
+    return delta.sent == 0 && delta.received == 0 && delta.lost == 0 && delta.errors == 0 && delta.rtt_total_us == 0 &&
+           std::all_of(delta.histogram.begin(), delta.histogram.end(), [](uint64_t count) { return count == 0; });
+}
+
+stats_pusher::stats_pusher(const std::string & destination) :
+    m_destination(destination),
+    m_address(parse_push_address(destination))
+{
+    const auto & address = m_address;
+    m_fd = ::socket(address.address.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+    {
+        throw std::runtime_error(fmt::format("could not create push socket: {}", std::strerror(errno)));
+    }
+    // a push of a million targets is thousands of datagrams, more than the queue of a unix socket holds (max_dgram_qlen).
+    // a blocking send waits for the collector to catch up, but not for a collector that hangs: the control thread runs the push.
+    timeval timeout{0, 200000};
+    ::setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // connecting a datagram socket only sets its destination, the collector does not have to run yet
+    if (address.address.ss_family != AF_UNIX && ::connect(m_fd, reinterpret_cast<const sockaddr *>(&address.address), address.length) != 0)
+    {
+        auto error = errno;
+        ::close(m_fd);
+        throw std::runtime_error(fmt::format("could not connect to collector '{}': {}", destination, std::strerror(error)));
+    }
+    char host[256] = {};
+    ::gethostname(host, sizeof(host) - 1);
+    m_host = fmt::format("{}:{}", host, ::getpid());
+}
+
+stats_pusher::~stats_pusher()
+{
+    ::close(m_fd);
+}
+
+void stats_pusher::seed(const std::vector<std::unique_ptr<probe_engine>> & engines)
+{
+    m_sources.resize(engines.size());
+    for (size_t i = 0; i < engines.size(); ++i)
+    {
+        for (const auto & target : engines[i]->targets()->targets)
+        {
+            m_sources[i].pushed[target->address] = totals_of(*target);
+        }
+    }
+}
+
+size_t stats_pusher::push(const std::vector<std::unique_ptr<probe_engine>> & engines)
+{
+    // a unix datagram socket is addressed per send, so a collector that is restarted with a new socket is found again.
+    // the path is looked up by the kernel on every send, only a udp address is resolved once, in the constructor.
+    const auto & address = m_address;
+    auto now = std::chrono::system_clock::now();
+    push_header header;
+    header.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+    header.interval_ms = m_last_push.time_since_epoch().count() == 0 ? 0 : std::chrono::duration_cast<std::chrono::milliseconds>(now - m_last_push).count();
+    m_last_push = now;
+    m_sources.resize(engines.size());
+
+    size_t bytes = 0;
+    std::string failure;
+    std::string datagram;
+    for (size_t i = 0; i < engines.size(); ++i)
+    {
+        auto & source = m_sources[i];
+        auto targets = engines[i]->targets();
+        header.source = engines[i]->name().empty() ? m_host : m_host + "/" + engines[i]->name();
+
+        struct change
+        {
+            push_record delta;
+            push_record totals;
+            const std::string * address;
+        };
+        std::vector<change> changes;
+        std::vector<push_record> deltas;
+        for (const auto & target : targets->targets)
+        {
+            auto totals = totals_of(*target);
+            auto pushed = source.pushed.find(target->address);
+            auto delta = pushed == source.pushed.end() ? totals : delta_of(totals, pushed->second);
+            if (!unchanged(delta))
+            {
+                changes.push_back({delta, totals, &target->address});
+            }
+        }
+        std::sort(changes.begin(), changes.end(), [](const change & a, const change & b) { return a.delta.address < b.delta.address; });
+        deltas.reserve(changes.size());
+        for (const auto & change : changes)
+        {
+            deltas.push_back(change.delta);
+        }
+
+        // an interval without changes is pushed as a datagram without records, so the collector sees the source is alive
+        size_t first = 0;
+        do
+        {
+            datagram.clear();
+            header.sequence = source.sequence;
+            auto next = encode_push(header, deltas, first, max_push_datagram, datagram);
+            auto sent = ::sendto(m_fd, datagram.data(), datagram.size(), 0, address.address.ss_family == AF_UNIX ? reinterpret_cast<const sockaddr *>(&address.address) : nullptr,
+                                 address.address.ss_family == AF_UNIX ? address.length : 0);
+            if (sent != static_cast<ssize_t>(datagram.size()))
+            {
+                // the collector did not drain its queue within the send timeout, the rest of this source goes out with the next push
+                failure = fmt::format("could not push {} to collector '{}': {}", header.source, m_destination, sent < 0 ? std::strerror(errno) : "short send");
+                break;
+            }
+            ++source.sequence;
+            bytes += datagram.size();
+            for (; first < next; ++first)
+            {
+                source.pushed[*changes[first].address] = changes[first].totals;
+            }
+        } while (first < deltas.size());
+        if (first < deltas.size())
+        {
+            continue;
+        }
+
+        for (auto it = source.pushed.begin(); it != source.pushed.end();)
+        {
+            it = targets->find(it->first) ? std::next(it) : source.pushed.erase(it);
+        }
+    }
+    if (!failure.empty())
+    {
+        throw std::runtime_error(failure);
+    }
+    return bytes;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "engine.h"
+#include "push_protocol.h"
+
+namespace icmp_ns {
+
+// pushes what changed in the statistics of the targets since the last push to a collector, see push_protocol.h.
+// it keeps the counters it pushed last per target, and reads the current ones like a snapshot while the probe thread runs.
+class stats_pusher
+{
+public:
+    // 'destination' is the socket path or host:port of the collector, see parse_push_address()
+    explicit stats_pusher(const std::string & destination);
+    ~stats_pusher();
+    stats_pusher(const stats_pusher &) = delete;
+    stats_pusher & operator=(const stats_pusher &) = delete;
+
+    // takes the current totals of every target as pushed, so only what they count from now on is pushed. the daemon calls
+    // this once at start, after the targets were restored from a checkpoint: their totals reached the collector before.
+    void seed(const std::vector<std::unique_ptr<probe_engine>> & engines);
+
+    // pushes the deltas of every engine, one source per engine. a source whose datagram could not be sent within the send
+    // timeout stops there, its remaining deltas are pushed the next time; the other sources are still pushed, then it throws.
+    // returns the number of bytes sent.
+    size_t push(const std::vector<std::unique_ptr<probe_engine>> & engines);
+
+private:
+    struct source_state
+    {
+        uint64_t sequence = 0;
+        std::unordered_map<std::string, push_record> pushed; // the totals pushed so far, by target address
+    };
+
+    std::string m_destination;
+    push_address m_address;
+    int m_fd = -1;
+    std::string m_host; // host:pid, the engines add their name
+    std::vector<source_state> m_sources;
+    std::chrono::system_clock::time_point m_last_push;
+};
+
+} // namespace icmp_ns
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "push_protocol.h"
+
+namespace icmp_ns {
+
+// the bits of the fields of a record
+static const uint64_t field_sent = 1;
+static const uint64_t field_missing = 2;
+static const uint64_t field_lost = 4;
+static const uint64_t field_errors = 8;
+static const uint64_t field_histogram = 16;
+
+static void put_varint(std::string & out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+static uint64_t get_varint(std::string_view & in)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (in.empty())
+        {
+            throw std::runtime_error("push datagram is truncated");
+        }
+        auto byte = static_cast<uint8_t>(in.front());
+        in.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+    throw std::runtime_error("push datagram has a varint longer than 64 bits");
+}
+
+static void encode_record(const push_record & record, uint32_t previous, std::string & out)
+{
+    put_varint(out, zigzag(static_cast<int64_t>(record.address) - previous));
+
+    int64_t missing = static_cast<int64_t>(record.sent) - static_cast<int64_t>(record.received);
+    uint32_t first = 0;
+    uint32_t mask = 0;
+    for (size_t bucket = 0; bucket < push_histogram_buckets; ++bucket)
+    {
+        if (record.histogram[bucket] != 0)
+        {
+            first = mask == 0 ? static_cast<uint32_t>(bucket) : first;
+            mask |= 1u << bucket;
+        }
+    }
+    uint64_t fields = (record.sent != 0 ? field_sent : 0) | (missing != 0 ? field_missing : 0) | (record.lost != 0 ? field_lost : 0) |
+                      (record.errors != 0 ? field_errors : 0) | (mask != 0 || record.rtt_total_us != 0 ? field_histogram : 0);
+    put_varint(out, fields);
+    if (fields & field_sent)
+    {
+        put_varint(out, record.sent);
+    }
+    if (fields & field_missing)
+    {
+        put_varint(out, zigzag(missing));
+    }
+    if (fields & field_lost)
+    {
+        put_varint(out, record.lost);
+    }
+    if (fields & field_errors)
+    {
+        put_varint(out, record.errors);
+    }
+    if (fields & field_histogram)
+    {
+        put_varint(out, record.rtt_total_us);
+        put_varint(out, first);
+        put_varint(out, mask >> first);
+        for (auto bucket = first; bucket < push_histogram_buckets; ++bucket)
+        {
+            if (mask & (1u << bucket))
+            {
+                put_varint(out, record.histogram[bucket]);
+            }
+        }
+    }
+}
+
+size_t encode_push(const push_header & header, const std::vector<push_record> & records, size_t first, size_t max_size, std::string & datagram)
+{
+    auto start = datagram.size();
+    datagram.push_back('P');
+    datagram.push_back('K');
+    datagram.push_back(static_cast<char>(push_version));
+    put_varint(datagram, header.source.size());
+    datagram += header.source;
+    put_varint(datagram, header.sequence);
+    put_varint(datagram, header.time_ms);
+    put_varint(datagram, header.interval_ms);
+
+    uint32_t previous = 0;
+    auto next = first;
+    for (; next < records.size(); ++next)
+    {
+        auto size = datagram.size();
+        encode_record(records[next], previous, datagram);
+        if (datagram.size() - start > max_size && next > first)
+        {
+            datagram.resize(size);
+            break;
+        }
+        previous = records[next].address;
+    }
+    return next;
+}
+
+void decode_push(std::string_view datagram, push_header & header, std::vector<push_record> & records)
+{
+    if (datagram.size() < 3 || datagram[0] != 'P' || datagram[1] != 'K')
+    {
+        throw std::runtime_error("not a push datagram");
+    }
+    if (static_cast<uint8_t>(datagram[2]) != push_version)
+    {
+        throw std::runtime_error("push datagram of another version");
+    }
+    datagram.remove_prefix(3);
+    auto source_size = get_varint(datagram);
+    if (source_size > datagram.size())
+    {
+        throw std::runtime_error("push datagram is truncated");
+    }
+    header.source = datagram.substr(0, source_size);
+    datagram.remove_prefix(source_size);
+    header.sequence = get_varint(datagram);
+    header.time_ms = get_varint(datagram);
+    header.interval_ms = get_varint(datagram);
+
+    records.clear();
+    uint32_t previous = 0;
+    while (!datagram.empty())
+    {
+        push_record record;
+        record.address = static_cast<uint32_t>(previous + unzigzag(get_varint(datagram)));
+        auto fields = get_varint(datagram);
+        record.sent = fields & field_sent ? get_varint(datagram) : 0;
+        auto missing = fields & field_missing ? unzigzag(get_varint(datagram)) : 0;
+        record.received = static_cast<uint64_t>(static_cast<int64_t>(record.sent) - missing);
+        record.lost = fields & field_lost ? get_varint(datagram) : 0;
+        record.errors = fields & field_errors ? get_varint(datagram) : 0;
+        if (fields & field_histogram)
+        {
+            record.rtt_total_us = get_varint(datagram);
+            auto first = get_varint(datagram);
+            auto mask = get_varint(datagram);
+            if (first >= push_histogram_buckets || (mask >> (push_histogram_buckets - first)) != 0)
+            {
+                throw std::runtime_error("push datagram has a histogram bucket out of range");
+            }
+            for (auto bucket = first; mask != 0; ++bucket, mask >>= 1)
+            {
+                if (mask & 1)
+                {
+                    record.histogram[bucket] = get_varint(datagram);
+                }
+            }
+        }
+        previous = record.address;
+        records.push_back(record);
+    }
+}
+
+push_address parse_push_address(const std::string & address)
+{
+    push_address result;
+    if (address.find('/') != std::string::npos)
+    {
+        auto & unix_address = reinterpret_cast<sockaddr_un &>(result.address);
+        if (address.size() >= sizeof(unix_address.sun_path))
+        {
+            throw std::runtime_error(fmt::format("socket path '{}' is too long", address));
+        }
+        unix_address.sun_family = AF_UNIX;
+        std::memcpy(unix_address.sun_path, address.c_str(), address.size());
+        result.length = sizeof(sockaddr_un);
+        return result;
+    }
+
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos)
+    {
+        throw std::runtime_error(fmt::format("'{}' is neither a socket path nor host:port", address));
+    }
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo * found = nullptr;
+    auto host = address.substr(0, colon);
+    if (auto error = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), address.c_str() + colon + 1, &hints, &found); error != 0)
+    {
+        throw std::runtime_error(fmt::format("could not resolve '{}': {}", address, gai_strerror(error)));
+    }
+    std::memcpy(&result.address, found->ai_addr, found->ai_addrlen);
+    result.length = found->ai_addrlen;
+    ::freeaddrinfo(found);
+    return result;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <sys/socket.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// the datagrams that daemons push to a collector: what changed in the statistics of every target since the last push.
+// a datagram is self-contained, so a lost one loses its deltas but nothing else:
+//   'P' 'K' <version>
+//   varint source length, source       who pushes, like host:pid or host:pid/eth0 for an engine bound to an interface
+//   varint sequence                    +1 per datagram of a source, the collector counts the gaps
+//   varint time                        unix time in ms at the end of the interval
+//   varint interval                    in ms
+//   records until the end of the datagram, sorted by address:
+//     varint zigzag address delta      from the address of the record before, 0.0.0.0 for the first
+//     varint fields                    a bit per field that follows, the others are 0
+//     varint sent                      fields & 1
+//     varint zigzag sent - received    fields & 2
+//     varint lost                      fields & 4
+//     varint errors                    fields & 8
+//     varint rtt total in us           fields & 16, followed by the histogram:
+//     varint first bucket, varint mask of the buckets from the first on, varint count per bucket in the mask
+// a target that replies to every probe of an interval within a few histogram buckets takes about 10 bytes.
+
+namespace icmp_ns {
+
+constexpr size_t push_histogram_buckets = 24;
+constexpr size_t max_push_datagram = 1472; // fits an ethernet frame as udp
+constexpr uint8_t push_version = 1;
+
+struct push_header
+{
+    std::string source;
+    uint64_t sequence = 0;
+    uint64_t time_ms = 0;
+    uint64_t interval_ms = 0;
+};
+
+// the deltas of one target
+struct push_record
+{
+    uint32_t address = 0; // ipv4 in host byte order
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t lost = 0;
+    uint64_t errors = 0;
+    uint64_t rtt_total_us = 0;
+    std::array<uint64_t, push_histogram_buckets> histogram{};
+};
+
+// appends a datagram with the records from 'first' on, as many as fit in 'max_size' but at least one, to 'datagram'.
+// the records must be sorted by address. returns the index of the first record that did not fit.
+size_t encode_push(const push_header & header, const std::vector<push_record> & records, size_t first, size_t max_size, std::string & datagram);
+
+// decodes a datagram, throws on a datagram that is not a valid push
+void decode_push(std::string_view datagram, push_header & header, std::vector<push_record> & records);
+
+struct push_address
+{
+    sockaddr_storage address{};
+    socklen_t length = 0;
+};
+
+// the address of a collector: a unix datagram socket for a path, anything with a '/', or else udp to host:port
+[[nodiscard]] push_address parse_push_address(const std::string & address);
+
+} // namespace icmp_ns
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "realtime.h"
+
+namespace icmp_ns {
+
+std::vector<int> parse_cpu_list(const std::string & list)
+{
+    std::vector<int> result;
+    size_t position = 0;
+    while (position < list.size())
+    {
+        auto end = list.find(',', position);
+        if (end == std::string::npos)
+        {
+            end = list.size();
+        }
+        auto range = list.substr(position, end - position);
+        auto dash = range.find('-');
+        try
+        {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                result.push_back(cpu);
+            }
+        }
+        catch (const std::logic_error &)
+        {
+            throw std::runtime_error(fmt::format("invalid cpu list '{}'", list));
+        }
+        position = end + 1;
+    }
+    return result;
+}
+
+void lock_memory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        throw std::runtime_error(fmt::format("could not lock memory: {} (requires root or CAP_IPC_LOCK)", std::strerror(errno)));
+    }
+}
+
+void prefault(void * data, size_t size)
+{
+    auto * bytes = static_cast<volatile char *>(data);
+    const auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    for (size_t i = 0; i < size; i += page_size)
+    {
+        bytes[i] = bytes[i];
+    }
+}
+
+// the stack of a new thread is mapped lazily, so grow it once before the first probe is timed.
+static void prefault_stack()
+{
+    const size_t stack_reserve = 64 * 1024;
+    char stack[stack_reserve];
+    std::memset(stack, 0, sizeof(stack));
+    prefault(stack, sizeof(stack));
+}
+
+static void configure_probe_thread(const realtime_options & options)
+{
+    if (!options.cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : options.cpus)
+        {
+            CPU_SET(cpu, &set);
+        }
+        if (auto error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); error != 0)
+        {
+            throw std::runtime_error(fmt::format("could not pin probe thread to the requested cpus: {}", std::strerror(error)));
+        }
+    }
+
+    if (options.enabled)
+    {
+        sched_param parameters{};
+        parameters.sched_priority = options.priority;
+        if (auto error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters); error != 0)
+        {
+            throw std::runtime_error(fmt::format("could not set SCHED_FIFO priority {}: {} (requires root or CAP_SYS_NICE)", options.priority, std::strerror(error)));
+        }
+        prefault_stack();
+    }
+}
+
+void run_probe_thread(const realtime_options & options, const std::function<void()> & probe)
+{
+    std::exception_ptr failure;
+    std::thread thread([&] {
+        try
+        {
+            configure_probe_thread(options);
+            probe();
+        }
+        catch (...)
+        {
+            failure = std::current_exception();
+        }
+    });
+    thread.join();
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+}
+
+} // namespace icmp_ns
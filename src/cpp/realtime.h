@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace icmp_ns {
+
+struct realtime_options
+{
+    bool enabled = false;
+    int priority = 50;     // SCHED_FIFO priority, 1 (lowest) to 99 (highest)
+    std::vector<int> cpus; // empty means the probe thread may run on any cpu
+};
+
+// parses a cpu list like "2", "2,3" or "2-5,7" (the same notation as taskset and isolcpus)
+std::vector<int> parse_cpu_list(const std::string & list);
+
+// locks all current and future pages of the process in memory, so no page fault can occur while timing a probe.
+void lock_memory();
+
+// touches every page of a buffer, so the page faults happen now instead of during the first probe.
+void prefault(void * data, size_t size);
+
+// runs 'probe' on a new thread that is configured according to 'options' and waits for it to finish.
+void run_probe_thread(const realtime_options & options, const std::function<void()> & probe);
+
+} // namespace icmp_ns
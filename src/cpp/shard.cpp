@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "shard.h"
+
+namespace icmp_ns {
+
+// an agent that missed this many heartbeats is taken to be dead, even when its process still exists
+static const int64_t missed_heartbeats = 3;
+
+static_assert(std::atomic<int32_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "the control block is shared between processes, its atomics must not use a lock of one process");
+
+static int64_t steady_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool process_exists(pid_t pid)
+{
+    return ::kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+shard_agent::shard_agent(const std::string & name, uint32_t shards, std::chrono::milliseconds heartbeat_interval) :
+    m_name(name),
+    m_shards(shards),
+    m_heartbeat_interval(heartbeat_interval),
+    m_owned(shards, false)
+{
+    if (shards == 0 || shards > max_shards)
+    {
+        throw std::runtime_error(fmt::format("the number of shards must be 1 to {}", max_shards));
+    }
+    auto fd = ::shm_open(("/" + name).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        throw std::runtime_error(fmt::format("could not open shard block '{}': {}", name, std::strerror(errno)));
+    }
+    // every agent grows the block to its size, the part that was added is zero filled
+    struct stat status{};
+    if (::fstat(fd, &status) != 0 || (static_cast<size_t>(status.st_size) < sizeof(control_block) && ::ftruncate(fd, sizeof(control_block)) != 0))
+    {
+        auto error = errno;
+        ::close(fd);
+        throw std::runtime_error(fmt::format("could not resize shard block '{}': {}", name, std::strerror(error)));
+    }
+    auto * data = ::mmap(nullptr, sizeof(control_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        throw std::runtime_error(fmt::format("could not map shard block '{}': {}", name, std::strerror(errno)));
+    }
+    m_block = static_cast<control_block *>(data);
+
+    uint32_t expected = 0;
+    if (!m_block->shards.compare_exchange_strong(expected, shards) && expected != shards)
+    {
+        ::munmap(m_block, sizeof(control_block));
+        throw std::runtime_error(fmt::format("shard block '{}' has {} shards, not {}", name, expected, shards));
+    }
+
+    // a free slot, or else the slot of an agent whose process is gone
+    auto pid = ::getpid();
+    bool joined = false;
+    for (int pass = 0; pass < 2 && !joined; ++pass)
+    {
+        for (uint32_t slot = 0; slot < max_agents && !joined; ++slot)
+        {
+            auto & agent = m_block->agents[slot];
+            auto current = agent.pid.load();
+            if ((pass == 0 && current == 0) || (pass == 1 && current != 0 && !process_exists(current)))
+            {
+                joined = agent.pid.compare_exchange_strong(current, pid);
+                m_slot = slot;
+            }
+        }
+    }
+    if (!joined)
+    {
+        ::munmap(m_block, sizeof(control_block));
+        throw std::runtime_error(fmt::format("shard block '{}' has no free slot for another agent, the most is {}", name, max_agents));
+    }
+    m_block->agents[m_slot].heartbeat.store(steady_now());
+}
+
+shard_agent::~shard_agent()
+{
+    // the other agents take the shards at their next heartbeat instead of after the timeout
+    auto owner = m_slot + 1;
+    for (uint32_t shard = 0; shard < m_shards; ++shard)
+    {
+        auto current = owner;
+        m_block->owners[shard].compare_exchange_strong(current, 0);
+    }
+    m_block->agents[m_slot].targets.store(0);
+    m_block->agents[m_slot].pid.store(0);
+    ::munmap(m_block, sizeof(control_block));
+}
+
+// fnv-1a, the agents have to agree on it, so it is not std::hash
+uint32_t shard_agent::shard_of(std::string_view address) const
+{
+    uint32_t hash = 2166136261u;
+    for (auto c : address)
+    {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return hash % m_shards;
+}
+
+uint32_t shard_agent::owned() const
+{
+    uint32_t count = 0;
+    for (auto owned : m_owned)
+    {
+        count += owned ? 1 : 0;
+    }
+    return count;
+}
+
+bool shard_agent::alive(uint32_t slot, int64_t now) const
+{
+    const auto & agent = m_block->agents[slot];
+    auto pid = agent.pid.load();
+    if (pid == 0)
+    {
+        return false;
+    }
+    auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(m_heartbeat_interval).count() * missed_heartbeats;
+    return now - agent.heartbeat.load() <= timeout && process_exists(pid);
+}
+
+bool shard_agent::heartbeat(uint64_t targets)
+{
+    auto now = steady_now();
+    auto & self = m_block->agents[m_slot];
+    self.heartbeat.store(now);
+    self.targets.store(targets);
+
+    // the slot of an agent whose process is gone is freed, its shards are free as well, see alive()
+    uint32_t live = 0;
+    for (uint32_t slot = 0; slot < max_agents; ++slot)
+    {
+        auto pid = m_block->agents[slot].pid.load();
+        if (pid != 0 && !process_exists(pid))
+        {
+            m_block->agents[slot].pid.compare_exchange_strong(pid, 0);
+        }
+        live += slot == m_slot || alive(slot, now) ? 1 : 0;
+    }
+    auto fair = (m_shards + live - 1) / live;
+
+    auto owner = m_slot + 1;
+    std::vector<uint32_t> mine;
+    for (uint32_t shard = 0; shard < m_shards; ++shard)
+    {
+        if (m_block->owners[shard].load() == owner)
+        {
+            mine.push_back(shard);
+        }
+    }
+    // the shards above the fair share are given away, the agents below it take them at their next heartbeat
+    while (mine.size() > fair)
+    {
+        auto current = owner;
+        m_block->owners[mine.back()].compare_exchange_strong(current, 0);
+        mine.pop_back();
+    }
+    for (uint32_t shard = 0; shard < m_shards && mine.size() < fair; ++shard)
+    {
+        auto current = m_block->owners[shard].load();
+        if (current != owner && (current == 0 || !alive(current - 1, now)) && m_block->owners[shard].compare_exchange_strong(current, owner))
+        {
+            mine.push_back(shard);
+        }
+    }
+
+    std::vector<bool> owned(m_shards, false);
+    for (auto shard : mine)
+    {
+        owned[shard] = true;
+    }
+    if (owned == m_owned)
+    {
+        return false;
+    }
+    m_owned = std::move(owned);
+    return true;
+}
+
+std::vector<shard_agent_status> shard_agent::status() const
+{
+    auto now = steady_now();
+    std::vector<shard_agent_status> result;
+    for (uint32_t slot = 0; slot < max_agents; ++slot)
+    {
+        const auto & agent = m_block->agents[slot];
+        auto pid = agent.pid.load();
+        if (pid == 0)
+        {
+            continue;
+        }
+        shard_agent_status status;
+        status.slot = slot;
+        status.pid = pid;
+        status.alive = slot == m_slot || alive(slot, now);
+        status.targets = agent.targets.load();
+        status.heartbeat_age = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::nanoseconds(now - agent.heartbeat.load()));
+        for (uint32_t shard = 0; shard < m_shards; ++shard)
+        {
+            status.shards += m_block->owners[shard].load() == slot + 1 ? 1 : 0;
+        }
+        result.push_back(status);
+    }
+    return result;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace icmp_ns {
+
+// one agent of a shard block as seen by the others
+struct shard_agent_status
+{
+    uint32_t slot = 0;
+    pid_t pid = 0;
+    bool alive = false;
+    uint32_t shards = 0; // owned
+    uint64_t targets = 0;
+    std::chrono::milliseconds heartbeat_age{};
+};
+
+// the daemons on one host that split one target list. every daemon is an agent with a slot in a control block in shared
+// memory, where it writes a heartbeat, and the targets are hashed into a fixed number of shards, each owned by one agent.
+// there is no coordinator: with every heartbeat an agent gives away the shards above its fair share, ceil(shards / live
+// agents), and takes free shards and the shards of dead agents up to it. an agent is dead when its process is gone, at
+// once, or when it missed three heartbeats. so a new agent gets its share within a heartbeat or two and the shards of an
+// agent that died are taken over by the others. a block of zeros is an empty block, so the agents that start at the same
+// time need no lock to create it.
+class shard_agent
+{
+public:
+    static constexpr size_t max_agents = 64;
+    static constexpr size_t max_shards = 4096;
+
+    // joins the shard block 'name' in /dev/shm, creating it if it does not exist
+    shard_agent(const std::string & name, uint32_t shards, std::chrono::milliseconds heartbeat_interval);
+    // gives the shards to the other agents and leaves the block
+    ~shard_agent();
+    shard_agent(const shard_agent &) = delete;
+    shard_agent & operator=(const shard_agent &) = delete;
+
+    [[nodiscard]] uint32_t shard_of(std::string_view address) const;
+
+    // whether this agent owned the shard at the last heartbeat
+    [[nodiscard]] bool owns(uint32_t shard) const { return m_owned[shard]; }
+    [[nodiscard]] uint32_t owned() const;
+    [[nodiscard]] uint32_t shards() const { return m_shards; }
+    [[nodiscard]] uint32_t slot() const { return m_slot; }
+    [[nodiscard]] std::chrono::milliseconds heartbeat_interval() const { return m_heartbeat_interval; }
+
+    // writes the heartbeat and balances the shards, returns true when the shards this agent owns changed
+    bool heartbeat(uint64_t targets);
+
+    [[nodiscard]] std::vector<shard_agent_status> status() const;
+
+private:
+    struct agent_slot
+    {
+        std::atomic<int32_t> pid;        // 0 for a free slot
+        std::atomic<int64_t> heartbeat;  // steady clock in ns, it is the same clock in every process
+        std::atomic<uint64_t> targets;
+    };
+
+    struct control_block
+    {
+        std::atomic<uint32_t> shards; // fixed by the first agent
+        uint32_t reserved;
+        agent_slot agents[max_agents];
+        std::atomic<uint32_t> owners[max_shards]; // the slot + 1 of the owner, 0 for none
+    };
+
+    [[nodiscard]] bool alive(uint32_t slot, int64_t now) const;
+
+    std::string m_name;
+    uint32_t m_shards;
+    std::chrono::milliseconds m_heartbeat_interval;
+    control_block * m_block = nullptr;
+    uint32_t m_slot = 0;
+    std::vector<bool> m_owned;
+};
+
+} // namespace icmp_ns
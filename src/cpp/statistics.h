@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+namespace icmp_ns {
+
+// running round-trip-time statistics, every sample is added in O(1) without storing it.
+// the variance is computed using Welford's method, which stays accurate for long runs.
+class rtt_statistics
+{
+public:
+    void add(double milliseconds)
+    {
+        ++m_count;
+        m_min = std::min(m_min, milliseconds);
+        m_max = std::max(m_max, milliseconds);
+        auto delta = milliseconds - m_mean;
+        m_mean += delta / m_count;
+        m_m2 += delta * (milliseconds - m_mean);
+    }
+
+    [[nodiscard]] size_t count() const { return m_count; }
+    [[nodiscard]] double min() const { return m_count > 0 ? m_min : 0.0; }
+    [[nodiscard]] double max() const { return m_count > 0 ? m_max : 0.0; }
+    [[nodiscard]] double mean() const { return m_mean; }
+    [[nodiscard]] double variance() const { return m_count > 1 ? m_m2 / (m_count - 1) : 0.0; }
+    [[nodiscard]] double stddev() const { return std::sqrt(variance()); }
+
+private:
+    size_t m_count = 0;
+    double m_min = std::numeric_limits<double>::max();
+    double m_max = std::numeric_limits<double>::lowest();
+    double m_mean = 0.0;
+    double m_m2 = 0.0;
+};
+
+struct linear_fit
+{
+    double slope = 0.0;
+    double intercept = 0.0;
+    double r_squared = 0.0; // 1.0 means all points are on the line
+};
+
+// least squares fit of y = slope * x + intercept, x and y must have the same size
+[[nodiscard]] inline linear_fit fit_line(const std::vector<double> & x, const std::vector<double> & y)
+{
+    linear_fit result;
+    const auto n = static_cast<double>(x.size());
+    if (x.size() < 2)
+    {
+        return result;
+    }
+    double sum_x = 0.0, sum_y = 0.0;
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+        sum_x += x[i];
+        sum_y += y[i];
+    }
+    const double mean_x = sum_x / n;
+    const double mean_y = sum_y / n;
+    double sxx = 0.0, sxy = 0.0, syy = 0.0;
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+        sxx += (x[i] - mean_x) * (x[i] - mean_x);
+        sxy += (x[i] - mean_x) * (y[i] - mean_y);
+        syy += (y[i] - mean_y) * (y[i] - mean_y);
+    }
+    if (sxx == 0.0)
+    {
+        return result;
+    }
+    result.slope = sxy / sxx;
+    result.intercept = mean_y - result.slope * mean_x;
+    result.r_squared = syy > 0.0 ? (sxy * sxy) / (sxx * syy) : 1.0;
+    return result;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <netinet/ip_icmp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fmt/core.h>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "icmp.h"
+#include "probe_table.h"
+#include "statistics.h"
+#include "sweep.h"
+
+namespace icmp_ns {
+
+struct sweep_target
+{
+    std::string address;
+    sockaddr_in sockaddr{};
+    std::vector<double> min_rtt; // per size, the lowest rtt has the least queueing delay in it
+};
+
+static void print_fit(const sweep_target & target, const std::vector<size_t> & sizes)
+{
+    std::vector<double> x;
+    std::vector<double> y;
+    for (size_t index = 0; index < sizes.size(); ++index)
+    {
+        if (target.min_rtt[index] < std::numeric_limits<double>::max())
+        {
+            x.push_back(static_cast<double>(sizes[index]));
+            y.push_back(target.min_rtt[index]);
+        }
+    }
+    if (x.size() < 2)
+    {
+        fmt::print("{}: not enough replies to fit a line.\n", target.address);
+        return;
+    }
+
+    // every extra payload byte is serialized on the way to the target and again in the reply,
+    // for a single store-and-forward link in each direction that costs 2 * 8 bits / capacity.
+    auto fit = fit_line(x, y);
+    auto seconds_per_byte = fit.slope / 1000.0;
+    auto capacity = seconds_per_byte > 0.0 ? fmt::format("{:.1f} Mbit/s", 16.0 / seconds_per_byte / 1e6) : std::string("unknown");
+    fmt::print("{}: base latency {:.3f} ms, {:.3f} ns per byte (one link each way of {}), r^2 {:.3f}, {} sizes\n", target.address, fit.intercept,
+               seconds_per_byte * 1e9, capacity, fit.r_squared, x.size());
+}
+
+void payload_sweep(const std::vector<std::string> & addresses, const sweep_options & options)
+{
+    // the payload of an ipv4 echo request is at most 65535 bytes minus the ip and icmp headers
+    if (options.min_payload < 0 || options.max_payload < options.min_payload || options.max_payload > 65507)
+    {
+        throw std::runtime_error(fmt::format("payload sizes {} to {} are not within 0 to 65507 bytes, the --size must be 28 to 65535", options.min_payload,
+                                             options.max_payload));
+    }
+    if (options.steps < 1)
+    {
+        throw std::runtime_error(fmt::format("invalid number of sweep steps '{}'", options.steps));
+    }
+    std::vector<size_t> sizes;
+    for (int step = 0; step < options.steps; ++step)
+    {
+        sizes.push_back(options.min_payload + (options.max_payload - options.min_payload) * step / std::max(options.steps - 1, 1));
+    }
+
+    std::vector<sweep_target> targets;
+    for (const auto & address : addresses)
+    {
+        targets.push_back({address, resolve_address(address), std::vector<double>(sizes.size(), std::numeric_limits<double>::max())});
+    }
+
+    // the payload is built once at the largest size, every probe only gets its own header
+    icmp_payload_template payload(options.max_payload);
+    icmp_socket socket;
+    socket.accept_replies_and_errors();
+    socket.set_receive_buffer_size(std::max<int>(targets.size() * (options.max_payload + 1024), 256 * 1024));
+    probe_table probes;
+
+    std::vector<size_t> order(sizes.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::mt19937 random(std::random_device{}());
+    std::vector<icmp_header> headers(targets.size());
+    std::vector<batch_packet> batch;
+    for (int round = 0; round < options.rounds; ++round)
+    {
+        std::shuffle(order.begin(), order.end(), random);
+        for (auto size_index : order)
+        {
+            // one probe of this size to every target, the next size is only sent when these are answered
+            batch.clear();
+            auto now = std::chrono::steady_clock::now();
+            for (uint32_t index = 0; index < targets.size(); ++index)
+            {
+                auto & target = targets[index];
+                headers[index] = payload.make_header(probes.add(index, target.sockaddr.sin_addr, 0, now), sizes[size_index]);
+                batch.push_back({&headers[index], sizeof(icmp_header), 0, &target.sockaddr, payload.data(), sizes[size_index]});
+            }
+            auto pending = socket.send_batch(batch);
+            auto deadline = now + options.timeout;
+            while (pending > 0)
+            {
+                auto reply = receive_probe_reply(socket, probes, deadline);
+                if (!reply)
+                {
+                    break;
+                }
+                --pending;
+                if (reply->message.type == ICMP_ECHOREPLY)
+                {
+                    auto & min_rtt = targets[reply->sent_probe.target].min_rtt[size_index];
+                    min_rtt = std::min(min_rtt, reply->rtt.count());
+                }
+            }
+        }
+    }
+
+    for (const auto & target : targets)
+    {
+        print_fit(target, sizes);
+    }
+}
+
+} // namespace icmp_ns
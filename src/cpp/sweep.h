@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace icmp_ns {
+
+struct sweep_options
+{
+    int min_payload = 0;
+    int max_payload = 1472; // a 1500 byte mtu minus the ip and icmp headers
+    int steps = 16;
+    int rounds = 10;
+    std::chrono::milliseconds timeout{2500};
+};
+
+// probes every target with payloads from min_payload to max_payload, in a different random order every round,
+// so a change in load affects all sizes alike. a straight line through the minimum rtt of every size
+// separates the fixed latency (where the line crosses zero payload) from the cost of every extra byte (its slope).
+void payload_sweep(const std::vector<std::string> & addresses, const sweep_options & options);
+
+} // namespace icmp_ns
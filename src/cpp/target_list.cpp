@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <fmt/core.h>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "engine.h"
+#include "target_list.h"
+
+namespace icmp_ns {
+
+static std::string_view next_field(std::string_view & line)
+{
+    auto begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos)
+    {
+        line = {};
+        return {};
+    }
+    auto end = std::min(line.find_first_of(" \t\r", begin), line.size());
+    auto field = line.substr(begin, end - begin);
+    line.remove_prefix(end);
+    return field;
+}
+
+// a group is a path like dc1/row3/rack7, without empty names
+static bool valid_group(std::string_view group)
+{
+    return group.front() != '/' && group.back() != '/' && group.find("//") == std::string_view::npos;
+}
+
+// a million line file is parsed without a stream or a copy per line, so a reload is dominated by the diff itself
+std::vector<target_spec> parse_target_list(const std::string & text, std::chrono::milliseconds default_interval)
+{
+    std::vector<target_spec> result;
+    std::string_view remaining(text);
+    size_t line_number = 0;
+    while (!remaining.empty())
+    {
+        ++line_number;
+        auto end = std::min(remaining.find('\n'), remaining.size());
+        auto line = remaining.substr(0, end);
+        remaining.remove_prefix(std::min(end + 1, remaining.size()));
+        line = line.substr(0, line.find('#'));
+
+        auto original = line;
+        auto address = next_field(line);
+        if (address.empty())
+        {
+            continue;
+        }
+        target_spec spec{std::string(address), default_interval, {}};
+        auto field = next_field(line);
+        if (!field.empty() && field.find_first_not_of("0123456789") == std::string_view::npos)
+        {
+            int64_t milliseconds = 0;
+            auto [last, error] = std::from_chars(field.data(), field.data() + field.size(), milliseconds);
+            if (error != std::errc() || last != field.data() + field.size())
+            {
+                throw std::runtime_error(fmt::format("invalid target on line {}: '{}'", line_number, original));
+            }
+            spec.interval = std::chrono::milliseconds(milliseconds);
+            field = next_field(line);
+        }
+        if (spec.interval < min_target_interval)
+        {
+            throw std::runtime_error(fmt::format("invalid interval on line {}, the shortest is {} ms: '{}'", line_number, min_target_interval.count(), original));
+        }
+        if (!field.empty())
+        {
+            if (!valid_group(field) || !next_field(line).empty())
+            {
+                throw std::runtime_error(fmt::format("invalid target on line {}: '{}'", line_number, original));
+            }
+            spec.group = std::string(field);
+        }
+        result.push_back(std::move(spec));
+    }
+    return result;
+}
+
+std::vector<target_spec> read_target_file(const std::string & path, std::chrono::milliseconds default_interval)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error(fmt::format("could not read target file '{}'", path));
+    }
+    std::ostringstream text;
+    text << file.rdbuf();
+    return parse_target_list(text.str(), default_interval);
+}
+
+reload_result apply_target_list(probe_engine & engine, const std::vector<target_spec> & specs)
+{
+    reload_result result;
+    engine.update([&](const target_set & current) -> std::shared_ptr<const target_set> {
+        result = {};
+        std::vector<std::shared_ptr<engine_target>> targets;
+        targets.reserve(specs.size());
+        // the intervals of the running targets are changed in place, so that waits until every new target has resolved:
+        // a target that does not resolve throws, and leaves the running set as it was
+        std::vector<std::pair<engine_target *, std::chrono::milliseconds>> interval_changes;
+        for (const auto & spec : specs)
+        {
+            auto target = current.find(spec.address);
+            if (!target)
+            {
+                targets.push_back(std::make_shared<engine_target>(spec.address, spec.interval, spec.group));
+                ++result.added;
+                continue;
+            }
+            if (target->group != spec.group)
+            {
+                // the group of a target is fixed, a target that moves starts over in its new group
+                targets.push_back(std::make_shared<engine_target>(spec.address, target->sockaddr, spec.interval, spec.group));
+                ++result.changed;
+                continue;
+            }
+            if (target->interval() != spec.interval)
+            {
+                interval_changes.emplace_back(target.get(), spec.interval);
+                ++result.changed;
+            }
+            else
+            {
+                ++result.unchanged;
+            }
+            targets.push_back(std::move(target));
+        }
+        auto next = make_target_set(std::move(targets));
+        for (const auto & [target, interval] : interval_changes)
+        {
+            target->interval_ms = interval.count();
+        }
+        for (const auto & target : current.targets)
+        {
+            if (!next->position(target->address))
+            {
+                ++result.removed;
+            }
+        }
+        return next;
+    });
+    return result;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "engine.h"
+
+namespace icmp_ns {
+
+// one line of a target file: an address, optionally its interval in milliseconds and optionally its group, a path
+// like dc1/row3/rack7. empty lines and everything after a '#' are ignored.
+struct target_spec
+{
+    std::string address;
+    std::chrono::milliseconds interval{};
+    std::string group;
+};
+
+[[nodiscard]] std::vector<target_spec> parse_target_list(const std::string & text, std::chrono::milliseconds default_interval);
+[[nodiscard]] std::vector<target_spec> read_target_file(const std::string & path, std::chrono::milliseconds default_interval);
+
+struct reload_result
+{
+    size_t added = 0;
+    size_t removed = 0;
+    size_t changed = 0; // present before and after, with a different interval or group
+    size_t unchanged = 0;
+};
+
+// makes the engine probe exactly the targets in 'specs'. the diff is one hash lookup per target: targets that stay keep
+// their statistics and schedule, changed intervals are updated in place, new targets are created and the others retired.
+// a target that moves to another group is replaced by a new one: its history leaves the old group, the new one starts at 0.
+reload_result apply_target_list(probe_engine & engine, const std::vector<target_spec> & specs);
+
+} // namespace icmp_ns
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <netinet/ip_icmp.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fmt/core.h>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "icmp.h"
+#include "icmp_ids.h"
+#include "probe_table.h"
+#include "statistics.h"
+#include "timestamp.h"
+
+namespace icmp_ns {
+
+static const int64_t milliseconds_per_day = 24 * 60 * 60 * 1000;
+static const uint32_t nonstandard_time = 0x80000000;
+
+struct timestamp_target
+{
+    std::string address;
+    sockaddr_in sockaddr{};
+    rtt_statistics rtt; // our round trip minus the time the target held the request
+    double min_forward = std::numeric_limits<double>::max();
+    double min_return = std::numeric_limits<double>::max();
+    uint64_t nonstandard = 0;
+    uint64_t errors = 0;
+    std::string last_error;
+};
+
+// CLOCK_REALTIME in nanoseconds, the clock the target's times are compared with
+static int64_t realtime_now()
+{
+    timespec time;
+    clock_gettime(CLOCK_REALTIME, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+static uint32_t milliseconds_of_day(int64_t realtime_ns)
+{
+    return static_cast<uint32_t>(realtime_ns / 1000000 % milliseconds_per_day);
+}
+
+// 'later' - 'earlier' in milliseconds, where 'later' is a time of day of the target and 'earlier' a local time,
+// taken across midnight the short way round
+static double time_of_day_difference(double later, int64_t earlier_ns)
+{
+    auto difference = later - static_cast<double>(earlier_ns % (milliseconds_per_day * 1000000)) / 1e6;
+    if (difference >= milliseconds_per_day / 2)
+    {
+        difference -= milliseconds_per_day;
+    }
+    else if (difference < -milliseconds_per_day / 2)
+    {
+        difference += milliseconds_per_day;
+    }
+    return difference;
+}
+
+// how long the target held the request: from its receive to its transmit time of day, across midnight if it passed in between
+static double held_time(uint32_t receive, uint32_t transmit)
+{
+    auto difference = (static_cast<int64_t>(transmit) - static_cast<int64_t>(receive)) % milliseconds_per_day;
+    return static_cast<double>(difference < 0 ? difference + milliseconds_per_day : difference);
+}
+
+static void print_estimate(const timestamp_target & target)
+{
+    if (target.rtt.count() == 0)
+    {
+        auto reason = target.nonstandard > 0 ? std::string("replies without standard times") : target.last_error.empty() ? "no replies" : target.last_error;
+        fmt::print("{}: {}.\n", target.address, reason);
+        return;
+    }
+    auto offset = (target.min_forward - target.min_return) / 2.0;
+    auto one_way = (target.min_forward + target.min_return) / 2.0;
+    fmt::print("{}: {} replies, rtt min/avg/max = {:.3f}/{:.3f}/{:.3f} ms, forward {:.3f} ms, return {:.3f} ms, clock offset {:+.3f} ms, "
+               "one-way {:.3f} ms if symmetric\n",
+               target.address, target.rtt.count(), target.rtt.min(), target.rtt.mean(), target.rtt.max(), target.min_forward, target.min_return,
+               offset, one_way);
+}
+
+void timestamp_probe(const std::vector<std::string> & addresses, const timestamp_options & options)
+{
+    std::vector<timestamp_target> targets(addresses.size());
+    for (size_t i = 0; i < addresses.size(); ++i)
+    {
+        targets[i].address = addresses[i];
+        targets[i].sockaddr = resolve_address(addresses[i]);
+    }
+
+    icmp_socket socket;
+    socket.accept_timestamp_replies_and_errors();
+    socket.enable_receive_timestamps();
+    socket.set_receive_buffer_size(std::max<int>(targets.size() * 1024, 256 * 1024));
+    probe_table probes;
+    const auto id = process_icmp_id();
+
+    std::vector<int64_t> sent_at(65536); // CLOCK_REALTIME of every outstanding request, by sequence number
+    std::vector<icmp_timestamp_message> requests(targets.size());
+    std::vector<batch_packet> batch;
+    for (int round = 0; round < options.rounds; ++round)
+    {
+        batch.clear();
+        auto now = std::chrono::steady_clock::now();
+        for (uint32_t index = 0; index < targets.size(); ++index)
+        {
+            auto sequence = probes.add(index, targets[index].sockaddr.sin_addr, 0, now);
+            sent_at[sequence] = realtime_now();
+            requests[index] = make_timestamp_request(id, sequence, milliseconds_of_day(sent_at[sequence]));
+            batch.push_back({&requests[index], sizeof(icmp_timestamp_message), 0, &targets[index].sockaddr});
+        }
+        auto pending = socket.send_batch(batch);
+        auto deadline = now + options.timeout;
+        while (pending > 0)
+        {
+            auto reply = receive_probe_reply(socket, probes, deadline);
+            if (!reply)
+            {
+                break;
+            }
+            --pending;
+            auto & target = targets[reply->sent_probe.target];
+            const auto & message = reply->message;
+            if (message.type != ICMP_TIMESTAMPREPLY || !message.timestamps)
+            {
+                ++target.errors;
+                target.last_error = fmt::format("{} from {}", describe_icmp_message(message.type, message.code), inet_ntoa(message.source));
+                continue;
+            }
+            const auto & times = *message.timestamps;
+            if ((times.receive & nonstandard_time) != 0 || (times.transmit & nonstandard_time) != 0)
+            {
+                ++target.nonstandard;
+                continue;
+            }
+            auto sent = sent_at[message.sequence];
+            auto received = reply->received_timestamp ? reply->received_timestamp->count() : realtime_now();
+            auto held = held_time(times.receive, times.transmit);
+            target.rtt.add(static_cast<double>(received - sent) / 1e6 - held);
+            // the target received the request before the end of the millisecond it reports, and replied after its start.
+            // these bounds are off by a random part of a millisecond, the minimum over many rounds approaches the true delay.
+            target.min_forward = std::min(target.min_forward, time_of_day_difference(times.receive + 1.0, sent));
+            target.min_return = std::min(target.min_return, -time_of_day_difference(times.transmit, received));
+        }
+        if (round + 1 < options.rounds)
+        {
+            std::this_thread::sleep_until(now + options.interval);
+        }
+    }
+
+    for (const auto & target : targets)
+    {
+        print_estimate(target);
+    }
+}
+
+} // namespace icmp_ns
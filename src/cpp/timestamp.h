@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace icmp_ns {
+
+struct timestamp_options
+{
+    int rounds = 10;
+    std::chrono::milliseconds interval{1000};
+    std::chrono::milliseconds timeout{2500};
+};
+
+// sends icmp timestamp requests (type 13) to every target, one batch per round, and estimates the delay of each direction
+// from the times in the replies. the forward time (target receive - our send) contains the target's clock offset and the
+// return time (our receive - target transmit) contains it negated, so their sum is the round trip and half their difference
+// is the offset, if both directions take equally long. the minimum over all rounds filters out the queueing delay.
+// the target reports whole milliseconds, its clock is only read to within a millisecond, but a bound that is off by a random
+// part of a millisecond converges to the true delay under the same minimum.
+void timestamp_probe(const std::vector<std::string> & addresses, const timestamp_options & options);
+
+} // namespace icmp_ns
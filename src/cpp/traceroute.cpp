@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <arpa/inet.h>
+#include <netinet/ip_icmp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fmt/core.h>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "icmp.h"
+#include "network.h"
+#include "probe_table.h"
+#include "statistics.h"
+#include "traceroute.h"
+
+namespace icmp_ns {
+
+struct hop
+{
+    std::optional<in_addr> address;
+    double_milliseconds rtt{};
+    std::string failure; // the description of an icmp error that ended the path at this hop
+};
+
+// the hops seen by one flow, every flow can take a different path through an ECMP network
+struct flow_path
+{
+    std::optional<uint16_t> flow;
+    std::vector<hop> hops;
+    int destination_ttl = 0; // 0 as long as the destination has not replied (or a router reported it unreachable)
+
+    [[nodiscard]] bool complete() const
+    {
+        if (destination_ttl == 0)
+        {
+            return false;
+        }
+        for (int ttl = 1; ttl < destination_ttl; ++ttl)
+        {
+            if (!hops[ttl].address)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    [[nodiscard]] int last_hop() const { return destination_ttl != 0 ? destination_ttl : static_cast<int>(hops.size()) - 1; }
+};
+
+static std::string format_flow(std::optional<uint16_t> flow)
+{
+    return flow ? fmt::format(" (flow {})", *flow) : std::string();
+}
+
+static void print_path(const flow_path & path)
+{
+    for (int ttl = 1; ttl <= path.last_hop(); ++ttl)
+    {
+        const auto & entry = path.hops[ttl];
+        if (!entry.address)
+        {
+            fmt::print("{:2}  *\n", ttl);
+            continue;
+        }
+        std::string hop_address = inet_ntoa(*entry.address);
+        auto name = reverse_dns_lookup(hop_address);
+        fmt::print("{:2}  {}{}  {:.3f} ms{}\n", ttl, hop_address, name.empty() ? "" : fmt::format(" ({})", name), entry.rtt.count(),
+                   entry.failure.empty() ? "" : fmt::format("  !{}", entry.failure));
+    }
+}
+
+// flows that saw the same address at every TTL took the same path
+static std::map<std::vector<in_addr_t>, std::vector<const flow_path *>> group_by_path(const std::vector<flow_path> & paths)
+{
+    std::map<std::vector<in_addr_t>, std::vector<const flow_path *>> result;
+    for (const auto & path : paths)
+    {
+        std::vector<in_addr_t> key;
+        for (int ttl = 1; ttl <= path.last_hop(); ++ttl)
+        {
+            key.push_back(path.hops[ttl].address ? path.hops[ttl].address->s_addr : INADDR_ANY);
+        }
+        result[key].push_back(&path);
+    }
+    return result;
+}
+
+static void print_distinct_paths(const std::string & address, const std::vector<flow_path> & paths)
+{
+    auto groups = group_by_path(paths);
+    fmt::print("traceroute to {}: {} distinct paths seen by {} flows\n", address, groups.size(), paths.size());
+    int number = 0;
+    for (const auto & [key, members] : groups)
+    {
+        std::string flows;
+        for (const auto * member : members)
+        {
+            flows += fmt::format(" {}", *member->flow);
+        }
+        fmt::print("path {}, flows{}:\n", ++number, flows);
+
+        // the rtt of a hop is averaged over all flows that took this path
+        flow_path average = *members.front();
+        for (int ttl = 1; ttl <= average.last_hop(); ++ttl)
+        {
+            double_milliseconds total{};
+            for (const auto * member : members)
+            {
+                total += member->hops[ttl].rtt;
+            }
+            average.hops[ttl].rtt = total / members.size();
+        }
+        print_path(average);
+    }
+}
+
+void traceroute(const std::string & address, const traceroute_options & options)
+{
+    icmp_socket socket(address);
+    socket.accept_replies_and_errors();
+
+    std::vector<flow_path> paths;
+    if (options.flows > 1)
+    {
+        for (int flow = 0; flow < options.flows; ++flow)
+        {
+            paths.push_back({static_cast<uint16_t>(flow), {}});
+        }
+    }
+    else
+    {
+        paths.push_back({options.flow, {}});
+    }
+
+    probe_table probes;
+    std::vector<probe_request> requests;
+    for (uint32_t index = 0; index < paths.size(); ++index)
+    {
+        paths[index].hops.resize(options.max_hops + 1);
+        for (int ttl = 1; ttl <= options.max_hops; ++ttl)
+        {
+            requests.push_back({index, nullptr, ttl, paths[index].flow});
+        }
+    }
+    if (requests.size() > probe_table::capacity)
+    {
+        throw std::runtime_error(fmt::format("{} flows of {} hops are more than the {} probes a batch can have outstanding", paths.size(), options.max_hops,
+                                             probe_table::capacity));
+    }
+    const int receive_buffer_per_probe = 2048;
+    socket.set_receive_buffer_size(std::max<int>(requests.size() * receive_buffer_per_probe, 256 * 1024));
+    auto start_timepoint = std::chrono::steady_clock::now();
+    send_probes(socket, probes, requests);
+
+    // the echo requests that live long enough to reach the destination all get a reply,
+    // the lowest TTL that got one is the number of hops to the destination.
+    auto all_complete = [&] {
+        return std::all_of(paths.begin(), paths.end(), [](const flow_path & path) { return path.complete(); });
+    };
+
+    auto deadline = start_timepoint + options.timeout;
+    while (!all_complete() && probes.outstanding() > 0)
+    {
+        auto reply = receive_probe_reply(socket, probes, deadline);
+        if (!reply)
+        {
+            break;
+        }
+        auto & path = paths[reply->sent_probe.target];
+        auto ttl = reply->sent_probe.ttl;
+        auto & entry = path.hops[ttl];
+        entry.address = reply->message.source;
+        entry.rtt = reply->rtt;
+
+        // an echo reply ends the path at the destination, any error other than time exceeded ends it at the router that sent it.
+        // the probes with a higher TTL get the same answer, they complete right away instead of running into the timeout.
+        if (reply->message.type != ICMP_TIME_EXCEEDED)
+        {
+            if (path.destination_ttl != 0 && ttl >= path.destination_ttl)
+            {
+                continue;
+            }
+            path.destination_ttl = ttl;
+            if (reply->message.type != ICMP_ECHOREPLY)
+            {
+                entry.failure = describe_icmp_message(reply->message.type, reply->message.code);
+            }
+        }
+        fmt::print("{:2}  {}  {:.3f} ms{}{}\n", ttl, inet_ntoa(reply->message.source), entry.rtt.count(), format_flow(path.flow),
+                   entry.failure.empty() ? "" : fmt::format("  !{}", entry.failure));
+    }
+
+    if (paths.size() > 1)
+    {
+        print_distinct_paths(address, paths);
+    }
+    else
+    {
+        fmt::print("traceroute to {}{}:\n", address, format_flow(paths.front().flow));
+        print_path(paths.front());
+    }
+    for (const auto & path : paths)
+    {
+        if (path.destination_ttl == 0)
+        {
+            fmt::print("{} not reached within {} hops{}.\n", address, options.max_hops, format_flow(path.flow));
+        }
+        else if (!path.hops[path.destination_ttl].failure.empty())
+        {
+            fmt::print("{} not reached{}, {}.\n", address, format_flow(path.flow), path.hops[path.destination_ttl].failure);
+        }
+    }
+}
+
+struct hop_statistics
+{
+    std::optional<in_addr> address;      // the router that forwarded or answered the probes, from time exceeded and echo replies
+    std::optional<in_addr> error_source; // the router that last reported an error at this hop, shown when there is no address
+    size_t sent = 0;
+    size_t received = 0;
+    double last = 0.0;
+    rtt_statistics rtt;
+    size_t errors = 0; // icmp errors other than time exceeded, these count as lost
+    size_t path_changes = 0;
+};
+
+struct mtr_target
+{
+    std::string address;
+    std::optional<uint16_t> flow;
+    sockaddr_in sockaddr{};
+    int destination_ttl = 0; // 0 as long as the destination has not replied
+    std::vector<hop_statistics> hops;
+};
+
+static void print_path_change(const mtr_target & target, int ttl, in_addr from, in_addr to)
+{
+    std::string from_address = inet_ntoa(from);
+    fmt::print("path change to {}{} at hop {}: {} -> {}\n", target.address, format_flow(target.flow), ttl, from_address, inet_ntoa(to));
+}
+
+// updates the statistics of one hop with a reply, this is O(1) per reply regardless of the number of targets.
+static void update_hop(mtr_target & target, const probe_reply & reply)
+{
+    auto ttl = reply.sent_probe.ttl;
+    auto & hop = target.hops[ttl];
+    if (reply.message.type != ICMP_ECHOREPLY && reply.message.type != ICMP_TIME_EXCEEDED)
+    {
+        // the error can come from another router than the one that forwards the probes, so it says nothing about the path
+        hop.error_source = reply.message.source;
+        // the path ends at a router that reports the destination as unreachable, so stop probing beyond it
+        ++hop.errors;
+        if (target.destination_ttl == 0 || ttl < target.destination_ttl)
+        {
+            target.destination_ttl = ttl;
+        }
+        return;
+    }
+    if (hop.address && hop.address->s_addr != reply.message.source.s_addr)
+    {
+        ++hop.path_changes;
+        print_path_change(target, ttl, *hop.address, reply.message.source);
+    }
+    hop.address = reply.message.source;
+    ++hop.received;
+    hop.last = reply.rtt.count();
+    hop.rtt.add(hop.last);
+
+    if (reply.message.type == ICMP_ECHOREPLY)
+    {
+        if (target.destination_ttl == 0 || ttl < target.destination_ttl)
+        {
+            target.destination_ttl = ttl;
+        }
+        return;
+    }
+    if (ttl == target.destination_ttl)
+    {
+        // a router answered where the destination used to answer, the path got longer so probe all hops again
+        target.destination_ttl = 0;
+    }
+}
+
+static void print_report(const std::vector<mtr_target> & targets, int round, int max_hops)
+{
+    fmt::print("round {}:\n", round);
+    for (const auto & target : targets)
+    {
+        fmt::print("{}{}\n", target.address, format_flow(target.flow));
+        fmt::print("{:>4}  {:<16} {:>6} {:>6} {:>8} {:>8} {:>8} {:>8} {:>8} {:>6} {:>7}\n", "hop", "address", "loss%", "sent", "last", "avg", "best", "worst", "stddev",
+                   "errors", "changes");
+        auto last_hop = target.destination_ttl != 0 ? target.destination_ttl : max_hops;
+        for (int ttl = 1; ttl <= last_hop; ++ttl)
+        {
+            const auto & hop = target.hops[ttl];
+            auto loss = hop.sent > 0 ? 100.0 * (hop.sent - hop.received) / hop.sent : 0.0;
+            auto shown = hop.address ? hop.address : hop.error_source;
+            std::string hop_address = shown ? inet_ntoa(*shown) : "*";
+            fmt::print("{:>4}  {:<16} {:>5.1f}% {:>6} {:>8.3f} {:>8.3f} {:>8.3f} {:>8.3f} {:>8.3f} {:>6} {:>7}\n", ttl, hop_address, loss, hop.sent,
+                       hop.last, hop.rtt.mean(), hop.rtt.min(), hop.rtt.max(), hop.rtt.stddev(), hop.errors, hop.path_changes);
+        }
+    }
+}
+
+void mtr(const std::vector<std::string> & addresses, const mtr_options & options)
+{
+    // with multiple flows every flow to a target is tracked as a separate target, as it can take a different path
+    std::vector<std::optional<uint16_t>> flows;
+    if (options.flows > 1)
+    {
+        for (int flow = 0; flow < options.flows; ++flow)
+        {
+            flows.push_back(static_cast<uint16_t>(flow));
+        }
+    }
+    else
+    {
+        flows.push_back(options.flow);
+    }
+
+    std::vector<mtr_target> targets;
+    for (const auto & address : addresses)
+    {
+        auto sockaddr = resolve_address(address);
+        for (auto flow : flows)
+        {
+            mtr_target target;
+            target.address = address;
+            target.flow = flow;
+            target.sockaddr = sockaddr;
+            target.hops.resize(options.max_hops + 1);
+            targets.push_back(std::move(target));
+        }
+    }
+
+    if (targets.size() * options.max_hops > probe_table::capacity)
+    {
+        throw std::runtime_error(fmt::format("{} targets and flows of {} hops are more than the {} probes a round can have outstanding", targets.size(),
+                                             options.max_hops, probe_table::capacity));
+    }
+
+    // all replies to a round arrive within a few milliseconds, the socket must be able to queue them all
+    const int receive_buffer_per_probe = 2048;
+    icmp_socket socket;
+    socket.accept_replies_and_errors();
+    socket.set_receive_buffer_size(std::max<int>(targets.size() * options.max_hops * receive_buffer_per_probe, 256 * 1024));
+    probe_table probes;
+    std::vector<probe_request> requests;
+    for (int round = 1; options.rounds == 0 || round <= options.rounds; ++round)
+    {
+        // once the destination is known only the hops up to the destination are probed
+        requests.clear();
+        for (uint32_t index = 0; index < targets.size(); ++index)
+        {
+            auto & target = targets[index];
+            auto last_hop = target.destination_ttl != 0 ? target.destination_ttl : options.max_hops;
+            for (int ttl = 1; ttl <= last_hop; ++ttl)
+            {
+                requests.push_back({index, &target.sockaddr, ttl, target.flow});
+                ++target.hops[ttl].sent;
+            }
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + options.interval;
+        send_probes(socket, probes, requests);
+        while (auto reply = receive_probe_reply(socket, probes, deadline))
+        {
+            update_hop(targets[reply->sent_probe.target], *reply);
+        }
+        print_report(targets, round, options.max_hops);
+        std::this_thread::sleep_until(deadline);
+    }
+}
+
+} // namespace icmp_ns
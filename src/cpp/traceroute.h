@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace icmp_ns {
+
+struct traceroute_options
+{
+    int max_hops = 30;
+    std::chrono::milliseconds timeout{2500};
+    std::optional<uint16_t> flow; // keep all probes on one ECMP path, see set_flow_checksum()
+    int flows = 1;                // more than one traces flows 0 to flows-1 in parallel to discover every ECMP path
+};
+
+// sends echo requests for every TTL from 1 to max_hops in one batch and prints each hop as soon as its reply arrives.
+// the whole path is known after roughly one round-trip time instead of one round-trip time per hop.
+void traceroute(const std::string & address, const traceroute_options & options);
+
+struct mtr_options
+{
+    int max_hops = 30;
+    std::chrono::milliseconds interval{1000};
+    int rounds = 0; // 0 means probe until the process is stopped
+    std::optional<uint16_t> flow;
+    int flows = 1; // more than one measures flows 0 to flows-1 to every target separately
+};
+
+// probes every hop to every target once per interval, re-using the batched send and reply matching of traceroute.
+// keeps loss and rtt statistics per hop per target, and reports a path change when a different address answers at the same TTL.
+void mtr(const std::vector<std::string> & addresses, const mtr_options & options);
+
+} // namespace icmp_ns
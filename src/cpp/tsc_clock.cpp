@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <thread>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "tsc_clock.h"
+
+namespace icmp_ns {
+
+std::atomic<bool> tsc_clock::s_enabled{false};
+std::atomic<uint32_t> tsc_clock::s_sequence{0};
+std::atomic<uint64_t> tsc_clock::s_ticks{0};
+std::atomic<int64_t> tsc_clock::s_nanoseconds{0};
+std::atomic<int64_t> tsc_clock::s_multiplier{0};
+int64_t tsc_clock::s_recalibrate_ticks = std::numeric_limits<int64_t>::max();
+
+// a recalibration that finds the clock further off than this does not trust the counter anymore
+static const int64_t max_offset_ns = 1000000;
+
+namespace {
+
+struct clock_sample
+{
+    uint64_t ticks;
+    int64_t nanoseconds;
+};
+
+// the first sample, every recalibration measures the rate over the whole time since then
+clock_sample anchor{};
+std::atomic_flag recalibrating = ATOMIC_FLAG_INIT;
+
+#if defined(__x86_64__)
+// reads the counter right before and after CLOCK_MONOTONIC and keeps the pair of the narrowest of a few tries,
+// so an interrupt between the reads does not end up in the calibration
+clock_sample take_sample()
+{
+    clock_sample best{};
+    uint64_t best_width = std::numeric_limits<uint64_t>::max();
+    for (int attempt = 0; attempt < 5; ++attempt)
+    {
+        uint64_t before = __rdtsc();
+        int64_t nanoseconds = monotonic_now();
+        uint64_t after = __rdtsc();
+        if (after - before < best_width)
+        {
+            best_width = after - before;
+            best = {before + (after - before) / 2, nanoseconds};
+        }
+    }
+    return best;
+}
+
+// nanoseconds per tick, shifted left by 32 bits
+int64_t measure_rate(const clock_sample & from, const clock_sample & to)
+{
+    return static_cast<int64_t>((static_cast<tsc_int128>(to.nanoseconds - from.nanoseconds) << 32) / static_cast<tsc_int128>(to.ticks - from.ticks));
+}
+#endif
+
+} // namespace
+
+bool tsc_clock::usable()
+{
+#if defined(__x86_64__)
+    // cpuid leaf 0x80000007, edx bit 8: invariant tsc
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) == 0 || (edx & (1u << 8)) == 0)
+    {
+        return false;
+    }
+    std::ifstream file("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+    std::string source;
+    return static_cast<bool>(file >> source) && source == "tsc";
+#else
+    return false;
+#endif
+}
+
+bool tsc_clock::initialize()
+{
+#if defined(__x86_64__)
+    if (enabled())
+    {
+        return true;
+    }
+    if (!usable())
+    {
+        return false;
+    }
+    auto first = take_sample();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto second = take_sample();
+
+    anchor = first;
+    auto multiplier = measure_rate(first, second);
+    s_recalibrate_ticks = static_cast<int64_t>((static_cast<tsc_int128>(1000000000) << 32) / multiplier);
+    store_calibration({second.ticks, second.nanoseconds, multiplier});
+    s_enabled.store(true, std::memory_order_release);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void tsc_clock::store_calibration(const calibration & next)
+{
+    auto sequence = s_sequence.load(std::memory_order_relaxed);
+    s_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s_ticks.store(next.ticks, std::memory_order_relaxed);
+    s_nanoseconds.store(next.nanoseconds, std::memory_order_relaxed);
+    s_multiplier.store(next.multiplier, std::memory_order_relaxed);
+    s_sequence.store(sequence + 2, std::memory_order_release);
+}
+
+void tsc_clock::recalibrate()
+{
+#if defined(__x86_64__)
+    if (recalibrating.test_and_set(std::memory_order_acquire))
+    {
+        return; // another thread is at it
+    }
+    auto sample = take_sample();
+    auto current = load_calibration();
+    if (static_cast<int64_t>(sample.ticks - current.ticks) > s_recalibrate_ticks)
+    {
+        auto converted = to_nanoseconds(current, sample.ticks);
+        auto offset = sample.nanoseconds - converted;
+        if (offset > max_offset_ns || offset < -max_offset_ns)
+        {
+            s_enabled.store(false, std::memory_order_release);
+        }
+        else
+        {
+            // continue from the current reading, with the rate measured since the anchor and a correction that
+            // makes up for the offset over the next second
+            auto steer = static_cast<int64_t>((static_cast<tsc_int128>(offset) << 32) / s_recalibrate_ticks);
+            store_calibration({sample.ticks, converted, measure_rate(anchor, sample) + steer});
+        }
+    }
+    recalibrating.clear(std::memory_order_release);
+#endif
+}
+
+} // namespace icmp_ns
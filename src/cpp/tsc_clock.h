@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+
+// the counter is only used on x86-64: the fixed-point conversion needs 128-bit intermediates, which 32-bit x86 does not have
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+namespace icmp_ns {
+
+#if defined(__x86_64__)
+// a gcc and clang extension, __extension__ keeps -Wpedantic quiet about it
+__extension__ typedef __int128 tsc_int128;
+#endif
+
+// nanoseconds of CLOCK_MONOTONIC, the clock behind std::chrono::steady_clock, read through the vdso
+[[nodiscard]] inline int64_t monotonic_now()
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+// a clock on the CLOCK_MONOTONIC time line that reads the cpu's time stamp counter (rdtsc) instead of calling into the vdso.
+// the counter is converted with a fixed-point multiplier that is calibrated against CLOCK_MONOTONIC when initialize() is called,
+// and again every second by whichever thread reads the clock first after that second has passed. a recalibration keeps the
+// clock continuous: it steers the rate so that the remaining offset to CLOCK_MONOTONIC is gone by the next recalibration.
+// without an invariant counter, or before initialize(), now() falls back to monotonic_now().
+class tsc_clock
+{
+public:
+    // true if the counter runs at a constant rate in every power state (cpuid) and the kernel itself uses it as clocksource,
+    // which it does not after it found the counter unstable, for example when it is not synchronized between cpus.
+    [[nodiscard]] static bool usable();
+
+    // calibrates the clock over about 10 ms, returns false if the counter is not usable and the clock falls back.
+    static bool initialize();
+
+    [[nodiscard]] static bool enabled() { return s_enabled.load(std::memory_order_acquire); }
+
+    [[nodiscard]] static int64_t now()
+    {
+#if defined(__x86_64__)
+        if (enabled())
+        {
+            uint64_t ticks = __rdtsc();
+            calibration current = load_calibration();
+            if (static_cast<int64_t>(ticks - current.ticks) > s_recalibrate_ticks)
+            {
+                recalibrate();
+            }
+            return to_nanoseconds(current, ticks);
+        }
+#endif
+        return monotonic_now();
+    }
+
+private:
+    struct calibration
+    {
+        uint64_t ticks;      // the counter at the start of this calibration
+        int64_t nanoseconds; // the time at the start of this calibration
+        int64_t multiplier;  // nanoseconds per tick, shifted left by 32 bits
+    };
+
+#if defined(__x86_64__)
+    // the difference is signed: another thread may have started a calibration a few ticks after this thread read the counter
+    [[nodiscard]] static int64_t to_nanoseconds(const calibration & current, uint64_t ticks)
+    {
+        auto elapsed = static_cast<tsc_int128>(static_cast<int64_t>(ticks - current.ticks)) * current.multiplier;
+        return current.nanoseconds + static_cast<int64_t>(elapsed >> 32);
+    }
+#endif
+
+    // the calibration is written rarely and read on every call, a sequence lock lets the readers go without a lock or
+    // a write of their own. an odd sequence number means a write is in progress.
+    [[nodiscard]] static calibration load_calibration()
+    {
+        calibration result;
+        uint32_t sequence;
+        do
+        {
+            sequence = s_sequence.load(std::memory_order_acquire);
+            result.ticks = s_ticks.load(std::memory_order_relaxed);
+            result.nanoseconds = s_nanoseconds.load(std::memory_order_relaxed);
+            result.multiplier = s_multiplier.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((sequence & 1) != 0 || sequence != s_sequence.load(std::memory_order_relaxed));
+        return result;
+    }
+
+    static void store_calibration(const calibration & next);
+    static void recalibrate();
+
+    static std::atomic<bool> s_enabled;
+    static std::atomic<uint32_t> s_sequence;
+    static std::atomic<uint64_t> s_ticks;
+    static std::atomic<int64_t> s_nanoseconds;
+    static std::atomic<int64_t> s_multiplier;
+    static int64_t s_recalibrate_ticks; // one second, set before s_enabled
+};
+
+} // namespace icmp_ns
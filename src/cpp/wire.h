@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// the layouts of the headers as they are on the wire. every multi-byte field is an array of bytes in network order,
+// so a struct has no padding, no alignment requirement and the same layout on every host, and the byte order is
+// handled by the load and store helpers below instead of by remembering htons() and ntohs() at every use.
+// everything here is constexpr: the static_asserts at the end check the encoding at compile time, for any host byte order.
+
+namespace icmp_ns {
+
+[[nodiscard]] constexpr uint16_t load_be16(const uint8_t * bytes)
+{
+    return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
+}
+
+[[nodiscard]] constexpr uint32_t load_be32(const uint8_t * bytes)
+{
+    return (static_cast<uint32_t>(bytes[0]) << 24) | (static_cast<uint32_t>(bytes[1]) << 16) | (static_cast<uint32_t>(bytes[2]) << 8) | bytes[3];
+}
+
+constexpr void store_be16(uint8_t * bytes, uint16_t value)
+{
+    bytes[0] = static_cast<uint8_t>(value >> 8);
+    bytes[1] = static_cast<uint8_t>(value);
+}
+
+constexpr void store_be32(uint8_t * bytes, uint32_t value)
+{
+    bytes[0] = static_cast<uint8_t>(value >> 24);
+    bytes[1] = static_cast<uint8_t>(value >> 16);
+    bytes[2] = static_cast<uint8_t>(value >> 8);
+    bytes[3] = static_cast<uint8_t>(value);
+}
+
+// the one's complement sum (RFC 1071) of network order data, taken as big-endian 16-bit words; an odd last byte is
+// the high byte of a word padded with zero. sums of parts at even offsets can be added up before folding.
+template <typename Byte>
+[[nodiscard]] constexpr uint32_t sum_network_words(const Byte * data, size_t size)
+{
+    static_assert(sizeof(Byte) == 1, "the checksum is taken over bytes");
+    uint32_t sum = 0;
+    for (; size > 1; size -= 2, data += 2)
+    {
+        sum += (static_cast<uint32_t>(static_cast<uint8_t>(data[0])) << 8) | static_cast<uint8_t>(data[1]);
+    }
+    if (size == 1)
+    {
+        sum += static_cast<uint32_t>(static_cast<uint8_t>(data[0])) << 8;
+    }
+    return sum;
+}
+
+// folds a sum into the 16-bit checksum, store it with store_be16()
+[[nodiscard]] constexpr uint16_t fold_checksum(uint32_t sum)
+{
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+    return static_cast<uint16_t>(~sum);
+}
+
+// the first 20 bytes of an ipv4 header, the options (if any) follow it
+struct ipv4_header
+{
+    uint8_t version_ihl; // the version in the high nibble, the header length in 32-bit words in the low nibble
+    uint8_t tos;
+    uint8_t total_length[2];
+    uint8_t id[2];
+    uint8_t fragment[2];
+    uint8_t ttl;
+    uint8_t protocol;
+    uint8_t checksum[2];
+    uint8_t source[4];
+    uint8_t destination[4];
+};
+
+[[nodiscard]] constexpr size_t ipv4_header_length(const ipv4_header & header)
+{
+    return (header.version_ihl & 0x0F) * 4;
+}
+
+// an icmp header. the last 4 bytes depend on the type: the id and sequence number of an echo request or reply,
+// and the next-hop mtu of a fragmentation needed error in the last 2.
+struct icmp_header
+{
+    uint8_t type;
+    uint8_t code;
+    uint8_t checksum[2];
+    uint8_t id[2];
+    uint8_t sequence[2];
+};
+
+[[nodiscard]] constexpr uint16_t echo_id(const icmp_header & header) { return load_be16(header.id); }
+[[nodiscard]] constexpr uint16_t echo_sequence(const icmp_header & header) { return load_be16(header.sequence); }
+[[nodiscard]] constexpr uint16_t next_hop_mtu(const icmp_header & header) { return load_be16(header.sequence); }
+[[nodiscard]] constexpr uint16_t icmp_checksum(const icmp_header & header) { return load_be16(header.checksum); }
+
+// an echo request header with its checksum field zeroed, the checksum also covers the payload
+[[nodiscard]] constexpr icmp_header make_echo_header(uint8_t type, uint16_t id, uint16_t sequence)
+{
+    icmp_header header{};
+    header.type = type;
+    store_be16(header.id, id);
+    store_be16(header.sequence, sequence);
+    return header;
+}
+
+[[nodiscard]] constexpr uint32_t sum_network_words(const icmp_header & header)
+{
+    return ((header.type << 8) | header.code) + load_be16(header.checksum) + load_be16(header.id) + load_be16(header.sequence);
+}
+
+// an icmp timestamp request or reply (RFC 792): the header, followed by the time the request was sent, the time the target
+// received it and the time it sent the reply, each in milliseconds since midnight UT.
+// a time with the high bit set is not in that standard form.
+struct icmp_timestamp_message
+{
+    icmp_header header;
+    uint8_t originate[4];
+    uint8_t receive[4];
+    uint8_t transmit[4];
+};
+
+[[nodiscard]] constexpr uint32_t sum_network_words(const icmp_timestamp_message & message)
+{
+    return sum_network_words(message.header) + sum_network_words(message.originate, 4) + sum_network_words(message.receive, 4) +
+           sum_network_words(message.transmit, 4);
+}
+
+static_assert(sizeof(ipv4_header) == 20 && alignof(ipv4_header) == 1, "ipv4_header must match the wire layout");
+static_assert(offsetof(ipv4_header, ttl) == 8 && offsetof(ipv4_header, protocol) == 9 && offsetof(ipv4_header, destination) == 16,
+              "ipv4_header must match the wire layout");
+static_assert(sizeof(icmp_header) == 8 && alignof(icmp_header) == 1, "icmp_header must match the wire layout");
+static_assert(offsetof(icmp_header, checksum) == 2 && offsetof(icmp_header, id) == 4 && offsetof(icmp_header, sequence) == 6,
+              "icmp_header must match the wire layout");
+static_assert(sizeof(icmp_timestamp_message) == 20 && offsetof(icmp_timestamp_message, transmit) == 16, "icmp_timestamp_message must match the wire layout");
+static_assert(std::is_trivially_copyable_v<ipv4_header> && std::is_trivially_copyable_v<icmp_header> && std::is_trivially_copyable_v<icmp_timestamp_message>,
+              "headers are copied as raw bytes");
+
+// the encoding is checked byte by byte, which does not depend on the byte order of the host
+static_assert(make_echo_header(8, 0x1234, 0xABCD).id[0] == 0x12 && make_echo_header(8, 0x1234, 0xABCD).id[1] == 0x34);
+static_assert(echo_sequence(make_echo_header(8, 0x1234, 0xABCD)) == 0xABCD);
+static_assert(sum_network_words(make_echo_header(8, 1, 2)) == 0x0800 + 1 + 2);
+
+// the example of RFC 1071 section 3: 00 01 f2 03 f4 f5 f6 f7 sums to ddf2, so the checksum is 220d
+constexpr uint8_t rfc1071_example[] = {0x00, 0x01, 0xF2, 0x03, 0xF4, 0xF5, 0xF6, 0xF7};
+static_assert(fold_checksum(sum_network_words(rfc1071_example, sizeof(rfc1071_example))) == 0x220D);
+static_assert(fold_checksum(sum_network_words(rfc1071_example, 3)) == static_cast<uint16_t>(~(0x0001 + 0xF200)));
+
+} // namespace icmp_ns
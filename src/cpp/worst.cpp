@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "engine.h"
+#include "worst.h"
+
+namespace icmp_ns {
+
+static const uint16_t loss_steps = 200;   // half a percent
+static const uint16_t bucket_steps = 8;   // an eighth of a histogram bucket
+static const std::array<size_t, worst_metric_count> level_count = {loss_steps + 1, rtt_histogram_buckets * bucket_steps};
+
+uint16_t worst_level(const engine_target & target, worst_metric metric)
+{
+    if (metric == worst_metric::loss)
+    {
+        auto loss = std::clamp(target.loss_changes.baseline(), 0.0, 1.0);
+        return static_cast<uint16_t>(loss * loss_steps + 0.5);
+    }
+
+    const auto & histogram = target.recent_histogram;
+    uint64_t total = 0;
+    for (auto count : histogram)
+    {
+        total += count;
+    }
+    auto rank = (total * 99 + 99) / 100;
+    uint64_t below = 0;
+    for (size_t i = 0; i < rtt_histogram_buckets; ++i)
+    {
+        if (histogram[i] > 0 && below + histogram[i] >= rank)
+        {
+            auto step = (rank - below) * bucket_steps / histogram[i];
+            return static_cast<uint16_t>(i * bucket_steps + std::min<uint64_t>(step, bucket_steps - 1));
+        }
+        below += histogram[i];
+    }
+    return 0;
+}
+
+double worst_score(worst_metric metric, uint16_t level)
+{
+    if (metric == worst_metric::loss)
+    {
+        return 100.0 * level / loss_steps;
+    }
+    // the upper end of the step, bucket i holds the rtts from 2^(i-1) to 2^i us
+    auto bucket = level / bucket_steps;
+    double lower = bucket == 0 ? 0.0 : std::ldexp(1.0, bucket - 1);
+    double upper = std::ldexp(1.0, bucket);
+    return (lower + (upper - lower) * (level % bucket_steps + 1) / bucket_steps) / 1000.0;
+}
+
+worst_tracker::worst_tracker()
+{
+    for (size_t metric = 0; metric < worst_metric_count; ++metric)
+    {
+        m_levels[metric].resize(level_count[metric]);
+    }
+}
+
+bool worst_tracker::update(engine_target & target, worst_metric metric)
+{
+    return move(target, metric, worst_level(target, metric));
+}
+
+void worst_tracker::remove(engine_target & target)
+{
+    for (size_t metric = 0; metric < worst_metric_count; ++metric)
+    {
+        move(target, static_cast<worst_metric>(metric), 0);
+    }
+}
+
+bool worst_tracker::move(engine_target & target, worst_metric metric, uint16_t level)
+{
+    auto index = static_cast<size_t>(metric);
+    auto & current = target.worst_level[index];
+    if (level == current)
+    {
+        return false;
+    }
+    auto & levels = m_levels[index];
+    if (current != 0)
+    {
+        // the last target of the level takes the place of the one that leaves
+        auto & list = levels[current];
+        auto position = target.worst_position[index];
+        list[position] = list.back();
+        list[position]->worst_position[index] = position;
+        list.pop_back();
+    }
+    current = level;
+    if (level != 0)
+    {
+        target.worst_position[index] = static_cast<uint32_t>(levels[level].size());
+        levels[level].push_back(&target);
+    }
+    return true;
+}
+
+std::vector<worst_target> worst_tracker::worst(worst_metric metric, size_t count) const
+{
+    std::vector<worst_target> result;
+    const auto & levels = m_levels[static_cast<size_t>(metric)];
+    for (auto level = levels.size() - 1; level > 0 && result.size() < count; --level)
+    {
+        for (size_t i = 0; i < levels[level].size() && result.size() < count; ++i)
+        {
+            result.push_back({levels[level][i]->address, worst_score(metric, static_cast<uint16_t>(level))});
+        }
+    }
+    return result;
+}
+
+} // namespace icmp_ns
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2023 Jan Wilmans, MIT License
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace icmp_ns {
+
+struct engine_target;
+
+enum class worst_metric : uint8_t
+{
+    loss, // the recent loss, the baseline of the loss change detector
+    p99   // the 99th percentile of the recent rtts, see engine_target::recent_histogram
+};
+
+constexpr size_t worst_metric_count = 2;
+
+// one of the worst targets of an engine, the score is the loss in percent or the p99 in ms
+struct worst_target
+{
+    std::string address;
+    double score;
+};
+
+// the level of a target for a metric, a higher level is worse. the loss is ranked in steps of half a percent, the p99 in
+// eighths of a bucket of the rtt histogram, interpolated within the bucket. level 0, no loss at all, is not ranked.
+// both look at the recent past only, the loss at its decaying average and the p99 at the last few hundred replies,
+// so a target that recovered drops out of the list.
+[[nodiscard]] uint16_t worst_level(const engine_target & target, worst_metric metric);
+
+// the score of the targets at a level
+[[nodiscard]] double worst_score(worst_metric metric, uint16_t level);
+
+// the targets of an engine ordered by how bad they are, kept up to date by the probe thread as their statistics change.
+// a metric has a fixed number of levels with a list of the targets at each level; a target knows its level and position,
+// so moving it to another level is O(1), and the worst k are found by walking the levels from the top in O(k + levels)
+// without sorting or looking at the targets further down.
+class worst_tracker
+{
+public:
+    worst_tracker();
+
+    // moves the target to its current level of the metric, returns false if it already was there
+    bool update(engine_target & target, worst_metric metric);
+
+    // forgets a target that left the set
+    void remove(engine_target & target);
+
+    // at most 'count' targets, the worst first; targets at the same level are in no particular order
+    [[nodiscard]] std::vector<worst_target> worst(worst_metric metric, size_t count) const;
+
+private:
+    // moves the target to 'level' of the metric, level 0 takes it out of the lists
+    bool move(engine_target & target, worst_metric metric, uint16_t level);
+
+    std::array<std::vector<std::vector<engine_target *>>, worst_metric_count> m_levels;
+};
+
+} // namespace icmp_ns